@@ -0,0 +1,311 @@
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "cpu.h"
+#include "elfload.h"
+#include "fpu.h"
+#include "irq.h"
+#include "mem.h"
+#include "sched.h"
+#include "uart.h"
+
+#define CAPTURE_SIZE (64 << 10) /* UART output kept per job */
+
+struct image {
+	const char *path;
+	struct mem_image *mem;
+	uint32_t entry;
+	uint32_t sig_begin; /* signature region, empty if none */
+	uint32_t sig_end;
+};
+
+struct job {
+	const struct image *image;
+	int worker;
+	bool halted; /* ebreak, as opposed to hitting max_insns */
+	bool signature; /* writes the image's signature */
+	bool state; /* writes the machine's final state */
+	uint32_t pc;
+	uint32_t a0;
+	uint64_t instret;
+	double seconds;
+	size_t out_len;
+	uint32_t out_hash; /* FNV-1a of the captured output */
+};
+
+/* Each worker starts with a contiguous range of jobs. It takes them from
+   the back of its own range while idle workers steal from the front. */
+struct worker {
+	pthread_t thread;
+	int id;
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+};
+
+static const struct batch_config *config;
+static struct job *jobs;
+static struct worker *workers;
+static int n_workers;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t fnv1a(const char *buf, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t)buf[i]) * 16777619u;
+	return h;
+}
+
+static int take_own(struct worker *w) {
+	int j = -1;
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail)
+		j = __atomic_sub_fetch(&w->tail, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->lock);
+	return j;
+}
+
+static int steal(struct worker *self) {
+	for (;;) {
+		struct worker *victim = NULL;
+		int most = 0;
+		for (int i = 0; i < n_workers; ++i) {
+			struct worker *w = &workers[i];
+			int left = __atomic_load_n(&w->tail, __ATOMIC_RELAXED) -
+				__atomic_load_n(&w->head, __ATOMIC_RELAXED);
+			if (w != self && left > most) {
+				victim = w;
+				most = left;
+			}
+		}
+		if (victim == NULL)
+			return -1;
+
+		int j = -1;
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail)
+			j = __atomic_fetch_add(&victim->head, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&victim->lock);
+		if (j >= 0)
+			return j;
+		/* lost the race for the last job, look again */
+	}
+}
+
+/* <signature dir>/<image name><suffix>, opened for writing */
+static FILE *open_output(const struct job *job, const char *suffix) {
+	char *copy = strdup(job->image->path);
+	char *name = basename(copy);
+	char *dot = strrchr(name, '.');
+	if (dot && dot != name)
+		*dot = '\0';
+	char path[4096];
+	snprintf(path, sizeof path, "%s/%s%s", config->signature_dir, name,
+			suffix);
+	free(copy);
+
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		perror(path);
+	return f;
+}
+
+/* Words of the signature region of the machine the job left behind */
+static void write_signature(const struct job *job) {
+	FILE *f = open_output(job, ".signature");
+	if (f == NULL)
+		return;
+	for (uint32_t a = job->image->sig_begin; a < job->image->sig_end; a += 4) {
+		uint32_t w = 0;
+		mem_load_word(a, &w);
+		fprintf(f, "%.8x\n", w);
+	}
+	fclose(f);
+}
+
+/* pc, instret, the x and f registers and fcsr the job left behind, to
+   compare engines with */
+static void write_state(const struct job *job) {
+	FILE *f = open_output(job, ".state");
+	if (f == NULL)
+		return;
+	fprintf(f, "pc %.8x\ninstret %llu\n", M.pc,
+			(unsigned long long)M.instret);
+	for (int i = 1; i < 32; ++i)
+		fprintf(f, "x%d %.8x\n", i, M.regs[i]);
+	for (int i = 0; i < 32; ++i)
+		fprintf(f, "f%d %.8x\n", i, M.fregs[i]);
+	fprintf(f, "fcsr %.2x\n", fpu_get_fcsr());
+	fclose(f);
+}
+
+static void run_job(struct job *job, char *out) {
+	sched_init();
+	mem_init(job->image->mem);
+	irq_init();
+	uart_init_capture(config->clock_hz, config->baud, out, CAPTURE_SIZE);
+	cpu_init(config->engine, false, false, false, false, false);
+	cpu_halt_on_ebreak();
+	M.pc = job->image->entry;
+
+	double start = now();
+	while (!cpu_halted && M.instret < config->max_insns) {
+		cpu_run(config->max_insns);
+		sched_run_due();
+	}
+	job->seconds = now() - start;
+
+	job->halted = cpu_halted;
+	job->pc = M.pc;
+	job->a0 = M.regs[10];
+	job->instret = M.instret;
+	job->out_len = uart_captured();
+	job->out_hash = fnv1a(out, job->out_len < CAPTURE_SIZE ?
+			job->out_len : CAPTURE_SIZE);
+	if (job->signature)
+		write_signature(job);
+	if (job->state)
+		write_state(job);
+}
+
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	char *out = malloc(CAPTURE_SIZE);
+	if (out == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	int j;
+	while ((j = take_own(w)) >= 0 || (j = steal(w)) >= 0) {
+		jobs[j].worker = w->id;
+		run_job(&jobs[j], out);
+	}
+	free(out);
+	return NULL;
+}
+
+/* Load every distinct image once, on the calling thread */
+static struct image *load_images(char *const paths[], int n) {
+	struct image *images = calloc(n, sizeof *images);
+	if (images == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < n; ++i) {
+		images[i].path = paths[i];
+		for (int k = 0; k < i; ++k) {
+			if (strcmp(paths[k], paths[i]) == 0) {
+				images[i] = images[k];
+				break;
+			}
+		}
+		if (images[i].mem)
+			continue;
+
+		mem_init(NULL);
+		if (elf_probe(paths[i])) {
+			images[i].entry = elf_load(paths[i]);
+			const struct elf_symbol *begin =
+				elf_symbol_by_name("begin_signature");
+			const struct elf_symbol *end = elf_symbol_by_name("end_signature");
+			if (begin && end) {
+				images[i].sig_begin = begin->addr;
+				images[i].sig_end = end->addr;
+			}
+		} else {
+			mem_rom_load_flatbin(0, paths[i]); /* flat binary at reset */
+		}
+		images[i].mem = mem_image_save();
+	}
+	return images;
+}
+
+int batch_run(const struct batch_config *cfg, char *const paths[],
+		int n_images, int copies) {
+	config = cfg;
+	struct image *images = load_images(paths, n_images);
+
+	int n_jobs = n_images * copies;
+	jobs = calloc(n_jobs, sizeof *jobs);
+	if (jobs == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int j = 0; j < n_jobs; ++j) {
+		jobs[j].image = &images[j % n_images];
+		jobs[j].signature = cfg->signature_dir && j < n_images &&
+			jobs[j].image->sig_end > jobs[j].image->sig_begin;
+		jobs[j].state = cfg->signature_dir && j < n_images;
+	}
+
+	n_workers = cfg->n_workers;
+	if (n_workers <= 0)
+		n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_workers > n_jobs)
+		n_workers = n_jobs;
+	workers = calloc(n_workers, sizeof *workers);
+	if (workers == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	double start = now();
+	for (int i = 0; i < n_workers; ++i) {
+		struct worker *w = &workers[i];
+		w->id = i;
+		w->head = (int64_t)n_jobs * i / n_workers;
+		w->tail = (int64_t)n_jobs * (i + 1) / n_workers;
+		pthread_mutex_init(&w->lock, NULL);
+	}
+	for (int i = 0; i < n_workers; ++i) {
+		int err = pthread_create(&workers[i].thread, NULL, worker_main,
+				&workers[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < n_workers; ++i)
+		pthread_join(workers[i].thread, NULL);
+	double elapsed = now() - start;
+
+	int failed = 0;
+	uint64_t total = 0;
+	for (int j = 0; j < n_jobs; ++j) {
+		const struct job *job = &jobs[j];
+		bool pass = job->halted && job->a0 == 0;
+		failed += !pass;
+		total += job->instret;
+		printf("job %d: %s %s a0=%u pc=0x%.8x instret=%llu uart=%zu/%.8x "
+				"%.3fs %.1f MIPS worker %d\n",
+				j, job->image->path, job->halted ? "halted" : "limit",
+				job->a0, job->pc, (unsigned long long)job->instret,
+				job->out_len, job->out_hash, job->seconds,
+				job->seconds > 0 ? job->instret / job->seconds * 1e-6 : 0,
+				job->worker);
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%d jobs, %d failed, %d workers: %llu instructions in %.3fs, "
+			"%.1f MIPS, %ld KiB peak RSS\n", n_jobs, failed, n_workers,
+			(unsigned long long)total, elapsed,
+			elapsed > 0 ? total / elapsed * 1e-6 : 0, usage.ru_maxrss);
+	return failed;
+}
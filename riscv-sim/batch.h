@@ -0,0 +1,34 @@
+#ifndef RVSIM_BATCH_H
+#define RVSIM_BATCH_H 1
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/* Batch mode: run many independent machines on a pool of worker threads.
+   Every image is loaded once and its read-only memory is shared by all
+   jobs started from it. A job runs headless (UART output is captured)
+   until the guest executes ebreak or max_insns instructions have been
+   retired. Idle workers steal jobs from the busiest one. */
+
+struct batch_config {
+	enum cpu_engine engine;
+	uint64_t clock_hz; /* UART timing only, jobs are never paced */
+	uint32_t baud;
+	uint64_t max_insns; /* per job */
+	int n_workers; /* 0 = one per online CPU */
+	const char *signature_dir; /* NULL for none, see batch_run() */
+};
+
+/* Run copies jobs of each image, then print one result line per job and
+   the aggregate instruction rate and peak resident set size. With a signature directory, the first
+   job of each image that has begin_signature and end_signature symbols
+   writes the words in between to <dir>/<image name>.signature, one hex
+   word per line, as the RISC-V architectural tests expect. The first job
+   of every image also writes its final pc, instret and registers to
+   <dir>/<image name>.state.
+   RETURN VALUE: number of jobs that did not halt with a0 == 0 */
+extern int batch_run(const struct batch_config *cfg, char *const images[],
+		int n_images, int copies);
+
+#endif /* RVSIM_BATCH_H */
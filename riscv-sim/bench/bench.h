@@ -0,0 +1,41 @@
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Common to the benchmarks. Each one is a freestanding main() that
+   returns 0 if its results check out; start.S hands the value to ebreak
+   in a0, which ends riscv-sim -j and -x. Output goes to the UART.
+   Built with the flags of the firmware in test/ and -O2. */
+
+/* External SDRAM, for buffers that do not fit into internal RAM */
+#define BENCH_SDRAM ((uint8_t *)0x10000000)
+
+/* Core clock cycles since reset, low 32 bits */
+static inline uint32_t bench_cycles(void) {
+	uint32_t c;
+	__asm__ volatile ("rdcycle %0" : "=r" (c));
+	return c;
+}
+
+/* Stop with a result code, as if main() returned it */
+extern void bench_exit(int code) __attribute__((noreturn));
+
+extern void bench_puts(const char *s);
+extern void bench_put_dec(uint32_t v);
+extern void bench_put_hex(uint32_t v);
+
+/* Print "name: <cycles> cycles, result <hex> (expected <hex>)" and
+   RETURN VALUE: 0 if result is the expected one, 1 otherwise */
+extern int bench_report(const char *name, uint32_t cycles, uint32_t result,
+		uint32_t expected);
+
+/* The compiler may emit calls to these even when freestanding */
+extern void *memcpy(void *dst, const void *src, size_t n);
+extern void *memset(void *dst, int c, size_t n);
+extern int memcmp(const void *a, const void *b, size_t n);
+extern char *strcpy(char *dst, const char *src);
+extern int strcmp(const char *a, const char *b);
+
+#endif /* BENCH_BENCH_H */
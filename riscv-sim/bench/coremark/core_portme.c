@@ -0,0 +1,161 @@
+#include <stdarg.h>
+
+#include "coremark.h"
+#include "../bench.h"
+#include "../../test/uart.h"
+
+/* Clock of the FPGA design, as riscv-sim assumes by default */
+#define EE_TICKS_PER_SEC 50000000
+
+#if VALIDATION_RUN
+volatile ee_s32 seed1_volatile = 0x3415;
+volatile ee_s32 seed2_volatile = 0x3415;
+volatile ee_s32 seed3_volatile = 0x66;
+#endif
+#if PERFORMANCE_RUN
+volatile ee_s32 seed1_volatile = 0x0;
+volatile ee_s32 seed2_volatile = 0x0;
+volatile ee_s32 seed3_volatile = 0x66;
+#endif
+#if PROFILE_RUN
+volatile ee_s32 seed1_volatile = 0x8;
+volatile ee_s32 seed2_volatile = 0x8;
+volatile ee_s32 seed3_volatile = 0x8;
+#endif
+volatile ee_s32 seed4_volatile = ITERATIONS;
+volatile ee_s32 seed5_volatile = 0;
+
+ee_u32 default_num_contexts = 1;
+
+static CORETIMETYPE start_time_val, stop_time_val;
+
+void start_time(void) {
+	start_time_val = bench_cycles();
+}
+
+void stop_time(void) {
+	stop_time_val = bench_cycles();
+}
+
+CORE_TICKS get_time(void) {
+	return stop_time_val - start_time_val;
+}
+
+secs_ret time_in_secs(CORE_TICKS ticks) {
+	return (secs_ret)ticks / (secs_ret)EE_TICKS_PER_SEC;
+}
+
+/* CoreMark reports a wrong CRC as "[<context>]ERROR! ...", and it always
+   finds errors in runs shorter than the 10 seconds its rules require, so
+   the result code comes from the former only */
+static const char crc_error[] = "]ERROR!";
+static int matched;
+static int failed;
+
+static void put_char(char c) {
+	if (c == crc_error[matched])
+		matched++;
+	else
+		matched = c == crc_error[0];
+	if (crc_error[matched] == '\0') {
+		failed = 1;
+		matched = 0;
+	}
+	if (c == '\n')
+		uart_write('\r');
+	uart_write(c);
+}
+
+static void put_padded(const char *s, int len, int width, char pad,
+		int left) {
+	for (; !left && width > len; --width)
+		put_char(pad);
+	for (int i = 0; i < len; ++i)
+		put_char(s[i]);
+	for (; left && width > len; --width)
+		put_char(' ');
+}
+
+/* The conversions CoreMark uses: %[-][0][width][l](c|d|i|u|x|s|%) */
+int ee_printf(const char *fmt, ...) {
+	va_list ap;
+	char buf[12];
+
+	va_start(ap, fmt);
+	for (; *fmt; ++fmt) {
+		if (*fmt != '%') {
+			put_char(*fmt);
+			continue;
+		}
+		int left = 0, width = 0;
+		char pad = ' ';
+		if (*++fmt == '-') {
+			left = 1;
+			++fmt;
+		}
+		if (*fmt == '0') {
+			pad = '0';
+			++fmt;
+		}
+		for (; *fmt >= '0' && *fmt <= '9'; ++fmt)
+			width = width * 10 + *fmt - '0';
+		if (*fmt == 'l')
+			++fmt;
+
+		const char *s = buf;
+		int len = 0;
+		unsigned int v, base = 10;
+		switch (*fmt) {
+		case 'c':
+			buf[len++] = va_arg(ap, int);
+			break;
+		case 's':
+			s = va_arg(ap, const char *);
+			while (s[len])
+				len++;
+			break;
+		case 'd':
+		case 'i':
+			v = va_arg(ap, int);
+			if ((int)v < 0) {
+				put_char('-');
+				v = -v;
+				width--;
+			}
+			goto number;
+		case 'x':
+			base = 16;
+			/* fall through */
+		case 'u':
+			v = va_arg(ap, unsigned int);
+		number:
+			len = sizeof buf;
+			do {
+				buf[--len] = "0123456789abcdef"[v % base];
+				v /= base;
+			} while (v);
+			s = buf + len;
+			len = sizeof buf - len;
+			break;
+		case '\0':
+			--fmt;
+			break;
+		default:
+			buf[len++] = *fmt;
+			break;
+		}
+		put_padded(s, len, width, pad, left);
+	}
+	va_end(ap);
+	return 0;
+}
+
+void portable_init(core_portable *p, int *argc, char *argv[]) {
+	p->portable_id = 1;
+}
+
+/* main() returns 0 regardless */
+void portable_fini(core_portable *p) {
+	p->portable_id = 0;
+	bench_exit(failed);
+}
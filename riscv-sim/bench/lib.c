@@ -0,0 +1,93 @@
+#include "bench.h"
+#include "../test/uart.h"
+
+/* Built with -fno-tree-loop-distribute-patterns, so that these loops do
+   not turn into calls to themselves */
+
+void *memcpy(void *dst, const void *src, size_t n) {
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	if ((((uintptr_t)d | (uintptr_t)s) & 3) == 0) {
+		for (; n >= 4; n -= 4, d += 4, s += 4)
+			*(uint32_t *)d = *(const uint32_t *)s;
+	}
+	while (n--)
+		*d++ = *s++;
+	return dst;
+}
+
+void *memset(void *dst, int c, size_t n) {
+	uint8_t *d = dst;
+	while (n--)
+		*d++ = c;
+	return dst;
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+	const uint8_t *x = a, *y = b;
+	for (; n; --n, ++x, ++y) {
+		if (*x != *y)
+			return *x - *y;
+	}
+	return 0;
+}
+
+char *strcpy(char *dst, const char *src) {
+	char *d = dst;
+	while ((*d++ = *src++) != '\0')
+		;
+	return dst;
+}
+
+int strcmp(const char *a, const char *b) {
+	while (*a && *a == *b)
+		a++, b++;
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
+void bench_puts(const char *s) {
+	while (*s)
+		uart_write(*s++);
+}
+
+/* Without dividing, which rv32i would leave to libgcc */
+void bench_put_dec(uint32_t v) {
+	static const uint32_t powers[] = {
+		1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000,
+		100, 10, 1,
+	};
+	int started = 0;
+	for (int i = 0; i < 10; ++i) {
+		char digit = '0';
+		while (v >= powers[i]) {
+			v -= powers[i];
+			digit++;
+		}
+		if (digit != '0' || started || i == 9) {
+			uart_write(digit);
+			started = 1;
+		}
+	}
+}
+
+void bench_put_hex(uint32_t v) {
+	for (int i = 28; i >= 0; i -= 4)
+		uart_write("0123456789abcdef"[(v >> i) & 0xf]);
+}
+
+int bench_report(const char *name, uint32_t cycles, uint32_t result,
+		uint32_t expected) {
+	bench_puts(name);
+	bench_puts(": ");
+	bench_put_dec(cycles);
+	bench_puts(" cycles, result ");
+	bench_put_hex(result);
+	if (result != expected) {
+		bench_puts(" (expected ");
+		bench_put_hex(expected);
+		bench_puts(") FAILED\r\n");
+		return 1;
+	}
+	bench_puts(" OK\r\n");
+	return 0;
+}
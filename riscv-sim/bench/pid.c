@@ -0,0 +1,140 @@
+/* Attitude control loop of a quadcopter in Q16.16 fixed point, the kind
+   of code the flight controller runs: a complementary filter estimates
+   roll, pitch and yaw from noisy gyro and accelerometer readings, a
+   cascade of an angle P and a rate PID controller per axis computes the
+   torques, and an X mixer turns them into four motor commands. A simple
+   rigid body model closes the loop. The result is a hash of the motor
+   commands, checked against the one from the same code on the host. */
+
+#include "bench.h"
+
+#define STEPS 100000
+#define EXPECTED 0x55310f80
+
+typedef int32_t fix; /* Q16.16 */
+
+#define FIX(x) ((fix)((x) * 65536.0))
+
+static fix mul(fix a, fix b) {
+	return (fix)(((int64_t)a * b) >> 16);
+}
+
+static fix clamp(fix v, fix lo, fix hi) {
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* Sensor noise of +-amplitude/2, from xorshift32 */
+static uint32_t seed = 0x12345678;
+
+static fix noise(fix amplitude) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return mul((fix)(seed & 0xffff) - FIX(0.5), amplitude);
+}
+
+struct pid {
+	fix kp, ki, kd;
+	fix integral, limit;
+	fix last; /* measurement, for the derivative */
+};
+
+/* Derivative on the measurement, so that setpoint steps do not kick */
+static fix pid_step(struct pid *p, fix setpoint, fix measured, fix dt) {
+	fix error = setpoint - measured;
+	p->integral = clamp(p->integral + mul(error, dt), -p->limit, p->limit);
+	fix derivative = mul(p->last - measured, FIX(1.0 / 0.002));
+	p->last = measured;
+	return mul(p->kp, error) + mul(p->ki, p->integral) +
+			mul(p->kd, derivative);
+}
+
+struct axis {
+	fix angle, rate; /* of the model */
+	fix estimate; /* of the filter */
+	fix angle_kp;
+	struct pid rate_pid;
+	fix inertia_inv;
+};
+
+static struct axis axes[3];
+
+static void init(void) {
+	for (int i = 0; i < 3; ++i) {
+		struct axis *a = &axes[i];
+		a->angle = 0;
+		a->rate = 0;
+		a->estimate = 0;
+		a->angle_kp = i == 2 ? FIX(2.0) : FIX(4.5);
+		a->rate_pid.kp = i == 2 ? FIX(0.3) : FIX(0.15);
+		a->rate_pid.ki = i == 2 ? FIX(0.05) : FIX(0.1);
+		a->rate_pid.kd = i == 2 ? 0 : FIX(0.003);
+		a->rate_pid.integral = 0;
+		a->rate_pid.limit = FIX(0.3);
+		a->rate_pid.last = 0;
+		a->inertia_inv = i == 2 ? FIX(20.0) : FIX(40.0);
+	}
+}
+
+/* Setpoints in radians, changing every 0.5 s of simulated time */
+static fix setpoint(int axis, int step) {
+	static const fix steps[8] = {
+		FIX(0.0), FIX(0.2), FIX(-0.2), FIX(0.1),
+		FIX(0.35), FIX(-0.05), FIX(0.0), FIX(-0.3),
+	};
+	return steps[((step / 250) + axis * 3) & 7];
+}
+
+int main(void) {
+	const fix dt = FIX(0.002); /* 500 Hz */
+	const fix alpha = FIX(0.98);
+	const fix throttle = FIX(0.5);
+	uint32_t hash = 0;
+	uint32_t start;
+
+	init();
+	start = bench_cycles();
+	for (int step = 0; step < STEPS; ++step) {
+		fix torque[3], motor[4];
+
+		for (int i = 0; i < 3; ++i) {
+			struct axis *a = &axes[i];
+			fix gyro = a->rate + noise(FIX(0.05));
+			fix accel = a->angle + noise(FIX(0.2));
+			a->estimate = mul(alpha, a->estimate + mul(gyro, dt)) +
+					mul(FIX(1.0) - alpha, accel);
+			fix rate_setpoint = mul(a->angle_kp,
+					setpoint(i, step) - a->estimate);
+			rate_setpoint = clamp(rate_setpoint, FIX(-4.0), FIX(4.0));
+			torque[i] = clamp(pid_step(&a->rate_pid, rate_setpoint, gyro,
+					dt), FIX(-0.5), FIX(0.5));
+		}
+
+		/* X configuration: front left, front right, rear right, rear
+		   left; yaw from the propellers spinning in turn */
+		motor[0] = throttle + torque[0] + torque[1] - torque[2];
+		motor[1] = throttle - torque[0] + torque[1] + torque[2];
+		motor[2] = throttle - torque[0] - torque[1] - torque[2];
+		motor[3] = throttle + torque[0] - torque[1] + torque[2];
+		for (int m = 0; m < 4; ++m) {
+			motor[m] = clamp(motor[m], 0, FIX(1.0));
+			hash = ((hash << 5) | (hash >> 27)) ^ (uint32_t)motor[m];
+		}
+
+		/* The model, from the torques the saturated motors deliver */
+		fix roll = (motor[0] + motor[3] - motor[1] - motor[2]) / 4;
+		fix pitch = (motor[0] + motor[1] - motor[2] - motor[3]) / 4;
+		fix yaw = (motor[1] + motor[3] - motor[0] - motor[2]) / 4;
+		fix applied[3] = { roll, pitch, yaw };
+		for (int i = 0; i < 3; ++i) {
+			struct axis *a = &axes[i];
+			fix accel = mul(applied[i], a->inertia_inv) -
+					mul(a->rate, FIX(0.5));
+			a->rate += mul(accel, dt);
+			a->angle += mul(a->rate, dt);
+		}
+	}
+	start = bench_cycles() - start;
+
+	return bench_report("pid", start, hash, EXPECTED);
+}
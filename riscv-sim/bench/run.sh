@@ -0,0 +1,72 @@
+#!/bin/sh
+# Runs the firmware benchmarks on every engine, from the riscv-sim
+# directory by make bench.
+#
+#   bench/run.sh bench.elf...
+#
+# Prints one JSON object per benchmark and engine, for instance
+#
+#   {"bench": "dhrystone", "engine": "jit", "result": 0, "instructions":
+#    95100123, "seconds": 0.2130, "ns_per_insn": 2.24, "mips": 446.5,
+#    "peak_rss_kib": 10240}
+#
+# on a single line. result is a0 at the final ebreak, 0 if the benchmark
+# checked its results, or "limit" if it ran into MAX_INSNS. The rates
+# come from the time the job spent running, without the setup of its
+# machine, and are the best of BENCH_RUNS runs; peak_rss_kib is the
+# largest of the simulator processes. Fails if any benchmark did.
+
+SIM=./riscv-sim
+ENGINES="interp threaded jit"
+MAX_INSNS=${MAX_INSNS:-2000000000}
+BENCH_RUNS=${BENCH_RUNS:-3}
+
+if [ $# -eq 0 ]; then
+	echo "run.sh: no benchmarks" >&2
+	exit 1
+fi
+
+failed=0
+for b in "$@"; do
+	name=$(basename "$b" .elf)
+	for e in $ENGINES; do
+		r=0
+		while [ $r -lt $BENCH_RUNS ]; do
+			$SIM -j 1 -e $e -n $MAX_INSNS "$b"
+			r=$((r + 1))
+		done | awk -v bench="$name" -v engine=$e '
+			/^job / {
+				for (i = 1; i <= NF; ++i) {
+					if ($i ~ /^a0=/)
+						result = substr($i, 4)
+					if ($i ~ /^instret=/)
+						insns = substr($i, 9)
+					if ($(i + 1) == "MIPS")
+						mips = $i + 0
+				}
+				if ($4 != "halted")
+					result = "\"limit\""
+				if (mips > best)
+					best = mips
+			}
+			/ peak RSS$/ {
+				if ($(NF - 3) > rss)
+					rss = $(NF - 3)
+			}
+			END {
+				fmt = "{\"bench\": \"%s\", \"engine\": \"%s\", "
+				fmt = fmt "\"result\": %s, \"instructions\": %d, "
+				fmt = fmt "\"seconds\": %.4f, \"ns_per_insn\": %.2f, "
+				fmt = fmt "\"mips\": %.1f, \"peak_rss_kib\": %d}\n"
+				printf fmt, bench, engine, result, insns,
+					(best > 0 ? insns / best * 1e-6 : 0),
+					(best > 0 ? 1e3 / best : 0), best, rss
+				exit result != "0"
+			}' || failed=$((failed + 1))
+	done
+done
+
+if [ $failed -ne 0 ]; then
+	echo "$failed failures" >&2
+	exit 1
+fi
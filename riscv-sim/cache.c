@@ -0,0 +1,319 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "elfload.h"
+#include "mem.h"
+#include "prof.h"
+
+#define CACHE_MAX_REGIONS 8 /* more than mem.c has */
+#define CACHE_INVALID 0xffffffff /* never a line number, lines are >= 4 bytes */
+#define CACHE_N_FUNCS 20 /* functions listed in the report */
+
+struct cache_stats {
+	uint64_t access;
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t evict;
+	uint64_t writeback;
+	uint64_t uncached;
+};
+
+/* Misses per instruction of ROM and RAM, by halfword like prof.h */
+struct pc_stats {
+	uint64_t access;
+	uint64_t miss;
+};
+
+/* Line i of set s is slot s * ways + i in each of the arrays. stamp is
+   the time of the last use for LRU and of the fill for FIFO, both
+   replace the smallest one. */
+struct cache {
+	struct cache_config cfg;
+	const char *name;
+	int line_bits;
+	uint32_t set_mask;
+	uint32_t *tag; /* line number, CACHE_INVALID if empty */
+	uint32_t *stamp;
+	uint8_t *region; /* of the line, for the statistics of evictions */
+	uint8_t *dirty;
+	uint32_t clock;
+	uint32_t rng; /* xorshift32 for CACHE_RANDOM */
+	struct cache_stats region_stats[CACHE_MAX_REGIONS + 1]; /* + unmapped */
+	struct pc_stats *pc_stats;
+};
+
+static struct cache icache = { .name = "I-cache" };
+static struct cache dcache = { .name = "D-cache" };
+
+static int log2u(uint32_t v) {
+	int n = 0;
+	while (v >>= 1)
+		n++;
+	return n;
+}
+
+static bool pow2(uint32_t v) {
+	return v && !(v & (v - 1));
+}
+
+bool cache_parse(const char *spec, struct cache_config *cfg) {
+	char *end;
+	cfg->size = strtoul(spec, &end, 0);
+	if (*end == 'K' || *end == 'k')
+		cfg->size <<= 10, end++;
+	else if (*end == 'M' || *end == 'm')
+		cfg->size <<= 20, end++;
+	if (*end++ != ':')
+		return false;
+	cfg->ways = strtoul(end, &end, 0);
+	if (*end++ != ':')
+		return false;
+	cfg->line = strtoul(end, &end, 0);
+
+	cfg->policy = CACHE_LRU;
+	if (*end == ':') {
+		end++;
+		if (strcmp(end, "lru") == 0)
+			cfg->policy = CACHE_LRU;
+		else if (strcmp(end, "fifo") == 0)
+			cfg->policy = CACHE_FIFO;
+		else if (strcmp(end, "random") == 0)
+			cfg->policy = CACHE_RANDOM;
+		else
+			return false;
+	} else if (*end != '\0') {
+		return false;
+	}
+
+	return pow2(cfg->size) && pow2(cfg->ways) && pow2(cfg->line) &&
+		cfg->line >= 4 && cfg->size >= cfg->ways * cfg->line;
+}
+
+static void *alloc(size_t n, size_t size) {
+	void *p = calloc(n, size);
+	if (p == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void setup(struct cache *c, const struct cache_config *cfg) {
+	if (cfg == NULL || cfg->size == 0)
+		return;
+	uint32_t n_lines = cfg->size / cfg->line;
+
+	c->cfg = *cfg;
+	c->line_bits = log2u(cfg->line);
+	c->set_mask = n_lines / cfg->ways - 1;
+	c->tag = alloc(n_lines, sizeof *c->tag);
+	c->stamp = alloc(n_lines, sizeof *c->stamp);
+	c->region = alloc(n_lines, sizeof *c->region);
+	c->dirty = alloc(n_lines, sizeof *c->dirty);
+	memset(c->tag, 0xff, n_lines * sizeof *c->tag);
+	c->rng = 2463534242u;
+	c->pc_stats = alloc(PROF_SPAN / 2, sizeof *c->pc_stats);
+}
+
+void cache_init(const struct cache_config *i, const struct cache_config *d) {
+	setup(&icache, i);
+	setup(&dcache, d);
+}
+
+static int region_of(uint32_t addr, bool *backed) {
+	int r = mem_region_at(addr);
+	if (r < 0 || r >= CACHE_MAX_REGIONS) {
+		*backed = false;
+		return CACHE_MAX_REGIONS;
+	}
+	mem_region_info(r, backed);
+	return r;
+}
+
+static void miss(struct cache *c, uint32_t *tag, uint32_t line, int region,
+		bool store) {
+	uint32_t set = tag - c->tag;
+	int w = -1;
+	for (int i = 0; i < c->cfg.ways; ++i) { /* empty ways first */
+		if (tag[i] == CACHE_INVALID) {
+			w = i;
+			break;
+		}
+	}
+
+	if (w < 0) {
+		w = 0;
+		if (c->cfg.policy == CACHE_RANDOM) {
+			c->rng ^= c->rng << 13;
+			c->rng ^= c->rng >> 17;
+			c->rng ^= c->rng << 5;
+			w = c->rng & (c->cfg.ways - 1);
+		} else {
+			for (int i = 1; i < c->cfg.ways; ++i) {
+				if (c->stamp[set + i] < c->stamp[set + w])
+					w = i;
+			}
+		}
+
+		struct cache_stats *victim = &c->region_stats[c->region[set + w]];
+		victim->evict++;
+		if (c->dirty[set + w])
+			victim->writeback++;
+	}
+
+	tag[w] = line;
+	c->stamp[set + w] = c->clock;
+	c->region[set + w] = region;
+	c->dirty[set + w] = store;
+}
+
+static void lookup(struct cache *c, uint32_t pc, uint32_t addr, bool store) {
+	bool backed;
+	int region = region_of(addr, &backed);
+	struct cache_stats *s = &c->region_stats[region];
+	if (!backed) {
+		s->uncached++;
+		return;
+	}
+
+	struct pc_stats *p = pc < PROF_SPAN ? &c->pc_stats[pc >> 1] : NULL;
+	uint32_t line = addr >> c->line_bits;
+	uint32_t *tag = &c->tag[(line & c->set_mask) * c->cfg.ways];
+	s->access++;
+	if (p)
+		p->access++;
+	c->clock++;
+
+	for (int i = 0; i < c->cfg.ways; ++i) {
+		if (tag[i] == line) {
+			uint32_t slot = tag - c->tag + i;
+			if (c->cfg.policy == CACHE_LRU)
+				c->stamp[slot] = c->clock;
+			c->dirty[slot] |= store;
+			s->hit++;
+			return;
+		}
+	}
+
+	s->miss++;
+	if (p)
+		p->miss++;
+	miss(c, tag, line, region, store);
+}
+
+void cache_fetch(uint32_t pc) {
+	if (icache.tag)
+		lookup(&icache, pc, pc, false);
+}
+
+void cache_data(uint32_t pc, uint32_t addr, bool store) {
+	if (dcache.tag)
+		lookup(&dcache, pc, addr, store);
+}
+
+static double percent(uint64_t n, uint64_t total) {
+	return total ? 100.0 * n / total : 0;
+}
+
+static const char *const policy_names[] = {
+	[CACHE_LRU] = "lru",
+	[CACHE_FIFO] = "fifo",
+	[CACHE_RANDOM] = "random",
+};
+
+static void report_regions(FILE *f, const struct cache *c) {
+	fprintf(f, "%-16s %14s %14s %14s %8s %12s %12s %12s\n", "region",
+			"accesses", "hits", "misses", "miss%", "evictions",
+			"writebacks", "uncached");
+	for (int i = 0; i <= CACHE_MAX_REGIONS; ++i) {
+		const struct cache_stats *s = &c->region_stats[i];
+		if (s->access == 0 && s->evict == 0 && s->uncached == 0)
+			continue;
+		bool backed;
+		const char *name = i < CACHE_MAX_REGIONS ?
+			mem_region_info(i, &backed) : "(unmapped)";
+		fprintf(f, "%-16s %14llu %14llu %14llu %8.2f %12llu %12llu %12llu\n",
+				name, (unsigned long long)s->access,
+				(unsigned long long)s->hit, (unsigned long long)s->miss,
+				percent(s->miss, s->access), (unsigned long long)s->evict,
+				(unsigned long long)s->writeback,
+				(unsigned long long)s->uncached);
+	}
+}
+
+struct func_stats {
+	const struct elf_symbol *sym;
+	struct pc_stats i;
+	struct pc_stats d;
+};
+
+static int cmp_func(const void *a, const void *b) {
+	const struct func_stats *x = a, *y = b;
+	uint64_t mx = x->i.miss + x->d.miss, my = y->i.miss + y->d.miss;
+	return (mx < my) - (mx > my);
+}
+
+/* Misses per function, by the symbol of the instruction's pc. Code before
+   the first symbol goes under the last entry. */
+static void report_functions(FILE *f) {
+	struct func_stats *funcs = alloc(elf_n_symbols + 1, sizeof *funcs);
+	for (size_t i = 0; i < elf_n_symbols; ++i)
+		funcs[i].sym = &elf_symbols[i];
+
+	for (uint32_t pc = 0; pc < PROF_SPAN; pc += 2) {
+		const struct pc_stats *i = icache.tag ? &icache.pc_stats[pc >> 1] : NULL;
+		const struct pc_stats *d = dcache.tag ? &dcache.pc_stats[pc >> 1] : NULL;
+		if ((i == NULL || i->access == 0) && (d == NULL || d->access == 0))
+			continue;
+		const struct elf_symbol *s = elf_symbol_at(pc);
+		struct func_stats *fs = &funcs[s ? s - elf_symbols : elf_n_symbols];
+		if (i) {
+			fs->i.access += i->access;
+			fs->i.miss += i->miss;
+		}
+		if (d) {
+			fs->d.access += d->access;
+			fs->d.miss += d->miss;
+		}
+	}
+	qsort(funcs, elf_n_symbols + 1, sizeof *funcs, cmp_func);
+
+	fprintf(f, "%14s %14s %8s %14s %14s %8s  %s\n", "fetches", "I-misses",
+			"miss%", "data", "D-misses", "miss%", "function");
+	for (size_t i = 0; i <= elf_n_symbols && i < CACHE_N_FUNCS; ++i) {
+		const struct func_stats *fs = &funcs[i];
+		if (fs->i.access == 0 && fs->d.access == 0)
+			break;
+		fprintf(f, "%14llu %14llu %8.2f %14llu %14llu %8.2f  %s\n",
+				(unsigned long long)fs->i.access,
+				(unsigned long long)fs->i.miss,
+				percent(fs->i.miss, fs->i.access),
+				(unsigned long long)fs->d.access,
+				(unsigned long long)fs->d.miss,
+				percent(fs->d.miss, fs->d.access),
+				fs->sym ? fs->sym->name : "(no symbol)");
+	}
+	free(funcs);
+}
+
+void cache_report(FILE *f) {
+	const struct cache *caches[] = { &icache, &dcache };
+	for (int i = 0; i < 2; ++i) {
+		const struct cache *c = caches[i];
+		if (c->tag == NULL)
+			continue;
+		fprintf(f, "%s: %u bytes, %u-way, %u byte lines, %s\n", c->name,
+				c->cfg.size, c->cfg.ways, c->cfg.line,
+				policy_names[c->cfg.policy]);
+		report_regions(f, c);
+		fprintf(f, "\n");
+	}
+	if (icache.tag || dcache.tag) {
+		fprintf(f, "Misses per function (ROM and RAM code):\n");
+		report_functions(f);
+	}
+}
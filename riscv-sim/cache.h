@@ -0,0 +1,44 @@
+#ifndef RVSIM_CACHE_H
+#define RVSIM_CACHE_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Cache model for the FPGA core, driven by the cache variant of the
+   interpreter. The instruction and data caches are set associative,
+   write-back and write-allocate. Accesses to memory that is not backed
+   (devices) bypass the cache and are counted as uncached. Statistics are
+   kept per memory region and per instruction word of internal ROM and
+   RAM, for a report per function. The model only counts: it does not
+   change timing. */
+
+enum cache_policy {
+	CACHE_LRU,
+	CACHE_FIFO,
+	CACHE_RANDOM,
+};
+
+struct cache_config {
+	uint32_t size; /* bytes, 0 if the cache is not modeled */
+	uint32_t ways;
+	uint32_t line; /* bytes */
+	enum cache_policy policy;
+};
+
+/* Parse "size:ways:line[:lru|fifo|random]", size in bytes with an
+   optional K or M suffix. All three numbers must be powers of two.
+   RETURN VALUE: true if spec is valid */
+extern bool cache_parse(const char *spec, struct cache_config *cfg);
+
+extern void cache_init(const struct cache_config *icache,
+		const struct cache_config *dcache);
+
+/* Instruction fetch at pc; load or store by the instruction at pc */
+extern void cache_fetch(uint32_t pc);
+extern void cache_data(uint32_t pc, uint32_t addr, bool store);
+
+/* Hits, misses and evictions per region and per function */
+extern void cache_report(FILE *f);
+
+#endif /* RVSIM_CACHE_H */
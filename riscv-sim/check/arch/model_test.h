@@ -0,0 +1,42 @@
+#ifndef RVSIM_MODEL_TEST_H
+#define RVSIM_MODEL_TEST_H 1
+
+/* Target model of riscv-sim for the RISC-V architectural tests
+   (riscv-arch-test), see check/check.sh. A test ends with ebreak, which
+   halts riscv-sim -j and -x with a0 == 0; batch mode then writes out the
+   words between begin_signature and end_signature (-W). */
+
+#define RVMODEL_DATA_SECTION
+
+#define RVMODEL_BOOT
+
+#define RVMODEL_HALT \
+	li a0, 0; \
+	ebreak; \
+1:	j 1b;
+
+#define RVMODEL_DATA_BEGIN \
+	RVMODEL_DATA_SECTION \
+	.align 4; \
+	.global begin_signature; \
+begin_signature:
+
+#define RVMODEL_DATA_END \
+	.align 4; \
+	.global end_signature; \
+end_signature:
+
+/* No output: the signature is compared */
+#define RVMODEL_IO_INIT
+#define RVMODEL_IO_WRITE_STR(_R, _STR)
+#define RVMODEL_IO_CHECK()
+#define RVMODEL_IO_ASSERT_GPR_EQ(_S, _R, _I)
+#define RVMODEL_IO_ASSERT_SFPR_EQ(_F, _R, _I)
+#define RVMODEL_IO_ASSERT_DFPR_EQ(_D, _R, _I)
+
+#define RVMODEL_SET_MSW_INT
+#define RVMODEL_CLEAR_MSW_INT
+#define RVMODEL_CLEAR_MTIMER_INT
+#define RVMODEL_CLEAR_MEXT_INT
+
+#endif /* RVSIM_MODEL_TEST_H */
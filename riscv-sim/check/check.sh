@@ -0,0 +1,232 @@
+#!/bin/sh
+# Regression checks over the RISC-V architectural tests, run from the
+# riscv-sim directory by make check, make golden and make perf-baseline.
+#
+#   check/check.sh check|golden|baseline referenceDirs test.elf...
+#
+# check     fails if, for any test,
+#           - the signature written by any engine differs from the
+#             reference signature in one of the colon separated
+#             referenceDirs,
+#           - the final state (pc, instret and registers) or the signature
+#             of the threaded engine or the JIT differs from the
+#             interpreter's,
+#           - the instruction trace of the interpreter differs from the
+#             golden trace in check/golden, or a regression test of
+#             check/regress has none,
+#           - or the instruction rate of an engine fell by more than
+#             PERF_THRESHOLD percent below check/perf-baseline.
+# golden    records the golden traces from the current build, to be
+#           committed with the tests they belong to
+# baseline  records the instruction rates of the current build
+#
+# Traces are the output of riscv-trace. The golden traces of the
+# riscv-arch-test tests hold for the revision of the RISCV_ARCH_TEST
+# checkout they were recorded from, which golden writes to
+# check/golden/arch-test-revision: check compares them only with the
+# tests of that revision, and skips them with a notice otherwise. To move
+# to another revision, check it out, run make golden and commit check/golden.
+#
+# Instruction rates are measured on PERF_COPIES copies of each test run by
+# a single worker, from the time each job spent running, without the setup
+# of its machine. The best of PERF_RUNS runs counts. The baseline is only
+# meaningful on the host that recorded it.
+
+SIM=./riscv-sim
+DECODE=./riscv-trace
+GOLDEN=check/golden
+GOLDEN_REVISION=$GOLDEN/arch-test-revision
+REGRESS=check/regress
+BASELINE=check/perf-baseline
+OUT=check/build/out
+ENGINES="interp threaded jit"
+MAX_INSNS=10000000
+PERF_THRESHOLD=${PERF_THRESHOLD:-10}
+PERF_COPIES=${PERF_COPIES:-100}
+PERF_RUNS=${PERF_RUNS:-3}
+
+mode=$1
+refs=$2
+shift 2
+if [ $# -eq 0 ]; then
+	echo "check.sh: no tests, set RISCV_ARCH_TEST in the Makefile" >&2
+	exit 1
+fi
+
+failed=0
+fail() {
+	echo "FAIL $*"
+	failed=$((failed + 1))
+}
+
+name() {
+	basename "$1" .elf
+}
+
+# Reference signature of test $1
+reference() {
+	echo "$refs" | tr : '\n' | while read -r d; do
+		if [ -f "$d/$1.reference_output" ]; then
+			echo "$d/$1.reference_output"
+			break
+		fi
+	done
+}
+
+mkdir -p "$OUT" "$GOLDEN"
+
+# Signatures, on every engine
+signatures() {
+	for e in $ENGINES; do
+		rm -rf "$OUT/$e"
+		mkdir -p "$OUT/$e"
+		$SIM -j 0 -e $e -n $MAX_INSNS -W "$OUT/$e" "$@" > "$OUT/$e.log" ||
+			fail "$e: not every test halted with a0 == 0, see $OUT/$e.log"
+		for t in "$@"; do
+			n=$(name "$t")
+			cmp -s "$OUT/$e/$n.signature" "$(reference "$n")" ||
+				fail "$e: $n: signature"
+		done
+	done
+
+	# the other engines must end where the interpreter does
+	for t in "$@"; do
+		n=$(name "$t")
+		for e in $ENGINES; do
+			[ $e = interp ] && continue
+			for s in state signature; do
+				[ -f "$OUT/interp/$n.$s" ] || continue
+				cmp -s "$OUT/interp/$n.$s" "$OUT/$e/$n.$s" ||
+					fail "$e: $n: $s differs from interp, diff $OUT/interp/$n.$s $OUT/$e/$n.$s"
+			done
+		done
+	done
+}
+
+# Trace of one test into $OUT/<test>.trace
+trace() {
+	n=$(name "$1")
+	timeout 60 $SIM -x -t "$OUT/$n.trc" "$1" < /dev/null > /dev/null ||
+		fail "$n: did not halt with a0 == 0"
+	$DECODE "$OUT/$n.trc" > "$OUT/$n.trace"
+	rm -f "$OUT/$n.trc"
+}
+
+traces() {
+	revision=$(git -C "$RISCV_ARCH_TEST" rev-parse -q --verify HEAD 2>/dev/null)
+	recorded=$(cat "$GOLDEN_REVISION" 2>/dev/null)
+	arch=0
+	skipped=0
+	for t in "$@"; do
+		n=$(name "$t")
+		trace "$t"
+		[ -f "$REGRESS/$n.S" ] || arch=$((arch + 1))
+		if [ "$mode" = golden ]; then
+			cp "$OUT/$n.trace" "$GOLDEN/$n.trace"
+			continue
+		fi
+		if [ ! -f "$REGRESS/$n.S" ] && { [ -z "$revision" ] ||
+		    [ "$revision" != "$recorded" ] || [ ! -f "$GOLDEN/$n.trace" ]; }; then
+			skipped=$((skipped + 1))
+		elif [ -f "$GOLDEN/$n.trace" ]; then
+			diff -q "$GOLDEN/$n.trace" "$OUT/$n.trace" > /dev/null ||
+				fail "$n: trace differs, diff $GOLDEN/$n.trace $OUT/$n.trace"
+		else
+			fail "$n: no golden trace, record it with make golden"
+		fi
+	done
+
+	if [ "$mode" = golden ] && [ $arch -ne 0 ]; then
+		if [ -n "$revision" ]; then
+			echo "$revision" > "$GOLDEN_REVISION"
+		else
+			rm -f "$GOLDEN_REVISION"
+			echo "$RISCV_ARCH_TEST is not a git checkout, check will skip the golden traces of its tests"
+		fi
+	elif [ $skipped -ne 0 ]; then
+		echo "skip golden traces of $skipped riscv-arch-test tests: recorded at revision ${recorded:-none}, $RISCV_ARCH_TEST is at ${revision:-none}"
+	fi
+}
+
+# MIPS of test $1 on engine $2, from the instructions and MIPS of every job
+rate() {
+	$SIM -j 1 -e $2 -N $PERF_COPIES -n $MAX_INSNS "$1" | awk '
+		/^job / {
+			for (i = 1; i < NF; ++i) {
+				if ($i ~ /^instret=/)
+					insns = substr($i, 9)
+				if ($(i + 1) == "MIPS")
+					mips = $i
+			}
+			if (mips > 0) {
+				total += insns
+				secs += insns / mips
+			}
+		}
+		END { printf "%.1f\n", secs ? total / secs : 0 }'
+}
+
+# "test engine MIPS" lines
+rates() {
+	for t in "$@"; do
+		for e in $ENGINES; do
+			best=0
+			r=0
+			while [ $r -lt $PERF_RUNS ]; do
+				best=$(echo "$(rate "$t" $e) $best" |
+					awk '{ print ($1 > $2 ? $1 : $2) }')
+				r=$((r + 1))
+			done
+			echo "$(name "$t") $e $best"
+		done
+	done
+}
+
+perf() {
+	rates "$@" > "$OUT/perf"
+	if [ "$mode" = baseline ]; then
+		cp "$OUT/perf" "$BASELINE"
+		return
+	fi
+	if [ ! -f "$BASELINE" ]; then
+		echo "skip performance: no $BASELINE, see make perf-baseline"
+		return
+	fi
+	cat "$OUT/perf"
+	slow=$(awk -v limit=$PERF_THRESHOLD '
+		NR == FNR { base[$1 " " $2] = $3; next }
+		($1 " " $2) in base && $3 < base[$1 " " $2] * (100 - limit) / 100 {
+			printf "%s %s: %.1f MIPS, baseline %.1f\n", $1, $2, $3,
+				base[$1 " " $2]
+		}' "$BASELINE" "$OUT/perf")
+	if [ -n "$slow" ]; then
+		echo "$slow" | while read -r line; do
+			echo "FAIL $line"
+		done
+		failed=$((failed + $(echo "$slow" | wc -l)))
+	fi
+}
+
+case $mode in
+check)
+	signatures "$@"
+	traces "$@"
+	perf "$@"
+	;;
+golden)
+	traces "$@"
+	;;
+baseline)
+	perf "$@"
+	;;
+*)
+	echo "check.sh: unknown mode $mode" >&2
+	exit 1
+	;;
+esac
+
+if [ $failed -ne 0 ]; then
+	echo "$failed failures"
+	exit 1
+fi
+echo "$mode: OK, $# tests"
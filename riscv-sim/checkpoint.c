@@ -0,0 +1,225 @@
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "cpu.h"
+#include "csr.h"
+#include "irq.h"
+#include "mem.h"
+#include "uart.h"
+
+#define CKPT_MAGIC "RVCKPT\0"
+#define CKPT_MAX_REGIONS 8
+#define HOST_PAGE 4096
+
+struct ckpt_region {
+	uint32_t addr;
+	uint32_t size;
+	uint64_t offset; /* page aligned file offset of the contents */
+};
+
+struct ckpt_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_regions;
+	uint32_t pc;
+	uint32_t regs[32];
+	uint32_t fregs[32];
+	uint64_t instret;
+	struct csr_state csr;
+	struct irq_state irq;
+	struct uart_state uart;
+	struct ckpt_region region[CKPT_MAX_REGIONS];
+};
+
+static uint64_t page_align(uint64_t n) {
+	return (n + HOST_PAGE - 1) & ~(uint64_t)(HOST_PAGE - 1);
+}
+
+static int write_at(int fd, const void *buf, size_t len, off_t offset) {
+	const uint8_t *p = buf;
+	while (len) {
+		ssize_t w = pwrite(fd, p, len, offset);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		len -= w;
+		offset += w;
+	}
+	return 0;
+}
+
+/* Write the present pages of a region, in runs. Pages never written are
+   left as holes, so a checkpoint of sparse SDRAM stays sparse on disk. */
+static int write_region(int fd, const uint8_t *data,
+		const struct ckpt_region *r) {
+	uint32_t start = 0;
+	while (start < r->size) {
+		if (!mem_page_present(r->addr + start)) {
+			start += MEM_PAGE_SIZE;
+			continue;
+		}
+		uint32_t end = start + MEM_PAGE_SIZE;
+		while (end < r->size && mem_page_present(r->addr + end))
+			end += MEM_PAGE_SIZE;
+		if (end > r->size)
+			end = r->size;
+		if (write_at(fd, data + start, end - start, r->offset + start) < 0)
+			return -1;
+		start = end;
+	}
+	return 0;
+}
+
+/* Mark the pages of a restored region that have data in the file */
+static void mark_present(int fd, const struct ckpt_region *r) {
+	off_t end = r->offset + r->size;
+	off_t pos = r->offset;
+	while (pos < end) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0 || data >= end)
+			return;
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+		mem_mark_present(r->addr + (data - r->offset), hole - data);
+		pos = hole;
+	}
+}
+
+int ckpt_save(const char *path) {
+	struct ckpt_header h;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, CKPT_MAGIC, sizeof h.magic);
+	h.version = CKPT_VERSION;
+	h.pc = M.pc;
+	memcpy(h.regs, M.regs, sizeof h.regs);
+	memcpy(h.fregs, M.fregs, sizeof h.fregs);
+	h.instret = M.instret;
+	csr_save(&h.csr);
+	irq_save(&h.irq);
+	uart_save(&h.uart);
+
+	uint8_t *data[CKPT_MAX_REGIONS];
+	uint64_t offset = page_align(sizeof h);
+	bool sparse;
+	for (int i = 0; (data[i] = mem_backed_region(i, &h.region[i].addr,
+			&h.region[i].size, &sparse)) != NULL; ++i) {
+		if (i == CKPT_MAX_REGIONS - 1) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		h.region[i].offset = offset;
+		offset = page_align(offset + h.region[i].size);
+		h.n_regions++;
+	}
+
+	/* write a temporary file and rename it, so that a checkpoint taken
+	   while running never leaves a torn file behind */
+	size_t len = strlen(path);
+	char *tmp = malloc(len + 5);
+	if (tmp == NULL)
+		return -1;
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto fail;
+	if (write_at(fd, &h, sizeof h, 0) < 0)
+		goto fail_close;
+	for (uint32_t i = 0; i < h.n_regions; ++i) {
+		if (write_region(fd, data[i], &h.region[i]) < 0)
+			goto fail_close;
+	}
+	if (ftruncate(fd, offset) < 0) /* trailing holes */
+		goto fail_close;
+	if (close(fd) < 0 || rename(tmp, path) < 0)
+		goto fail_unlink;
+	free(tmp);
+	return 0;
+
+fail_close:
+	close(fd);
+fail_unlink:
+	unlink(tmp);
+fail:
+	free(tmp);
+	return -1;
+}
+
+static void fail(const char *path, const char *msg) {
+	fprintf(stderr, "%s: %s\n", path, msg);
+	exit(EXIT_FAILURE);
+}
+
+void ckpt_restore(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	struct ckpt_header h;
+	if (pread(fd, &h, sizeof h, 0) != sizeof h ||
+			memcmp(h.magic, CKPT_MAGIC, sizeof h.magic) != 0)
+		fail(path, "not a checkpoint");
+	if (h.version != CKPT_VERSION)
+		fail(path, "unsupported checkpoint version");
+	if (h.n_regions > CKPT_MAX_REGIONS)
+		fail(path, "bad region table");
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < h.n_regions; ++i) {
+		const struct ckpt_region *r = &h.region[i];
+		uint32_t addr, size;
+		bool sparse;
+		uint8_t *dst = mem_backed_region(i, &addr, &size, &sparse);
+		if (dst == NULL || addr != r->addr || size != r->size)
+			fail(path, "memory layout does not match this machine");
+		if (r->offset & (HOST_PAGE - 1))
+			fail(path, "bad region table");
+		/* pages past the end of the file would fault on access */
+		if (r->offset + r->size > (uint64_t)st.st_size)
+			fail(path, "truncated checkpoint");
+
+		/* the backing stores are page aligned anonymous mappings sized
+		   to the region, so the file pages can simply replace them.
+		   Sparse regions stay uncommitted, as mem.c allocates them. */
+		void *p = mmap(dst, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED | (sparse ? MAP_NORESERVE : 0),
+				fd, r->offset);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+		mark_present(fd, r);
+	}
+	close(fd); /* the mappings keep their own reference */
+
+	M.pc = h.pc;
+	memcpy(M.regs, h.regs, sizeof M.regs);
+	M.regs[0] = 0;
+	memcpy(M.fregs, h.fregs, sizeof M.fregs);
+	M.instret = h.instret;
+	csr_restore(&h.csr);
+	irq_restore(&h.irq);
+	uart_restore(&h.uart);
+}
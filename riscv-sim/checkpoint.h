@@ -0,0 +1,17 @@
+#ifndef RVSIM_CHECKPOINT_H
+#define RVSIM_CHECKPOINT_H 1
+
+/* Machine checkpoints: CPU registers and CSRs, the memory backed regions
+   and the guest visible CLINT and UART state. Memory is stored page aligned in the
+   file and mapped copy-on-write on restore, so restoring costs a few
+   system calls regardless of memory size. Host side buffers (pty, trace) are not saved. */
+
+#define CKPT_VERSION 4
+
+/* RETURN VALUE: 0 on success, -1 with errno set on failure */
+extern int ckpt_save(const char *path);
+
+/* Call after cpu_init() and before uart_start(). Exits on error. */
+extern void ckpt_restore(const char *path);
+
+#endif /* RVSIM_CHECKPOINT_H */
@@ -0,0 +1,1080 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "cpu.h"
+#include "csr.h"
+#include "csr/mstatus.h"
+#include "disasm.h"
+#include "fpu.h"
+#include "insn.h"
+#include "mem.h"
+#include "prof.h"
+#include "rvc.h"
+#include "sched.h"
+#include "threaded.h"
+#include "trace.h"
+
+#define OP_LOAD    0x00 /* 00000 */
+#define OP_LOAD_FP 0x01 /* 00001 */
+#define OP_MISC_MEM 0x03 /* 00011 */
+#define OP_IMM     0x04 /* 00100 */
+#define OP_AUIPC   0x05 /* 00101 */
+#define OP_STORE   0x08 /* 01000 */
+#define OP_STORE_FP 0x09 /* 01001 */
+#define OP_AMO     0x0B /* 01011 */
+#define OP         0x0C /* 01100 */
+#define OP_LUI     0x0D /* 01101 */
+#define OP_MADD    0x10 /* 10000 */
+#define OP_MSUB    0x11 /* 10001 */
+#define OP_NMSUB   0x12 /* 10010 */
+#define OP_NMADD   0x13 /* 10011 */
+#define OP_FP      0x14 /* 10100 */
+#define OP_BRANCH  0x18 /* 11000 */
+#define OP_JALR    0x19 /* 11001 */
+#define OP_JAL     0x1B /* 11011 */
+#define OP_SYSTEM  0x1C /* 11100 */
+#define OP_NONE    0x1F /* 11111, longer encodings, never decoded */
+
+/* Decode cache. Direct mapped and indexed by halfword address, as
+   compressed instructions may start at any of them, so the whole of
+   internal ROM and RAM (0x00000-0x1ffff) fits without aliasing. */
+#define DCACHE_BITS 16
+#define DCACHE_SIZE (1 << DCACHE_BITS)
+#define DCACHE_INVALID 0xffffffff /* never a valid (aligned) pc */
+
+#define ECALL  0x00000073
+#define EBREAK 0x00100073
+#define C_EBREAK 0x9002
+#define MRET   0x30200073
+#define WFI    0x10500073
+#define RESERVATION_NONE 0x1 /* never a word address */
+
+__thread struct machine M;
+__thread uint8_t cpu_code_map[CPU_CODE_MAP_SIZE];
+__thread bool cpu_halted;
+__thread bool cpu_waiting;
+__thread bool cpu_polling;
+__thread enum cpu_stop cpu_stopped;
+__thread uint32_t cpu_stop_addr;
+__thread int cpu_stop_watch;
+__thread uint32_t cpu_hartid;
+
+static __thread struct insn dcache[DCACHE_SIZE];
+static __thread bool verbose;
+static __thread exec_f *const (*exec_ops)[N_INSN_IDS]; /* handlers of the selected variant */
+static __thread exec_f *exec_loop; /* polling loop branches, NULL if none */
+static __thread uint64_t run_end; /* of the current cpu_run() */
+static __thread struct trace_rec *rec_cur; /* record of the executing instruction */
+static __thread uint32_t next_pc; /* M.pc once the executing instruction completes */
+static __thread bool protect_code; /* native code stores without cpu_invalidate() */
+static __thread bool halt_on_ebreak;
+static __thread struct sched_event halt_event;
+static __thread struct sched_event wfi_event;
+static __thread uint32_t reserved_addr; /* LR.W reservation */
+static __thread uint32_t reserved_value; /* word loaded by LR.W */
+static __thread int decoded_rm; /* F instructions decoded for, see fp_state() */
+static __thread struct sched_event stop_event;
+static __thread uint32_t breakpoints[CPU_MAX_BREAKPOINTS];
+static __thread int n_breakpoints;
+static __thread uint8_t break_map[CPU_CODE_MAP_SIZE]; /* pages with breakpoints */
+static __thread uint32_t resume_pc; /* breakpoint stepped over, see cpu_resume() */
+static __thread uint64_t resume_instret;
+
+struct watchpoint {
+	uint32_t addr;
+	uint32_t len;
+	int kind;
+};
+
+static __thread struct watchpoint watchpoints[CPU_MAX_WATCHPOINTS];
+static __thread int n_watchpoints;
+
+static uint32_t sign_extend(uint32_t imm, int signPos) {
+	int shift = 31 - signPos;
+	return (uint32_t)((int32_t)(imm << shift) >> shift);
+}
+
+/* OP_NONE if instr is not a 32-bit instruction, like the 0 rvc_expand()
+   returns for an illegal one */
+static uint32_t get_op(const uint32_t instr) {
+	if (RVC_COMPRESSED(instr))
+		return OP_NONE;
+	return (instr >> 2) & 0x1F; /* 1 1111 */
+}
+
+static uint32_t get_rd(const uint32_t instr) {
+	return (instr >> 7) & 0x1F; /* 1 1111 */
+}
+
+static uint32_t get_funct3(const uint32_t instr) {
+	return (instr >> 12) & 0x07; /* 111 */
+}
+
+static uint32_t get_funct7(const uint32_t instr) {
+	return (instr >> 25) & 0x7F; /* 111 1111 */
+}
+
+static uint32_t get_rs1(const uint32_t instr) {
+	return (instr >> 15) & 0x1F; /* 1 1111 */
+}
+
+static uint32_t get_rs2(const uint32_t instr) {
+	return (instr >> 20) & 0x1F; /* 1 1111 */
+}
+
+static uint32_t get_i_imm(const uint32_t instr) {
+	return (instr >> 20) & 0xFFF; /* 1111 1111 1111 */
+}
+
+static uint32_t get_s_imm(const uint32_t instr) {
+	uint32_t imm_11_5 = (instr >> 25) & 0x7F; /* 111 1111 */
+	uint32_t imm_4_0 = (instr >> 7) & 0x1F; /* 1 1111 */
+	return (imm_11_5 << 5) | imm_4_0;
+}
+
+static uint32_t get_b_imm(const uint32_t instr) {
+	uint32_t imm_12 = (instr >> 31) & 0x01; /* 1 */
+	uint32_t imm_10_5 = (instr >> 25) & 0x3F; /* 11 1111 */
+	uint32_t imm_4_1 = (instr >> 8) & 0x0F; /* 1111 */
+	uint32_t imm_11 = (instr >> 7) & 0x01; /* 1 */
+	return (imm_12 << 12)|(imm_11 << 11)|(imm_10_5 << 5)|(imm_4_1 << 1);
+}
+
+static uint32_t get_u_imm(const uint32_t instr) {
+	return (instr & 0xFFFFF000) >> 12; /* 1111 1111 1111 1111 1111 0000 0000 0000 */
+}
+
+static uint32_t get_j_imm(const uint32_t instr) {
+	uint32_t imm_20 = (instr >> 31) & 0x01; /* 1 */
+	uint32_t imm_10_1 = (instr >> 21) & 0x3FF; /* 11 1111 1111 */
+	uint32_t imm_11 = (instr >> 20) & 0x01; /* 1 */
+	uint32_t imm_19_12 = (instr >> 12) & 0xFF; /* 1111 1111 */
+	return (imm_20 << 20)|(imm_19_12 << 12)|(imm_11 << 11)|(imm_10_1 << 1);
+}
+
+static const uint8_t load_ids[8] = {
+	[0] = I_LB,  /* 000 LB */
+	[1] = I_LH,  /* 001 LH */
+	[2] = I_LW,  /* 010 LW */
+	[4] = I_LBU, /* 100 LBU */
+	[5] = I_LHU, /* 101 LHU */
+};
+
+static const uint8_t imm_ids[8] = {
+	[0] = I_ADDI,  /* 000 ADDI */
+	[2] = I_SLTI,  /* 010 SLTI */
+	[3] = I_SLTIU, /* 011 SLTIU */
+	[4] = I_XORI,  /* 100 XORI */
+	[6] = I_ORI,   /* 110 ORI */
+	[7] = I_ANDI,  /* 111 ANDI */
+};
+
+static const uint8_t store_ids[8] = {
+	[0] = I_SB, /* 000 SB */
+	[1] = I_SH, /* 001 SH */
+	[2] = I_SW, /* 010 SW */
+};
+
+static const uint8_t op_ids[8] = {
+	[0] = I_ADD,  /* 000 ADD */
+	[1] = I_SLL,  /* 001 SLL */
+	[2] = I_SLT,  /* 010 SLT */
+	[3] = I_SLTU, /* 011 SLTU */
+	[4] = I_XOR,  /* 100 XOR */
+	[5] = I_SRL,  /* 101 SRL */
+	[6] = I_OR,   /* 110 OR */
+	[7] = I_AND,  /* 111 AND */
+};
+
+/* funct7 000 0001 */
+static const uint8_t muldiv_ids[8] = {
+	[0] = I_MUL,    /* 000 MUL */
+	[1] = I_MULH,   /* 001 MULH */
+	[2] = I_MULHSU, /* 010 MULHSU */
+	[3] = I_MULHU,  /* 011 MULHU */
+	[4] = I_DIV,    /* 100 DIV */
+	[5] = I_DIVU,   /* 101 DIVU */
+	[6] = I_REM,    /* 110 REM */
+	[7] = I_REMU,   /* 111 REMU */
+};
+
+/* Indexed by funct5, the aq/rl bits are ignored */
+static const uint8_t amo_ids[32] = {
+	[0x00] = I_AMOADD_W,  /* 00000 AMOADD.W */
+	[0x01] = I_AMOSWAP_W, /* 00001 AMOSWAP.W */
+	[0x02] = I_LR_W,      /* 00010 LR.W */
+	[0x03] = I_SC_W,      /* 00011 SC.W */
+	[0x04] = I_AMOXOR_W,  /* 00100 AMOXOR.W */
+	[0x08] = I_AMOOR_W,   /* 01000 AMOOR.W */
+	[0x0C] = I_AMOAND_W,  /* 01100 AMOAND.W */
+	[0x10] = I_AMOMIN_W,  /* 10000 AMOMIN.W */
+	[0x14] = I_AMOMAX_W,  /* 10100 AMOMAX.W */
+	[0x18] = I_AMOMINU_W, /* 11000 AMOMINU.W */
+	[0x1C] = I_AMOMAXU_W, /* 11100 AMOMAXU.W */
+};
+
+/* funct3 000 is ECALL, EBREAK and the other privileged instructions */
+static const uint8_t system_ids[8] = {
+	[0] = I_SYSTEM,
+	[1] = I_CSRRW,  /* 001 CSRRW */
+	[2] = I_CSRRS,  /* 010 CSRRS */
+	[3] = I_CSRRC,  /* 011 CSRRC */
+	[5] = I_CSRRWI, /* 101 CSRRWI */
+	[6] = I_CSRRSI, /* 110 CSRRSI */
+	[7] = I_CSRRCI, /* 111 CSRRCI */
+};
+
+/* OP_MADD..OP_NMADD, by the low two opcode bits */
+static const uint8_t fma_ids[4] = {
+	I_FMADD_S,  /* 00 FMADD.S */
+	I_FMSUB_S,  /* 01 FMSUB.S */
+	I_FNMSUB_S, /* 10 FNMSUB.S */
+	I_FNMADD_S, /* 11 FNMADD.S */
+};
+
+/* funct7 001 0000 */
+static const uint8_t fsgnj_ids[8] = {
+	[0] = I_FSGNJ_S,  /* 000 FSGNJ.S */
+	[1] = I_FSGNJN_S, /* 001 FSGNJN.S */
+	[2] = I_FSGNJX_S, /* 010 FSGNJX.S */
+};
+
+/* funct7 101 0000 */
+static const uint8_t fcmp_ids[8] = {
+	[0] = I_FLE_S, /* 000 FLE.S */
+	[1] = I_FLT_S, /* 001 FLT.S */
+	[2] = I_FEQ_S, /* 010 FEQ.S */
+};
+
+static const uint8_t branch_ids[8] = {
+	[0] = I_BEQ,  /* 000 BEQ */
+	[1] = I_BNE,  /* 001 BNE */
+	[4] = I_BLT,  /* 100 BLT */
+	[5] = I_BGE,  /* 101 BGE */
+	[6] = I_BLTU, /* 110 BLTU */
+	[7] = I_BGEU, /* 111 BGEU */
+};
+
+/* OP_FP, single precision only: fmt, the low two bits of funct7, is 00.
+   Conversions and moves tell their variants apart by rs2. */
+static int fp_id(uint32_t funct7, uint32_t funct3, uint32_t rs2) {
+	switch (funct7) {
+	case 0x00: return I_FADD_S; /* 000 0000 */
+	case 0x04: return I_FSUB_S; /* 000 0100 */
+	case 0x08: return I_FMUL_S; /* 000 1000 */
+	case 0x0C: return I_FDIV_S; /* 000 1100 */
+	case 0x2C: return rs2 == 0 ? I_FSQRT_S : I_INVALID; /* 010 1100 */
+	case 0x10: return fsgnj_ids[funct3]; /* 001 0000 */
+	case 0x14: /* 001 0100 */
+		if (funct3 > 1)
+			return I_INVALID;
+		return funct3 == 0 ? I_FMIN_S : I_FMAX_S;
+	case 0x50: return fcmp_ids[funct3]; /* 101 0000 */
+	case 0x60: /* 110 0000 */
+		if (rs2 > 1)
+			return I_INVALID;
+		return rs2 == 0 ? I_FCVT_W_S : I_FCVT_WU_S;
+	case 0x68: /* 110 1000 */
+		if (rs2 > 1)
+			return I_INVALID;
+		return rs2 == 0 ? I_FCVT_S_W : I_FCVT_S_WU;
+	case 0x70: /* 111 0000 */
+		if (rs2 != 0 || funct3 > 1)
+			return I_INVALID;
+		return funct3 == 0 ? I_FMV_X_W : I_FCLASS_S;
+	case 0x78: /* 111 1000 */
+		return rs2 == 0 && funct3 == 0 ? I_FMV_W_X : I_INVALID;
+	default:
+		return I_INVALID;
+	}
+}
+
+/* F instructions with a rounding mode in funct3 */
+static bool fp_rounds(int id) {
+	switch (id) {
+	case I_FMADD_S ... I_FSQRT_S:
+	case I_FCVT_S_W: case I_FCVT_S_WU:
+	case I_FCVT_W_S: case I_FCVT_WU_S:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* What decoding F instructions depends on: -1 while mstatus.FS is off,
+   otherwise what their dynamic rounding mode stands for. Decoding to
+   I_INVALID while FS is off and resolving rm == DYN once here means no
+   engine checks either when the instructions run; the decoded code is
+   flushed whenever this changes, see fp_check(). */
+static int fp_state(void) {
+	if (!(mstatus_get() & MST_FS))
+		return -1;
+	return fpu_dyn_rm();
+}
+
+/* See cpu_poll_loop(). The instructions in between are checked once,
+   when the branch is decoded.
+   RETURN VALUE: instructions in the loop, the branch included, 0 if it
+   cannot be polling */
+static int poll_length(uint32_t pc, int32_t offset) {
+	if (offset >= 0 || offset < -4 * (CPU_POLL_MAX_INSNS - 1))
+		return 0;
+	int n = 1;
+	uint32_t a = pc + offset;
+	while (a != pc) {
+		uint16_t half;
+		uint32_t instr;
+		if (a > pc || n == CPU_POLL_MAX_INSNS ||
+				mem_load_half(a, &half) < 0)
+			return 0;
+		if (RVC_COMPRESSED(half)) {
+			instr = rvc_expand(half);
+			a += 2;
+		} else if (mem_load_word(a, &instr) == 0) {
+			a += 4;
+		} else {
+			return 0;
+		}
+		switch (get_op(instr)) {
+		case OP_LOAD: case OP_IMM: case OP: case OP_LUI: case OP_AUIPC:
+			break;
+		default:
+			return 0;
+		}
+		n++;
+	}
+	return n;
+}
+
+bool cpu_breakpoint(uint32_t pc) {
+	if (!(break_map[pc >> (CPU_CODE_PAGE_BITS + 3)] &
+			(1 << ((pc >> CPU_CODE_PAGE_BITS) & 7))))
+		return false;
+	for (int i = 0; i < n_breakpoints; ++i) {
+		if (breakpoints[i] == pc)
+			return true;
+	}
+	return false;
+}
+
+/* The run loops leave at the event, see cpu_run() */
+static void stop(enum cpu_stop why) {
+	cpu_stopped = why;
+	sched_at(&stop_event, M.instret);
+}
+
+static void stopped(void *arg) {
+}
+
+/* In place of the handler of an instruction at a breakpoint: it is not
+   executed, unless the machine resumes from it */
+static void breakpoint(const struct insn *in) {
+	if (M.pc == resume_pc && M.instret == resume_instret + 1) {
+		exec_ops[RVC_COMPRESSED(in->raw)][in->id](in);
+		return;
+	}
+	M.instret--;
+	next_pc = M.pc;
+	stop(CPU_STOP_BREAK);
+}
+
+/* Fill in a decode cache entry for instr, 16 bits wide if compressed.
+   Compressed instructions are decoded as the 32-bit instruction they
+   expand to, only raw keeps the original encoding. Unknown encodings
+   decode to I_INVALID so they still hit in the cache. */
+static void decode(struct insn *in, uint32_t pc, uint32_t raw) {
+	uint32_t instr = RVC_COMPRESSED(raw) ? rvc_expand(raw) : raw;
+	uint32_t funct3 = get_funct3(instr);
+	uint32_t funct7 = get_funct7(instr);
+
+	uint8_t *map = &cpu_code_map[pc >> (CPU_CODE_PAGE_BITS + 3)];
+	uint8_t bit = 1 << ((pc >> CPU_CODE_PAGE_BITS) & 7);
+	if (!(*map & bit)) {
+		*map |= bit;
+		if (protect_code)
+			mem_write_protect(pc);
+	}
+
+	in->pc = pc;
+	in->raw = raw;
+	in->id = I_INVALID;
+	in->rd = get_rd(instr);
+	in->rs1 = get_rs1(instr);
+	in->rs2 = get_rs2(instr);
+	in->imm = 0;
+
+	switch(get_op(instr)) {
+	case OP_LOAD:
+		in->id = load_ids[funct3];
+		in->imm = sign_extend(get_i_imm(instr), 11);
+		break;
+	case OP_IMM:
+		in->imm = sign_extend(get_i_imm(instr), 11);
+		if (funct3 == 1) { /* 001 */
+			if (funct7 == 0x00) /* 000 0000 SLLI */
+				in->id = I_SLLI;
+			in->imm = in->rs2; /* shamt */
+		} else if (funct3 == 5) { /* 101 */
+			if (funct7 == 0x00) /* 000 0000 SRLI */
+				in->id = I_SRLI;
+			else if (funct7 == 0x20) /* 010 0000 SRAI */
+				in->id = I_SRAI;
+			in->imm = in->rs2; /* shamt */
+		} else {
+			in->id = imm_ids[funct3];
+		}
+		break;
+	case OP_AUIPC:
+		in->id = I_AUIPC;
+		in->imm = get_u_imm(instr) << 12;
+		break;
+	case OP_STORE:
+		in->id = store_ids[funct3];
+		in->imm = sign_extend(get_s_imm(instr), 11);
+		break;
+	case OP:
+		if (funct7 == 0x00) /* 000 0000 */
+			in->id = op_ids[funct3];
+		else if (funct7 == 0x01) /* 000 0001 */
+			in->id = muldiv_ids[funct3];
+		else if (funct7 == 0x20 && funct3 == 0) /* 010 0000 SUB */
+			in->id = I_SUB;
+		else if (funct7 == 0x20 && funct3 == 5) /* 010 0000 SRA */
+			in->id = I_SRA;
+		break;
+	case OP_LUI:
+		in->id = I_LUI;
+		in->imm = get_u_imm(instr) << 12;
+		break;
+	case OP_BRANCH:
+		in->id = branch_ids[funct3];
+		in->imm = sign_extend(get_b_imm(instr), 12);
+		break;
+	case OP_JALR:
+		in->id = I_JALR;
+		in->imm = sign_extend(get_i_imm(instr), 11);
+		break;
+	case OP_JAL:
+		in->id = I_JAL;
+		in->imm = sign_extend(get_j_imm(instr), 20);
+		break;
+	case OP_MISC_MEM:
+		if (funct3 == 0) /* 000 FENCE */
+			in->id = I_FENCE;
+		else if (funct3 == 1) /* 001 FENCE.I */
+			in->id = I_FENCE_I;
+		break;
+	case OP_AMO:
+		if (funct3 == 2) /* 010, word sized */
+			in->id = amo_ids[funct7 >> 2];
+		if (in->id == I_LR_W && in->rs2 != 0)
+			in->id = I_INVALID;
+		break;
+	case OP_SYSTEM:
+		in->id = system_ids[funct3];
+		in->imm = get_i_imm(instr); /* CSR number, rs1 is the uimm */
+		break;
+	case OP_LOAD_FP:
+		if (funct3 == 2) /* 010 FLW */
+			in->id = I_FLW;
+		in->imm = sign_extend(get_i_imm(instr), 11);
+		break;
+	case OP_STORE_FP:
+		if (funct3 == 2) /* 010 FSW */
+			in->id = I_FSW;
+		in->imm = sign_extend(get_s_imm(instr), 11);
+		break;
+	case OP_MADD: case OP_MSUB: case OP_NMSUB: case OP_NMADD:
+		if ((funct7 & 0x3) == 0) /* fmt 00 */
+			in->id = fma_ids[get_op(instr) & 0x3];
+		in->imm = funct3 | (instr >> 27) << 3; /* rm, rs3 */
+		break;
+	case OP_FP:
+		in->id = fp_id(funct7, funct3, in->rs2);
+		in->imm = funct3;
+		break;
+	}
+
+	if (insn_fp(in->id)) {
+		if (decoded_rm < 0) {
+			in->id = I_INVALID;
+		} else if (fp_rounds(in->id)) {
+			uint32_t rm = in->imm & 0x7;
+			if (rm == FPU_DYN)
+				rm = decoded_rm;
+			if (rm > FPU_RMM && rm != FPU_DYN)
+				in->id = I_INVALID;
+			in->imm = (in->imm & ~0x7u) | rm;
+		}
+	}
+
+	in->exec = exec_ops[RVC_COMPRESSED(raw)][in->id];
+	if (exec_loop && get_op(instr) == OP_BRANCH && in->id != I_INVALID) {
+		int n = poll_length(pc, in->imm);
+		if (n) {
+			in->exec = exec_loop;
+			in->rd = n; /* branches have no rd, see fast_loop() */
+		}
+	}
+	if (cpu_breakpoint(pc))
+		in->exec = breakpoint;
+}
+
+/* Decode cache miss, kept out of fetch() so that the hit stays inline in
+   the run loops */
+static struct insn *fill(struct insn *in, uint32_t pc) {
+	/* by halves, the second one may be past the end of memory */
+	uint16_t lo, hi;
+	if (mem_load_half(pc, &lo) < 0)
+		return NULL;
+	uint32_t instr = lo;
+	if (!RVC_COMPRESSED(lo)) {
+		if (mem_load_half(pc + 2, &hi) < 0)
+			return NULL;
+		instr |= (uint32_t)hi << 16;
+	}
+
+	decode(in, pc, instr);
+	return in;
+}
+
+static inline struct insn *fetch(uint32_t pc) {
+	struct insn *in = &dcache[(pc >> 1) & (DCACHE_SIZE - 1)];
+	if (in->pc == pc)
+		return in;
+	return fill(in, pc);
+}
+
+const struct insn *cpu_fetch(uint32_t pc) {
+	return fetch(pc);
+}
+
+/* Drop everything decoded so far, for FENCE.I: stores by other harts do
+   not invalidate this hart's caches */
+static void flush_code(void) {
+	for (int i = 0; i < DCACHE_SIZE; ++i)
+		dcache[i].pc = DCACHE_INVALID;
+	threaded_flush();
+}
+
+/* After anything that may have changed mstatus.FS or frm: the host FPU
+   follows FS, and F instructions decoded for another fp_state() are
+   decoded again */
+static void fp_check(void) {
+	int state = fp_state();
+	fpu_update();
+	if (state != decoded_rm) {
+		decoded_rm = state;
+		flush_code();
+	}
+}
+
+static uint32_t amo_result(int id, uint32_t old, uint32_t src) {
+	switch (id) {
+	case I_AMOSWAP_W: return src;
+	case I_AMOADD_W:  return old + src;
+	case I_AMOXOR_W:  return old ^ src;
+	case I_AMOAND_W:  return old & src;
+	case I_AMOOR_W:   return old | src;
+	case I_AMOMIN_W:  return (int32_t)old < (int32_t)src ? old : src;
+	case I_AMOMAX_W:  return (int32_t)old > (int32_t)src ? old : src;
+	case I_AMOMINU_W: return old < src ? old : src;
+	case I_AMOMAXU_W: return old > src ? old : src;
+	default:          return old;
+	}
+}
+
+/* Atomic read-modify-write of the word at addr. Directly mapped words
+   are updated with a host compare-and-swap, so harts on other threads
+   see a single access; devices and write protected code pages fall back
+   to a plain load and store.
+   RETURN VALUE: 0 on success, negative value on error */
+static int amo(int id, uint32_t addr, uint32_t src, uint32_t *old) {
+	if (addr & 0x3)
+		return -EINVAL;
+
+	uint32_t *p = mem_atomic_word(addr);
+	if (p == NULL) {
+		int r = mem_load_word(addr, old);
+		if (r == 0)
+			r = mem_store_word(addr, amo_result(id, *old, src));
+		return r;
+	}
+
+	uint32_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(p, &cur, amo_result(id, cur, src),
+			true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+	*old = cur;
+	cpu_invalidate(addr, 4);
+	return 0;
+}
+
+static int load_reserved(uint32_t addr, uint32_t *value) {
+	if (addr & 0x3)
+		return -EINVAL;
+	uint32_t *p = mem_atomic_word(addr);
+	int r = 0;
+	if (p)
+		*value = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+	else
+		r = mem_load_word(addr, value);
+	if (r == 0) {
+		reserved_addr = addr;
+		reserved_value = *value;
+	}
+	return r;
+}
+
+/* The reservation holds while the word still has the value LR.W loaded,
+   which the compare-and-swap checks atomically.
+   RETURN VALUE: 0 if stored, 1 if not, negative value on error */
+static int store_conditional(uint32_t addr, uint32_t value) {
+	if (addr & 0x3)
+		return -EINVAL;
+	bool reserved = reserved_addr == addr;
+	reserved_addr = RESERVATION_NONE;
+	if (!reserved)
+		return 1;
+
+	uint32_t *p = mem_atomic_word(addr);
+	if (p == NULL)
+		return mem_store_word(addr, value);
+
+	uint32_t expected = reserved_value;
+	if (!__atomic_compare_exchange_n(p, &expected, value, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return 1;
+	cpu_invalidate(addr, 4);
+	return 0;
+}
+
+/* CSRRW, CSRRS or CSRRC (or their immediate forms) of in->imm with src.
+   CSRRS and CSRRC with x0 or a zero uimm do not write; every form reads,
+   as no CSR has read side effects.
+   RETURN VALUE: 0 on success, negative value for an illegal access */
+static int csr_rw(const struct insn *in, uint32_t src, uint32_t *old) {
+	int r = csr_get(in->imm, old);
+	if (r < 0)
+		return r;
+
+	switch ((in->raw >> 12) & 0x3) { /* funct3 without the immediate bit */
+	case 1: /* 01 CSRRW */
+		r = csr_set(in->imm, src);
+		break;
+	case 2: /* 10 CSRRS */
+		if (!in->rs1)
+			return 0;
+		r = csr_set(in->imm, *old | src);
+		break;
+	default: /* 11 CSRRC */
+		if (!in->rs1)
+			return 0;
+		r = csr_set(in->imm, *old & ~src);
+		break;
+	}
+	if (r == 0)
+		fp_check();
+	return r;
+}
+
+/* Registers at the head of the last candidate loop iteration */
+static __thread struct {
+	uint32_t head;
+	uint32_t effects; /* mem_read_effects then */
+	uint64_t instret;
+	uint64_t events; /* sched_n_run then */
+	uint32_t regs[32];
+} poll_last;
+
+/* Called with M.instret counting the branch and the registers as they
+   are at the head again */
+void cpu_poll_loop(uint32_t head, uint32_t n_insns) {
+	if (poll_last.head == head && M.instret - poll_last.instret == n_insns &&
+			poll_last.events == sched_n_run &&
+			poll_last.effects == mem_read_effects &&
+			mem_device_lock == NULL &&
+			memcmp(poll_last.regs, M.regs, sizeof M.regs) == 0) {
+		uint64_t limit = run_end < sched_next_event ? run_end : sched_next_event;
+		if (limit > M.instret) {
+			M.instret += (limit - M.instret) / n_insns * n_insns;
+			cpu_polling = true;
+		}
+	}
+
+	poll_last.head = head;
+	poll_last.effects = mem_read_effects;
+	poll_last.instret = M.instret;
+	poll_last.events = sched_n_run;
+	memcpy(poll_last.regs, M.regs, sizeof M.regs);
+}
+
+/* Watch variant of the interpreter, after an access of len bytes at addr
+   by the executing instruction */
+static void watch(uint32_t addr, uint32_t len, int kind) {
+	for (int i = 0; i < n_watchpoints; ++i) {
+		const struct watchpoint *w = &watchpoints[i];
+		if ((w->kind & kind) && addr < w->addr + w->len &&
+				w->addr < addr + len) {
+			cpu_stop_addr = w->addr;
+			cpu_stop_watch = w->kind;
+			stop(CPU_STOP_WATCH);
+			return;
+		}
+	}
+}
+
+/* Synchronous trap of the executing instruction */
+static void exception(uint32_t cause, uint32_t tval) {
+	next_pc = csr_trap(cause, M.pc, tval);
+}
+
+/* The wait starts once the run loop has been left for the event, see
+   cpu_run(). Only hart 0 takes interrupts, so WFI is a no-op on the
+   others. */
+static void wfi(void) {
+	if (cpu_hartid != 0)
+		return;
+	cpu_waiting = true;
+	sched_at(&wfi_event, M.instret);
+}
+
+static void wfi_check(void *arg) {
+	cpu_interrupt();
+}
+
+/* An enabled interrupt ends WFI even with mstatus.MIE clear, which
+   then leaves it pending */
+void cpu_interrupt(void) {
+	int irq = csr_interrupt();
+	if (irq < 0)
+		return;
+	cpu_waiting = false;
+	if (mstatus_get() & MST_MIE)
+		M.pc = csr_trap(CAUSE_INTERRUPT | irq, M.pc, 0);
+}
+
+/* Instructions start at every halfword of the range, and a 32-bit one may
+   start at the halfword before it */
+void cpu_invalidate_code(uint32_t addr, uint32_t len) {
+	for (uint32_t pc = (addr & ~0x1) - 2; pc != ((addr + len + 1) & ~0x1);
+			pc += 2) {
+		struct insn *in = &dcache[(pc >> 1) & (DCACHE_SIZE - 1)];
+		if (in->pc == pc)
+			in->pc = DCACHE_INVALID;
+	}
+	threaded_invalidate(addr);
+}
+
+#define INTERP_NAME fast
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_RECORD 0
+#define INTERP_PROFILE 0
+#define INTERP_CACHE 0
+#define INTERP_WATCH 0
+#include "interp.h"
+#undef INTERP_NAME
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_RECORD
+#undef INTERP_PROFILE
+#undef INTERP_CACHE
+#undef INTERP_WATCH
+
+#define INTERP_NAME trace
+#define INTERP_TRACE 1
+#define INTERP_DEBUG 0
+#define INTERP_RECORD 0
+#define INTERP_PROFILE 0
+#define INTERP_CACHE 0
+#define INTERP_WATCH 0
+#include "interp.h"
+#undef INTERP_NAME
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_RECORD
+#undef INTERP_PROFILE
+#undef INTERP_CACHE
+#undef INTERP_WATCH
+
+#define INTERP_NAME debug
+#define INTERP_TRACE 1
+#define INTERP_DEBUG 1
+#define INTERP_RECORD 0
+#define INTERP_PROFILE 0
+#define INTERP_CACHE 0
+#define INTERP_WATCH 0
+#include "interp.h"
+#undef INTERP_NAME
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_RECORD
+#undef INTERP_PROFILE
+#undef INTERP_CACHE
+#undef INTERP_WATCH
+
+#define INTERP_NAME record
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_RECORD 1
+#define INTERP_PROFILE 0
+#define INTERP_CACHE 0
+#define INTERP_WATCH 0
+#include "interp.h"
+#undef INTERP_NAME
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_RECORD
+#undef INTERP_PROFILE
+#undef INTERP_CACHE
+#undef INTERP_WATCH
+
+#define INTERP_NAME profile
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_RECORD 0
+#define INTERP_PROFILE 1
+#define INTERP_CACHE 0
+#define INTERP_WATCH 0
+#include "interp.h"
+#undef INTERP_NAME
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_RECORD
+#undef INTERP_PROFILE
+#undef INTERP_CACHE
+#undef INTERP_WATCH
+
+#define INTERP_NAME cache
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_RECORD 0
+#define INTERP_PROFILE 0
+#define INTERP_CACHE 1
+#define INTERP_WATCH 0
+#include "interp.h"
+#undef INTERP_NAME
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_RECORD
+#undef INTERP_PROFILE
+#undef INTERP_CACHE
+#undef INTERP_WATCH
+
+#define INTERP_NAME watch
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_RECORD 0
+#define INTERP_PROFILE 0
+#define INTERP_CACHE 0
+#define INTERP_WATCH 1
+#include "interp.h"
+#undef INTERP_NAME
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_RECORD
+#undef INTERP_PROFILE
+#undef INTERP_CACHE
+#undef INTERP_WATCH
+
+/* Branch closing a loop that may be polling a device, in place of the
+   fast variant's handler */
+static void fast_loop(const struct insn *in) {
+	fast_ops[RVC_COMPRESSED(in->raw)][in->id](in);
+	if (next_pc != M.pc + insn_len(in))
+		cpu_poll_loop(next_pc, in->rd);
+}
+
+struct interp {
+	exec_f *const (*ops)[N_INSN_IDS];
+	void (*run)(uint64_t end);
+	exec_f *loop;
+};
+
+static const struct interp interps[] = {
+	{ fast_ops, fast_run, fast_loop },
+	{ trace_ops, trace_run },
+	{ debug_ops, debug_run },
+	{ record_ops, record_run },
+	{ profile_ops, profile_run },
+	{ cache_ops, cache_run },
+};
+
+static const struct interp watch_interp = { watch_ops, watch_run };
+
+static __thread void (*run)(uint64_t end);
+static __thread const struct interp *selected; /* by cpu_init() */
+static __thread void (*engine_run)(uint64_t end);
+
+/* Switch to the watch variant while there are watchpoints */
+static void select_interp(void) {
+	const struct interp *interp = n_watchpoints ? &watch_interp : selected;
+	if (exec_ops == interp->ops)
+		return;
+	exec_ops = interp->ops;
+	exec_loop = interp->loop;
+	run = n_watchpoints ? watch_run : engine_run;
+	flush_code();
+}
+
+int cpu_set_breakpoint(uint32_t pc, bool set) {
+	int i;
+	for (i = 0; i < n_breakpoints && breakpoints[i] != pc; ++i)
+		;
+	if (set) {
+		if (i < n_breakpoints)
+			return 0;
+		if (n_breakpoints == CPU_MAX_BREAKPOINTS)
+			return -ENOSPC;
+		breakpoints[n_breakpoints++] = pc;
+	} else {
+		if (i == n_breakpoints)
+			return -ENOENT;
+		breakpoints[i] = breakpoints[--n_breakpoints];
+	}
+
+	memset(break_map, 0, sizeof break_map);
+	for (i = 0; i < n_breakpoints; ++i) {
+		break_map[breakpoints[i] >> (CPU_CODE_PAGE_BITS + 3)] |=
+			1 << ((breakpoints[i] >> CPU_CODE_PAGE_BITS) & 7);
+	}
+	/* redecoded and retranslated around the breakpoint */
+	cpu_invalidate_code(pc, 2);
+	return 0;
+}
+
+int cpu_set_watchpoint(uint32_t addr, uint32_t len, int kind, bool set) {
+	int i;
+	for (i = 0; i < n_watchpoints; ++i) {
+		const struct watchpoint *w = &watchpoints[i];
+		if (w->addr == addr && w->len == len && w->kind == kind)
+			break;
+	}
+	if (set) {
+		if (n_watchpoints == CPU_MAX_WATCHPOINTS)
+			return -ENOSPC;
+		watchpoints[n_watchpoints++] = (struct watchpoint){ addr, len, kind };
+	} else {
+		if (i == n_watchpoints)
+			return -ENOENT;
+		watchpoints[i] = watchpoints[--n_watchpoints];
+	}
+	select_interp();
+	return 0;
+}
+
+void cpu_resume(void) {
+	cpu_stopped = CPU_STOP_NONE;
+	resume_pc = M.pc;
+	resume_instret = M.instret;
+}
+
+/* Waiting in WFI, time passes up to end or the next event, which may
+   bring the interrupt. Cycles go on, instret does not. */
+static void idle(uint64_t end) {
+	if (end > sched_next_event)
+		end = sched_next_event;
+	if (M.instret < end) {
+		csr_idle(end - M.instret);
+		M.instret = end;
+	}
+}
+
+void cpu_run(uint64_t end) {
+	run_end = end;
+	cpu_polling = false;
+	if (cpu_waiting) {
+		idle(end);
+		return;
+	}
+	/* the host FPU is the guest's until the run ends, see fpu.h */
+	fp_check();
+	run(end);
+	fpu_leave();
+}
+
+void cpu_interp_run(uint64_t end) {
+	fast_run(end);
+}
+
+static void halt(void *arg) {
+	cpu_halted = true;
+}
+
+void cpu_halt_on_ebreak(void) {
+	halt_on_ebreak = true;
+	sched_event_init(&halt_event, halt, NULL);
+}
+
+void cpu_print_regs(void) {
+	for (int i = 0; i < 32; i += 4) {
+		printf("%s=%.8x\t%s=%.8x\t%s=%.8x\t%s=%.8x\n",
+				regname[i], M.regs[i], regname[i+1], M.regs[i + 1],
+				regname[i+2], M.regs[i + 2], regname[i+3], M.regs[i + 3]);
+	}
+	if (!(mstatus_get() & MST_FS))
+		return;
+	for (int i = 0; i < 32; i += 4) {
+		printf("%s=%.8x\t%s=%.8x\t%s=%.8x\t%s=%.8x\n",
+				fregname[i], M.fregs[i], fregname[i+1], M.fregs[i + 1],
+				fregname[i+2], M.fregs[i + 2], fregname[i+3], M.fregs[i + 3]);
+	}
+}
+
+void cpu_init(enum cpu_engine engine, bool verbose_trace, bool print_regs,
+		bool record, bool profile, bool cache) {
+	const struct interp *interp = &interps[0];
+	if (print_regs)
+		interp = &interps[2];
+	else if (verbose_trace)
+		interp = &interps[1];
+	else if (record)
+		interp = &interps[3];
+	else if (profile)
+		interp = &interps[4];
+	else if (cache)
+		interp = &interps[5];
+
+	verbose = verbose_trace;
+	selected = interp;
+	exec_ops = interp->ops;
+	exec_loop = interp->loop;
+	run = interp->run;
+	if (engine != CPU_INTERP) {
+		threaded_init(engine == CPU_JIT);
+		run = threaded_run;
+	}
+	engine_run = run;
+	protect_code = engine == CPU_JIT;
+	halt_on_ebreak = false;
+	cpu_halted = false;
+	cpu_waiting = false;
+	cpu_polling = false;
+	memset(&poll_last, 0, sizeof poll_last);
+	poll_last.head = DCACHE_INVALID;
+	sched_event_init(&wfi_event, wfi_check, NULL);
+	sched_event_init(&stop_event, stopped, NULL);
+	cpu_stopped = CPU_STOP_NONE;
+	n_breakpoints = 0;
+	n_watchpoints = 0;
+	memset(break_map, 0, sizeof break_map);
+	resume_pc = DCACHE_INVALID;
+	reserved_addr = RESERVATION_NONE;
+
+	/* initialize machine state */
+	memset(&M, 0, sizeof M);
+	M.pc = 0;
+	csr_init();
+	decoded_rm = fp_state();
+
+	for (int i = 0; i < DCACHE_SIZE; ++i)
+		dcache[i].pc = DCACHE_INVALID;
+	memset(cpu_code_map, 0, sizeof cpu_code_map);
+}
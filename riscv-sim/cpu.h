@@ -0,0 +1,122 @@
+#ifndef RVSIM_CPU_H
+#define RVSIM_CPU_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct machine {
+	uint32_t pc;
+	uint32_t regs[32];
+	uint32_t fregs[32]; /* F extension, bits of single precision values */
+	uint64_t instret; /* also the cycle count, CPI is taken to be 1 */
+};
+
+/* All machine state is thread local: a thread runs one machine at a time,
+   and a process can run as many as it has threads (see batch.c). */
+extern __thread struct machine M;
+
+enum cpu_engine {
+	CPU_INTERP,   /* one handler call per instruction, supports tracing */
+	CPU_THREADED, /* direct threaded basic blocks, see threaded.c */
+	CPU_JIT,      /* threaded, hot blocks translated to x86-64, see jit.c */
+};
+
+/* Selects the execution engine and, for the interpreter, its variant:
+   tracing, register dumps, binary trace recording, profiling and the
+   cache model are compiled out unless requested. record requires
+   trace_open(), profile prof_init() and cache cache_init() to have been
+   called. The threaded engine and the JIT run without any of them. */
+extern void cpu_init(enum cpu_engine engine, bool verbose, bool print_regs,
+		bool record, bool profile, bool cache);
+
+/* Run until M.instret reaches end or the next scheduled device event.
+   While the hart waits in WFI, this only lets the time pass. */
+extern void cpu_run(uint64_t end);
+extern void cpu_print_regs(void);
+
+/* Make ebreak stop the machine instead of being a no-op: cpu_run()
+   returns right after it and cpu_halted is set once the device events
+   due at that point have run. Call after cpu_init(). */
+extern void cpu_halt_on_ebreak(void);
+extern __thread bool cpu_halted;
+
+/* Set by WFI until an enabled interrupt is pending. The wait is a hint:
+   it is not part of checkpoints. */
+extern __thread bool cpu_waiting;
+
+/* Idle loop detection, for firmware that polls a device in a loop like
+   uart_read() does. A candidate is a conditional branch back over at
+   most CPU_POLL_MAX_INSNS instructions that only load and compute. The
+   engines call cpu_poll_loop() when one is taken; if an iteration of
+   n_insns instructions left the registers as they were and neither an
+   event nor a device read with side effects happened meanwhile, every
+   further iteration does the same until the next event, so whole
+   iterations are skipped up to it. M.instret advances as if they ran.
+   cpu_polling is then set until the next cpu_run(), so that the UART may
+   block for input. Only in the fast interpreter and the threaded
+   engine, and with a single hart. */
+#define CPU_POLL_MAX_INSNS 8
+
+extern __thread bool cpu_polling;
+extern void cpu_poll_loop(uint32_t head, uint32_t n_insns);
+
+/* Debugger support, see gdb.c. Execution stops before the instruction at
+   a breakpoint, which the decode cache sends to a stopping handler and
+   the threaded engine never puts into a block, so breakpoints cost
+   nothing until one is hit. Watchpoints stop after a load or store
+   touching the watched range; while any is set, every engine runs the
+   watch variant of the interpreter instead. cpu_run() returns early on
+   a stop, with cpu_stopped set. */
+#define CPU_MAX_BREAKPOINTS 64
+#define CPU_MAX_WATCHPOINTS 8
+
+#define CPU_WATCH_WRITE  0x1
+#define CPU_WATCH_READ   0x2
+#define CPU_WATCH_ACCESS (CPU_WATCH_WRITE | CPU_WATCH_READ)
+
+enum cpu_stop {
+	CPU_STOP_NONE,
+	CPU_STOP_BREAK,
+	CPU_STOP_WATCH,
+};
+
+extern __thread enum cpu_stop cpu_stopped;
+extern __thread uint32_t cpu_stop_addr; /* watched range that was hit */
+extern __thread int cpu_stop_watch; /* its CPU_WATCH_* */
+
+/* RETURN VALUE: 0 on success, -ENOSPC if too many are set, -ENOENT when
+   removing one that is not */
+extern int cpu_set_breakpoint(uint32_t pc, bool set);
+extern int cpu_set_watchpoint(uint32_t addr, uint32_t len, int kind,
+		bool set);
+extern bool cpu_breakpoint(uint32_t pc);
+
+/* Clear cpu_stopped before running on. A breakpoint at M.pc is stepped
+   over, not hit again. */
+extern void cpu_resume(void);
+
+/* Take the interrupt that is pending and enabled, if any, at M.pc. For
+   irq.c, between two instructions. */
+extern void cpu_interrupt(void);
+
+/* Value of mhartid, 0 unless set by hart.c */
+extern __thread uint32_t cpu_hartid;
+
+/* One bit per 4K guest page that instructions have been decoded from */
+#define CPU_CODE_PAGE_BITS 12
+#define CPU_CODE_MAP_SIZE (1 << (32 - CPU_CODE_PAGE_BITS - 3))
+
+extern __thread uint8_t cpu_code_map[CPU_CODE_MAP_SIZE];
+extern void cpu_invalidate_code(uint32_t addr, uint32_t len);
+
+/* Drop any predecoded instruction overlapping the len bytes at addr, which
+   do not cross a page. Must be called whenever guest memory that may
+   contain code is written. Stores to pages that never held code only cost
+   the bitmap test. */
+static inline void cpu_invalidate(uint32_t addr, uint32_t len) {
+	if (cpu_code_map[addr >> (CPU_CODE_PAGE_BITS + 3)] &
+			(1 << ((addr >> CPU_CODE_PAGE_BITS) & 7)))
+		cpu_invalidate_code(addr, len);
+}
+
+#endif /* RVSIM_CPU_H */
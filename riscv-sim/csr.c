@@ -1,81 +1,290 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
 #include "csr.h"
+#include "csr/mstatus.h"
+#include "fpu.h"
+#include "irq.h"
+
+/* misa: RV32 with the extensions implemented by cpu.c */
+#define MISA_MXL_32 (1u << 30)
+#define MISA_EXT(c) (1u << ((c) - 'A'))
+#define MISA (MISA_MXL_32 | MISA_EXT('A') | MISA_EXT('C') | MISA_EXT('F') | \
+	MISA_EXT('I') | MISA_EXT('M'))
+
+/* Machine software, timer and external interrupts */
+#define MIE_MASK ((1 << IRQ_MSI) | (1 << IRQ_MTI) | (1 << IRQ_MEI))
+
+/* mtvec at reset: the undef vector of test/head.S, which all traps go to
+   until the firmware installs its own handler */
+#define MTVEC_RESET 0x4
+#define MTVEC_VECTORED 0x1
+
+/* CSR numbers with the two top bits set are read-only */
+#define CSR_READ_ONLY(reg) (((reg) >> 10) == 0x3)
 
 typedef int csrset_f(uint16_t addr, uint32_t value);
 typedef int csrget_f(uint16_t addr, uint32_t *value);
 
 struct csr_desc {
 	char *name;
-	uint16_t addr; /* 12 bit address */
-	csrget_f *do_get;
-	csrset_f *do_set;
+	csrget_f *do_get; /* NULL if the CSR does not exist */
+	csrset_f *do_set; /* NULL for read-only CSRs */
 };
 
+static __thread struct csr_state S;
+
 static int set_nothing(uint16_t addr, uint32_t value) {
 	return 0;
 }
 
 static int get_zero(uint16_t addr, uint32_t *value) {
+	*value = 0;
+	return 0;
+}
+
+static int get_misa(uint16_t addr, uint32_t *value) {
+	*value = MISA;
+	return 0;
+}
+
+static int get_mhartid(uint16_t addr, uint32_t *value) {
+	*value = cpu_hartid;
+	return 0;
+}
+
+static int get_mstatus(uint16_t addr, uint32_t *value) {
+	*value = mstatus_get();
+	return 0;
+}
+
+static int set_mstatus(uint16_t addr, uint32_t value) {
+	mstatus_set(value);
+	irq_update();
+	return 0;
+}
+
+static int get_mip(uint16_t addr, uint32_t *value) {
+	*value = irq_pending();
+	return 0;
+}
+
+/* fflags, frm and fcsr, views of the one register in fpu.c. They are
+   not there for the guest while mstatus.FS is off. */
+static int get_fcsr(uint16_t addr, uint32_t *value) {
+	if (!(mstatus_get() & MST_FS))
+		return -EACCES;
+	uint32_t fcsr = fpu_get_fcsr();
+	switch (addr) {
+	case CSR_FFLAGS: *value = fcsr & FPU_FLAGS; break;
+	case CSR_FRM:    *value = fcsr >> 5; break;
+	default:         *value = fcsr; break;
+	}
+	return 0;
+}
+
+static int set_fcsr(uint16_t addr, uint32_t value) {
+	if (!(mstatus_get() & MST_FS))
+		return -EACCES;
+	switch (addr) {
+	case CSR_FFLAGS: fpu_set_fflags(value); break;
+	case CSR_FRM:    fpu_set_frm(value); break;
+	default:         fpu_set_fcsr(value); break;
+	}
+	return 0;
+}
+
+/* Plain registers in S, with the bits that are writable */
+static uint32_t *reg_of(uint16_t addr, uint32_t *mask) {
+	switch (addr) {
+	case CSR_MIE:      *mask = MIE_MASK; return &S.mie;
+	case CSR_MTVEC:    *mask = ~0x2u; return &S.mtvec; /* direct or vectored */
+	case CSR_MSCRATCH: *mask = ~0u; return &S.mscratch;
+	case CSR_MEPC:     *mask = ~0x1u; return &S.mepc;
+	case CSR_MCAUSE:   *mask = ~0u; return &S.mcause;
+	case CSR_MTVAL:    *mask = ~0u; return &S.mtval;
+	default:           return NULL; /* not registered with get_reg() */
+	}
+}
+
+static int get_reg(uint16_t addr, uint32_t *value) {
+	uint32_t mask;
+	*value = *reg_of(addr, &mask);
+	return 0;
+}
+
+static int set_reg(uint16_t addr, uint32_t value) {
+	uint32_t mask;
+	uint32_t *reg = reg_of(addr, &mask);
+	*reg = value & mask;
+	if (addr == CSR_MIE)
+		irq_update();
 	return 0;
 }
 
-#define N_CSR 2
-static struct csr_desc csr[N_CSR] = {
-	{
-		.name = "mstatus",
-		.addr = 0x300,
-		.do_get = NULL,
-		.do_set = NULL,
-	},
-	{
-		.name = "misa",
-		.addr = 0x301,
-		.do_get = get_zero,
-		.do_set = set_nothing,
-	},
-	{
-		.name = "mvendorid",
-		.addr = 0xF11,
-		.do_get = get_zero,
-		.do_set = set_nothing,
-	},
-	{
-		.name = "marchid",
-		.addr = 0xF12,
-		.do_get = get_zero,
-		.do_set = set_nothing,
-	},
-	{
-		.name = "mimpid",
-		.addr = 0xF13,
-		.do_get = get_zero,
-		.do_set = set_nothing,
-	},
-	{
-		.name = "mhartid",
-		.addr = 0xF14,
-		.do_get = get_zero,
-		.do_set = set_nothing,
-	},
+/* Counters. CPI is taken to be 1, so cycle and instret both follow
+   M.instret and only differ once the guest writes one of them. A write
+   replaces the increment of the writing instruction: the next instruction
+   reads the value written. */
+
+/* The instret CSRs are the cycle ones + 2, high halves are at + 0x80 */
+static uint64_t *offset_of(uint16_t addr) {
+	return (addr & 0x2) ? &S.instret_offset : &S.cycle_offset;
+}
+
+static int get_counter(uint16_t addr, uint32_t *value) {
+	uint64_t v = M.instret - 1 + *offset_of(addr);
+	*value = (addr & 0x80) ? v >> 32 : v;
+	return 0;
+}
+
+/* The CLINT's mtime */
+static int get_time(uint16_t addr, uint32_t *value) {
+	uint64_t v = irq_mtime();
+	*value = (addr & 0x80) ? v >> 32 : v;
+	return 0;
+}
+
+static int set_counter(uint16_t addr, uint32_t value) {
+	uint64_t *offset = offset_of(addr);
+	uint64_t v = M.instret - 1 + *offset;
+	if (addr & 0x80)
+		v = (uint64_t)value << 32 | (uint32_t)v;
+	else
+		v = (v & ~(uint64_t)0xffffffff) | value;
+	*offset = v - M.instret;
+	return 0;
+}
+
+#define RO(n, get) { .name = n, .do_get = get }
+#define RW(n, get, set) { .name = n, .do_get = get, .do_set = set }
+
+static const struct csr_desc csr[CSR_COUNT] = {
+	[CSR_FFLAGS] = RW("fflags", get_fcsr, set_fcsr),
+	[CSR_FRM]    = RW("frm", get_fcsr, set_fcsr),
+	[CSR_FCSR]   = RW("fcsr", get_fcsr, set_fcsr),
+
+	[CSR_CYCLE]    = RO("cycle", get_counter),
+	[CSR_TIME]     = RO("time", get_time),
+	[CSR_INSTRET]  = RO("instret", get_counter),
+	[CSR_CYCLEH]   = RO("cycleh", get_counter),
+	[CSR_TIMEH]    = RO("timeh", get_time),
+	[CSR_INSTRETH] = RO("instreth", get_counter),
+	[CSR_HPMCOUNTER3 ... CSR_HPMCOUNTER31] = RO("hpmcounter", get_zero),
+	[CSR_HPMCOUNTER3H ... CSR_HPMCOUNTER31H] = RO("hpmcounterh", get_zero),
+
+	[CSR_MVENDORID] = RO("mvendorid", get_zero),
+	[CSR_MARCHID]   = RO("marchid", get_zero),
+	[CSR_MIMPID]    = RO("mimpid", get_zero),
+	[CSR_MHARTID]   = RO("mhartid", get_mhartid),
+
+	[CSR_MSTATUS] = RW("mstatus", get_mstatus, set_mstatus),
+	[CSR_MISA]    = RW("misa", get_misa, set_nothing),
+	[CSR_MIE]     = RW("mie", get_reg, set_reg),
+	[CSR_MTVEC]   = RW("mtvec", get_reg, set_reg),
+	[CSR_MHPMEVENT3 ... CSR_MHPMEVENT31] =
+		RW("mhpmevent", get_zero, set_nothing),
+
+	[CSR_MSCRATCH] = RW("mscratch", get_reg, set_reg),
+	[CSR_MEPC]     = RW("mepc", get_reg, set_reg),
+	[CSR_MCAUSE]   = RW("mcause", get_reg, set_reg),
+	[CSR_MTVAL]    = RW("mtval", get_reg, set_reg),
+	[CSR_MIP]      = RW("mip", get_mip, set_nothing), /* set by devices */
+
+	[CSR_PMPCFG0 ... CSR_PMPCFG3] = RW("pmpcfg", get_zero, set_nothing),
+	[CSR_PMPADDR0 ... CSR_PMPADDR15] = RW("pmpaddr", get_zero, set_nothing),
+
+	[CSR_MCYCLE]    = RW("mcycle", get_counter, set_counter),
+	[CSR_MINSTRET]  = RW("minstret", get_counter, set_counter),
+	[CSR_MCYCLEH]   = RW("mcycleh", get_counter, set_counter),
+	[CSR_MINSTRETH] = RW("minstreth", get_counter, set_counter),
+	[CSR_MHPMCOUNTER3 ... CSR_MHPMCOUNTER31] =
+		RW("mhpmcounter", get_zero, set_nothing),
+	[CSR_MHPMCOUNTER3H ... CSR_MHPMCOUNTER31H] =
+		RW("mhpmcounterh", get_zero, set_nothing),
 };
 
+#undef RO
+#undef RW
+
 int csr_set(uint16_t reg, uint32_t value) {
-	for (int i = 0; i < N_CSR; ++i) {
-		struct csr_desc c = csr[i];
-		if (c.do_set)
-			return c.do_set(reg, value);
-		else
-			return -EINVAL;
-	}
-	return -EINVAL;
+	const struct csr_desc *c = &csr[reg & (CSR_COUNT - 1)];
+	if (c->do_get == NULL)
+		return -EINVAL;
+	if (c->do_set == NULL || CSR_READ_ONLY(reg))
+		return -EACCES;
+	return c->do_set(reg, value);
 }
 
 int csr_get(uint16_t reg, uint32_t *value) {
-	for (int i = 0; i < N_CSR; ++i) {
-		struct csr_desc c = csr[i];
-		if (c.do_get)
-			return c.do_get(reg, value);
-		else
-			return -EINVAL;
+	const struct csr_desc *c = &csr[reg & (CSR_COUNT - 1)];
+	if (c->do_get == NULL)
+		return -EINVAL;
+	return c->do_get(reg, value);
+}
+
+const char *csr_name(uint16_t reg) {
+	return csr[reg & (CSR_COUNT - 1)].name;
+}
+
+uint32_t csr_trap(uint32_t cause, uint32_t epc, uint32_t tval) {
+	uint32_t old = mstatus_get();
+	uint32_t mstatus = old & ~(MST_MIE | MST_MPIE);
+	if (old & MST_MIE)
+		mstatus |= MST_MPIE;
+	mstatus_set(mstatus);
+
+	S.mepc = epc & ~0x1u;
+	S.mcause = cause;
+	S.mtval = tval;
+	uint32_t base = S.mtvec & ~0x3u;
+	if ((cause & CAUSE_INTERRUPT) && (S.mtvec & MTVEC_VECTORED))
+		return base + 4 * (cause & ~CAUSE_INTERRUPT);
+	return base;
+}
+
+uint32_t csr_mret(void) {
+	uint32_t old = mstatus_get();
+	uint32_t mstatus = (old & ~MST_MIE) | MST_MPIE;
+	if (old & MST_MPIE)
+		mstatus |= MST_MIE;
+	mstatus_set(mstatus);
+	irq_update();
+	return S.mepc;
+}
+
+/* External, then software, then timer, as in the privileged spec */
+int csr_interrupt(void) {
+	static const int priority[] = { IRQ_MEI, IRQ_MSI, IRQ_MTI };
+	uint32_t pending = irq_pending() & S.mie;
+	for (int i = 0; i < 3; ++i) {
+		if (pending & (1u << priority[i]))
+			return priority[i];
 	}
-	return -EINVAL;
+	return -1;
+}
+
+void csr_idle(uint64_t cycles) {
+	S.instret_offset -= cycles;
+}
+
+void csr_init(void) {
+	S = (struct csr_state){ 0 };
+	S.mtvec = MTVEC_RESET;
+	mstatus_set(0);
+	fpu_set_fcsr(0);
+}
+
+void csr_save(struct csr_state *s) {
+	*s = S;
+	s->mstatus = mstatus_get();
+	s->fcsr = fpu_get_fcsr();
+}
+
+void csr_restore(const struct csr_state *s) {
+	S = *s;
+	mstatus_set(s->mstatus);
+	fpu_set_fcsr(s->fcsr);
 }
@@ -1,27 +1,44 @@
 #ifndef RVSIM_CSR_H
 #define RVSIM_CSR_H 1
 
+#include <stdint.h>
+
+#define CSR_COUNT 4096 /* 12 bit addresses */
+
 enum {
-	/* User Counter/Timers */ /* not needed */
+	/* User Floating-Point CSRs */
+	CSR_FFLAGS     = 0x001, /* URW */
+	CSR_FRM        = 0x002, /* URW */
+	CSR_FCSR       = 0x003, /* URW */
+
+	/* User Counter/Timers */
 	CSR_CYCLE      = 0xC00, /* URO */
 	CSR_TIME       = 0xC01, /* URO */
 	CSR_INSTRET    = 0xC02, /* URO */
+	CSR_HPMCOUNTER3 = 0xC03, /* URO */ /* up to 31, read zero */
+	CSR_HPMCOUNTER31 = 0xC1F, /* URO */
 	CSR_CYCLEH     = 0xC80, /* URO */
 	CSR_TIMEH      = 0xC81, /* URO */
 	CSR_INSTRETH   = 0xC82, /* URO */
+	CSR_HPMCOUNTER3H = 0xC83, /* URO */
+	CSR_HPMCOUNTER31H = 0xC9F, /* URO */
 
 	/* Machine Information Registers */
 	CSR_MVENDORID  = 0xF11, /* MRO */ /* return 0 if not implemented */
 	CSR_MARCHID    = 0xF12, /* MRO */ /* return 0 if not implemented */
 	CSR_MIMPID     = 0xF13, /* MRO */ /* return 0 if not implemented */
-	CSR_MHARTID    = 0xF14, /* MRO */ /* return 0 - single core system */
+	CSR_MHARTID    = 0xF14, /* MRO */ /* cpu_hartid */
 
 	/* Machine Trap Setup */
 	CSR_MSTATUS    = 0x300, /* MRW */
 	CSR_MISA       = 0x301, /* MRW */ /* return 0 if not implemented */
 	CSR_MIE        = 0x304, /* MRW */
 	CSR_MTVEC      = 0x305, /* MRW */
-	CSR_MCOUNTEREN = 0x306, /* MRW */
+	CSR_MCOUNTEREN = 0x306, /* MRW */ /* not implemented, no U-mode */
+
+	/* Machine Counter Setup */
+	CSR_MHPMEVENT3 = 0x323, /* MRW */ /* up to 31, read zero */
+	CSR_MHPMEVENT31 = 0x33F, /* MRW */
 
 	/* Machine Trap Handling */
 	CSR_MSCRATCH   = 0x340, /* MRW */
@@ -31,7 +48,7 @@ enum {
 	CSR_MIP        = 0x344, /* MRW */
 
 	/* Machine Protection and Translation */
-	CSR_PMPCFG0    = 0x3A0, /* MRW */
+	CSR_PMPCFG0    = 0x3A0, /* MRW */ /* no PMP entries, all read zero */
 	CSR_PMPCFG1    = 0x3A1, /* MRW */
 	CSR_PMPCFG2    = 0x3A2, /* MRW */
 	CSR_PMPCFG3    = 0x3A3, /* MRW */
@@ -55,11 +72,70 @@ enum {
 	/* Machine Counter/Timers */
 	CSR_MCYCLE     = 0xB00, /* MRW */
 	CSR_MINSTRET   = 0xB02, /* MRW */
+	CSR_MHPMCOUNTER3 = 0xB03, /* MRW */ /* up to 31, read zero */
+	CSR_MHPMCOUNTER31 = 0xB1F, /* MRW */
 	CSR_MCYCLEH    = 0xB80, /* MRW */
 	CSR_MINSTRETH  = 0xB82, /* MRW */
+	CSR_MHPMCOUNTER3H = 0xB83, /* MRW */
+	CSR_MHPMCOUNTER31H = 0xB9F, /* MRW */
+};
+
+/* mcause values. Interrupts have the top bit set and their number from
+   irq.h below it. */
+#define CAUSE_INTERRUPT    (1u << 31)
+#define CAUSE_FETCH_ACCESS 1
+#define CAUSE_ILLEGAL_INSN 2
+#define CAUSE_ECALL_M      11
+
+/* Guest visible CSR state, for checkpoints. The counters are not stored
+   as such: cycle and instret are M.instret plus an offset that changes
+   only when the guest writes them. */
+struct csr_state {
+	uint32_t mstatus;
+	uint32_t mie;
+	uint32_t mtvec;
+	uint32_t mscratch;
+	uint32_t mepc;
+	uint32_t mcause;
+	uint32_t mtval;
+	uint32_t fcsr;
+	uint64_t cycle_offset;
+	uint64_t instret_offset;
 };
 
+/* Reset values, called by cpu_init() */
+extern void csr_init(void);
+
+/* Access by CSR number through a table indexed by it. Meant to be called
+   while a CSR instruction executes: M.instret then already counts that
+   instruction, which the counters leave out.
+   RETURN VALUE: 0 on success, -EINVAL if the CSR does not exist,
+   -EACCES on a write to a read-only CSR or on any access to the F CSRs
+   while mstatus.FS is off */
 extern int csr_set(uint16_t reg, uint32_t value);
 extern int csr_get(uint16_t reg, uint32_t *value);
 
+/* Name of a CSR for traces, NULL if it does not exist */
+extern const char *csr_name(uint16_t reg);
+
+/* Enter a trap: epc goes to mepc, mstatus.MIE is stacked into MPIE and
+   cleared. Interrupts in vectored mode go to mtvec + 4 * their number.
+   RETURN VALUE: pc of the trap handler */
+extern uint32_t csr_trap(uint32_t cause, uint32_t epc, uint32_t tval);
+
+/* MRET: unstack mstatus.MIE.
+   RETURN VALUE: mepc, the pc to return to */
+extern uint32_t csr_mret(void);
+
+/* Highest priority interrupt pending in mip and enabled in mie,
+   regardless of mstatus.MIE, -1 if none */
+extern int csr_interrupt(void);
+
+/* Cycles spent waiting for an interrupt: M.instret moves on by that many
+   but instret does not */
+extern void csr_idle(uint64_t cycles);
+
+extern void csr_save(struct csr_state *s);
+extern void csr_restore(const struct csr_state *s);
+
 #endif /* RVSIM_CSR_H */
@@ -2,4 +2,17 @@
 
 #include "csr/mstatus.h"
 
-static uint32_t mstatus = 0;
+#define MST_WRITABLE (MST_MIE | MST_MPIE | MST_FS)
+#define MST_ONES (MST_MPP0 | MST_MPP1) /* machine mode is all there is */
+
+static __thread uint32_t mstatus = MST_ONES;
+
+uint32_t mstatus_get(void) {
+	return mstatus;
+}
+
+void mstatus_set(uint32_t value) {
+	mstatus = (value & MST_WRITABLE) | MST_ONES;
+	if (mstatus & MST_FS)
+		mstatus |= MST_FS | MST_SD;
+}
@@ -1,6 +1,8 @@
 #ifndef RVSIM_CSR_MSTATUS_H
 #define RVSIM_CSR_MSTATUS_H 1
 
+#include <stdint.h>
+
 #define MST_UIE   (1 << 0)  /* Always zero */
 #define MST_SIE   (1 << 1)  /* Always zero */
 #define MST_MIE   (1 << 3)
@@ -10,8 +12,8 @@
 #define MST_SPP   (1 << 8)  /* Always zero */
 #define MST_MPP0  (1 << 11) /* Always 1 */
 #define MST_MPP1  (1 << 12) /* Always 1 */
-#define MST_FS0   (1 << 13) /* Always zero */
-#define MST_FS1   (1 << 14) /* Always zero */
+#define MST_FS0   (1 << 13) /* Off or Dirty, see mstatus_set() */
+#define MST_FS1   (1 << 14)
 #define MST_XS0   (1 << 15) /* Always zero */
 #define MST_XS1   (1 << 16) /* Always zero */
 #define MST_MPRV  (1 << 17) /* Always zero */
@@ -20,6 +22,14 @@
 #define MST_TVM   (1 << 20) /* Always zero */
 #define MST_TW    (1 << 21) /* Always zero */
 #define MST_TSR   (1 << 22) /* Always zero */
-#define MST_SD    (1 << 31) /* Always zero */
+#define MST_SD    (1 << 31) /* Set with FS */
+
+#define MST_FS (MST_FS0 | MST_FS1)
+
+/* Writes only change the bits not documented as fixed above. FS, the
+   state of the F extension, is Off or Dirty: any other value written
+   turns it on as Dirty, since the F state is not tracked any closer. */
+extern uint32_t mstatus_get(void);
+extern void mstatus_set(uint32_t value);
 
 #endif /* RVSIM_CSR_MSTATUS_H */
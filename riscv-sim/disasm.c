@@ -0,0 +1,429 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "disasm.h"
+#include "rvc.h"
+
+enum {
+	REG_ZERO = 0,
+	REG_RA   = 1,
+	REG_SP   = 2,
+	REG_GP   = 3,
+	REG_TP   = 4,
+	REG_T0   = 5,
+	REG_T1   = 6,
+	REG_T2   = 7,
+	REG_S0   = 8,
+	REG_S1   = 9,
+	REG_A0   = 10,
+	REG_A1   = 11,
+	REG_A2   = 12,
+	REG_A3   = 13,
+	REG_A4   = 14,
+	REG_A5   = 15,
+	REG_A6   = 16,
+	REG_A7   = 17,
+	REG_S2   = 18,
+	REG_S3   = 19,
+	REG_S4   = 20,
+	REG_S5   = 21,
+	REG_S6   = 22,
+	REG_S7   = 23,
+	REG_S8   = 24,
+	REG_S9   = 25,
+	REG_S10  = 26,
+	REG_S11  = 27,
+	REG_T3   = 28,
+	REG_T4   = 29,
+	REG_T5   = 30,
+	REG_T6   = 31,
+};
+
+const char *const regname[32] = {
+	[REG_ZERO] = "zero",
+	[REG_RA]   = "ra",
+	[REG_SP]   = "sp",
+	[REG_GP]   = "gp",
+	[REG_TP]   = "tp",
+	[REG_T0]   = "t0",
+	[REG_T1]   = "t1",
+	[REG_T2]   = "t2",
+	[REG_S0]   = "s0",
+	[REG_S1]   = "s1",
+	[REG_A0]   = "a0",
+	[REG_A1]   = "a1",
+	[REG_A2]   = "a2",
+	[REG_A3]   = "a3",
+	[REG_A4]   = "a4",
+	[REG_A5]   = "a5",
+	[REG_A6]   = "a6",
+	[REG_A7]   = "a7",
+	[REG_S2]   = "s2",
+	[REG_S3]   = "s3",
+	[REG_S4]   = "s4",
+	[REG_S5]   = "s5",
+	[REG_S6]   = "s6",
+	[REG_S7]   = "s7",
+	[REG_S8]   = "s8",
+	[REG_S9]   = "s9",
+	[REG_S10]  = "s10",
+	[REG_S11]  = "s11",
+	[REG_T3]   = "t3",
+	[REG_T4]   = "t4",
+	[REG_T5]   = "t5",
+	[REG_T6]   = "t6",
+};
+
+const char *const fregname[32] = {
+	"ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "ft6", "ft7",
+	"fs0", "fs1", "fa0", "fa1", "fa2", "fa3", "fa4", "fa5",
+	"fa6", "fa7", "fs2", "fs3", "fs4", "fs5", "fs6", "fs7",
+	"fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11",
+};
+
+const char *const rmname[8] = {
+	",rne", ",rtz", ",rdn", ",rup", ",rmm", ",5", ",6", "",
+};
+
+static int32_t sext(uint32_t imm, int signPos) {
+	int shift = 31 - signPos;
+	return (int32_t)(imm << shift) >> shift;
+}
+
+static const char *const load_names[8] = {
+	"lb", "lh", "lw", NULL, "lbu", "lhu", NULL, NULL,
+};
+static const char *const store_names[8] = {
+	"sb", "sh", "sw", NULL, NULL, NULL, NULL, NULL,
+};
+static const char *const imm_names[8] = {
+	"addi", "slli", "slti", "sltiu", "xori", "srli", "ori", "andi",
+};
+static const char *const op_names[8] = {
+	"add", "sll", "slt", "sltu", "xor", "srl", "or", "and",
+};
+static const char *const muldiv_names[8] = {
+	"mul", "mulh", "mulhsu", "mulhu", "div", "divu", "rem", "remu",
+};
+static const char *const branch_names[8] = {
+	"beq", "bne", NULL, NULL, "blt", "bge", "bltu", "bgeu",
+};
+
+static const char *const fma_names[4] = {
+	"fmadd.s", "fmsub.s", "fnmsub.s", "fnmadd.s",
+};
+
+static const char *const fsgnj_names[8] = {
+	"fsgnj.s", "fsgnjn.s", "fsgnjx.s", NULL, NULL, NULL, NULL, NULL,
+};
+static const char *const fcmp_names[8] = {
+	"fle.s", "flt.s", "feq.s", NULL, NULL, NULL, NULL, NULL,
+};
+
+static const char *const csr_names[8] = {
+	NULL, "csrrw", "csrrs", "csrrc", NULL, "csrrwi", "csrrsi", "csrrci",
+};
+
+static const char *const amo_names[32] = {
+	[0x00] = "amoadd.w", [0x01] = "amoswap.w", [0x02] = "lr.w",
+	[0x03] = "sc.w", [0x04] = "amoxor.w", [0x08] = "amoor.w",
+	[0x0C] = "amoand.w", [0x10] = "amomin.w", [0x14] = "amomax.w",
+	[0x18] = "amominu.w", [0x1C] = "amomaxu.w",
+};
+
+/* OP_FP, single precision only */
+static void decode_fp(uint32_t instr, uint32_t funct3, uint32_t funct7,
+		struct dis_insn *d) {
+	static const char *const arith_names[4] = {
+		"fadd.s", "fsub.s", "fmul.s", "fdiv.s",
+	};
+	const int all = DIS_F_RD | DIS_F_RS1 | DIS_F_RS2;
+
+	d->fmt = DIS_R2;
+	switch (funct7) {
+	case 0x00: case 0x04: case 0x08: case 0x0C:
+		d->name = arith_names[funct7 >> 2];
+		d->fmt = DIS_R;
+		d->fregs = all;
+		d->rm = funct3;
+		break;
+	case 0x2C:
+		if (d->rs2 == 0)
+			d->name = "fsqrt.s";
+		d->fregs = DIS_F_RD | DIS_F_RS1;
+		d->rm = funct3;
+		break;
+	case 0x10:
+		d->name = fsgnj_names[funct3];
+		d->fmt = DIS_R;
+		d->fregs = all;
+		break;
+	case 0x14:
+		if (funct3 < 2)
+			d->name = funct3 == 0 ? "fmin.s" : "fmax.s";
+		d->fmt = DIS_R;
+		d->fregs = all;
+		break;
+	case 0x50:
+		d->name = fcmp_names[funct3];
+		d->fmt = DIS_R;
+		d->fregs = DIS_F_RS1 | DIS_F_RS2;
+		break;
+	case 0x60:
+		if (d->rs2 < 2)
+			d->name = d->rs2 == 0 ? "fcvt.w.s" : "fcvt.wu.s";
+		d->fregs = DIS_F_RS1;
+		d->rm = funct3;
+		break;
+	case 0x68:
+		if (d->rs2 < 2)
+			d->name = d->rs2 == 0 ? "fcvt.s.w" : "fcvt.s.wu";
+		d->fregs = DIS_F_RD;
+		d->rm = funct3;
+		break;
+	case 0x70:
+		if (d->rs2 == 0 && funct3 < 2)
+			d->name = funct3 == 0 ? "fmv.x.w" : "fclass.s";
+		d->fregs = DIS_F_RS1;
+		break;
+	case 0x78:
+		if (d->rs2 == 0 && funct3 == 0)
+			d->name = "fmv.w.x";
+		d->fregs = DIS_F_RD;
+		break;
+	}
+	if (d->fmt == DIS_R2)
+		d->rs2 = -1;
+}
+
+void disasm_decode(uint32_t instr, struct dis_insn *d) {
+	if (RVC_COMPRESSED(instr)) /* as the instruction it expands to */
+		instr = rvc_expand(instr);
+
+	uint32_t funct3 = (instr >> 12) & 0x07;
+	uint32_t funct7 = (instr >> 25) & 0x7F;
+
+	d->name = NULL;
+	d->fmt = DIS_INVALID;
+	d->rd = (instr >> 7) & 0x1F;
+	d->rs1 = (instr >> 15) & 0x1F;
+	d->rs2 = (instr >> 20) & 0x1F;
+	d->rs3 = -1;
+	d->fregs = 0;
+	d->rm = -1;
+	d->imm = 0;
+	d->size = 0;
+
+	if ((instr & 0x03) != 0x03)
+		goto invalid;
+
+	switch ((instr >> 2) & 0x1F) {
+	case 0x00: /* OP_LOAD */
+		d->name = load_names[funct3];
+		d->fmt = DIS_LOAD;
+		d->imm = sext(instr >> 20, 11);
+		d->size = 1 << (funct3 & 0x3);
+		d->rs2 = -1;
+		break;
+	case 0x04: /* OP_IMM */
+		d->name = imm_names[funct3];
+		d->fmt = DIS_I;
+		d->imm = sext(instr >> 20, 11);
+		if (funct3 == 1 || funct3 == 5) {
+			d->imm = d->rs2; /* shamt */
+			if (funct3 == 5 && funct7 == 0x20)
+				d->name = "srai";
+			else if (funct7 != 0x00)
+				d->name = NULL;
+		}
+		d->rs2 = -1;
+		break;
+	case 0x05: /* OP_AUIPC */
+	case 0x0D: /* OP_LUI */
+		d->name = (instr & 0x20) ? "lui" : "auipc";
+		d->fmt = DIS_U;
+		d->imm = instr & 0xFFFFF000;
+		d->rs1 = d->rs2 = -1;
+		break;
+	case 0x08: /* OP_STORE */
+		d->name = store_names[funct3];
+		d->fmt = DIS_STORE;
+		d->imm = sext(((instr >> 20) & 0xFE0) | ((instr >> 7) & 0x1F), 11);
+		d->size = 1 << (funct3 & 0x3);
+		d->rd = -1;
+		break;
+	case 0x0C: /* OP */
+		d->name = op_names[funct3];
+		d->fmt = DIS_R;
+		if (funct7 == 0x20 && funct3 == 0)
+			d->name = "sub";
+		else if (funct7 == 0x20 && funct3 == 5)
+			d->name = "sra";
+		else if (funct7 == 0x01)
+			d->name = muldiv_names[funct3];
+		else if (funct7 != 0x00)
+			d->name = NULL;
+		break;
+	case 0x18: /* OP_BRANCH */
+		d->name = branch_names[funct3];
+		d->fmt = DIS_BRANCH;
+		d->imm = sext(((instr >> 19) & 0x1000) | ((instr << 4) & 0x800) |
+				((instr >> 20) & 0x7E0) | ((instr >> 7) & 0x1E), 12);
+		d->rd = -1;
+		break;
+	case 0x19: /* OP_JALR */
+		d->name = "jalr";
+		d->fmt = DIS_JALR;
+		d->imm = sext(instr >> 20, 11);
+		d->rs2 = -1;
+		break;
+	case 0x1B: /* OP_JAL */
+		d->name = "jal";
+		d->fmt = DIS_JAL;
+		d->imm = sext((instr & 0x80000000) >> 11 | (instr & 0xFF000) |
+				((instr >> 9) & 0x800) | ((instr >> 20) & 0x7FE), 20);
+		d->rs1 = d->rs2 = -1;
+		break;
+	case 0x03: /* OP_MISC_MEM */
+		if (funct3 == 0)
+			d->name = "fence";
+		else if (funct3 == 1)
+			d->name = "fence.i";
+		d->fmt = DIS_SYSTEM;
+		d->rd = d->rs1 = d->rs2 = -1;
+		break;
+	case 0x0B: /* OP_AMO */
+		if (funct3 == 2)
+			d->name = amo_names[funct7 >> 2];
+		d->fmt = DIS_AMO;
+		d->size = 4;
+		if (funct7 >> 2 == 0x02) /* lr.w */
+			d->rs2 = -1;
+		break;
+	case 0x01: /* OP_LOAD_FP */
+		if (funct3 == 2)
+			d->name = "flw";
+		d->fmt = DIS_LOAD;
+		d->fregs = DIS_F_RD;
+		d->imm = sext(instr >> 20, 11);
+		d->size = 4;
+		d->rs2 = -1;
+		break;
+	case 0x09: /* OP_STORE_FP */
+		if (funct3 == 2)
+			d->name = "fsw";
+		d->fmt = DIS_STORE;
+		d->fregs = DIS_F_RS2;
+		d->imm = sext(((instr >> 20) & 0xFE0) | ((instr >> 7) & 0x1F), 11);
+		d->size = 4;
+		d->rd = -1;
+		break;
+	case 0x10: /* OP_MADD */
+	case 0x11: /* OP_MSUB */
+	case 0x12: /* OP_NMSUB */
+	case 0x13: /* OP_NMADD */
+		if ((funct7 & 0x3) == 0)
+			d->name = fma_names[(instr >> 2) & 0x3];
+		d->fmt = DIS_R4;
+		d->fregs = DIS_F_RD | DIS_F_RS1 | DIS_F_RS2 | DIS_F_RS3;
+		d->rs3 = instr >> 27;
+		d->rm = funct3;
+		break;
+	case 0x14: /* OP_FP */
+		decode_fp(instr, funct3, funct7, d);
+		break;
+	case 0x1C: /* OP_SYSTEM */
+		d->name = csr_names[funct3];
+		d->fmt = DIS_CSR;
+		d->imm = instr >> 20; /* CSR number */
+		d->rs2 = -1;
+		if (funct3 == 0) {
+			switch (instr) {
+			case 0x00000073: d->name = "ecall"; break;
+			case 0x00100073: d->name = "ebreak"; break;
+			case 0x30200073: d->name = "mret"; break;
+			case 0x10500073: d->name = "wfi"; break;
+			default: d->name = "system"; break;
+			}
+			d->fmt = DIS_SYSTEM;
+			d->rd = d->rs1 = -1;
+		} else if (funct3 & 0x4) {
+			d->fmt = DIS_CSRI;
+			d->rs1 = -1;
+		}
+		break;
+	}
+
+	if (d->name)
+		return;
+
+invalid:
+	d->name = "invalid";
+	d->fmt = DIS_INVALID;
+	d->rd = d->rs1 = d->rs2 = d->rs3 = -1;
+	d->fregs = 0;
+	d->rm = -1;
+	d->size = 0;
+}
+
+/* Name of register r, field is the DIS_F_* flag of its field */
+static const char *reg(const struct dis_insn *d, int field, int r) {
+	return (d->fregs & field) ? fregname[r] : regname[r];
+}
+
+int disasm(uint32_t pc, uint32_t instr, char *buf, size_t size) {
+	struct dis_insn d;
+	disasm_decode(instr, &d);
+	const char *rm = d.rm < 0 ? "" : rmname[d.rm];
+
+	switch (d.fmt) {
+	case DIS_R:
+		return snprintf(buf, size, "%s %s,%s,%s%s", d.name,
+				reg(&d, DIS_F_RD, d.rd), reg(&d, DIS_F_RS1, d.rs1),
+				reg(&d, DIS_F_RS2, d.rs2), rm);
+	case DIS_R2:
+		return snprintf(buf, size, "%s %s,%s%s", d.name,
+				reg(&d, DIS_F_RD, d.rd), reg(&d, DIS_F_RS1, d.rs1), rm);
+	case DIS_R4:
+		return snprintf(buf, size, "%s %s,%s,%s,%s%s", d.name,
+				fregname[d.rd], fregname[d.rs1], fregname[d.rs2],
+				fregname[d.rs3], rm);
+	case DIS_I:
+		return snprintf(buf, size, "%s %s,%s,%d", d.name,
+				regname[d.rd], regname[d.rs1], d.imm);
+	case DIS_LOAD:
+		return snprintf(buf, size, "%s %s,%d(%s)", d.name,
+				reg(&d, DIS_F_RD, d.rd), d.imm, regname[d.rs1]);
+	case DIS_STORE:
+		return snprintf(buf, size, "%s %s,%d(%s)", d.name,
+				reg(&d, DIS_F_RS2, d.rs2), d.imm, regname[d.rs1]);
+	case DIS_BRANCH:
+		return snprintf(buf, size, "%s %s,%s,0x%x", d.name,
+				regname[d.rs1], regname[d.rs2], pc + d.imm);
+	case DIS_U:
+		return snprintf(buf, size, "%s %s,0x%x", d.name,
+				regname[d.rd], (uint32_t)d.imm >> 12);
+	case DIS_JAL:
+		return snprintf(buf, size, "%s %s,0x%x", d.name,
+				regname[d.rd], pc + d.imm);
+	case DIS_JALR:
+		return snprintf(buf, size, "%s %s,%d(%s)", d.name,
+				regname[d.rd], d.imm, regname[d.rs1]);
+	case DIS_AMO:
+		if (d.rs2 < 0)
+			return snprintf(buf, size, "%s %s,(%s)", d.name,
+					regname[d.rd], regname[d.rs1]);
+		return snprintf(buf, size, "%s %s,%s,(%s)", d.name,
+				regname[d.rd], regname[d.rs2], regname[d.rs1]);
+	case DIS_CSR:
+		return snprintf(buf, size, "%s %s,0x%x,%s", d.name,
+				regname[d.rd], d.imm, regname[d.rs1]);
+	case DIS_CSRI:
+		return snprintf(buf, size, "%s %s,0x%x,%d", d.name,
+				regname[d.rd], d.imm, (instr >> 15) & 0x1F);
+	case DIS_SYSTEM:
+	case DIS_INVALID:
+	default:
+		return snprintf(buf, size, "%s", d.name);
+	}
+}
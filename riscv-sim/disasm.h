@@ -0,0 +1,56 @@
+#ifndef RVSIM_DISASM_H
+#define RVSIM_DISASM_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern const char *const regname[32];
+extern const char *const fregname[32];
+
+/* Rounding mode operand by the rm field, with its comma, "" for dyn */
+extern const char *const rmname[8];
+
+/* Instruction format as far as a disassembler cares */
+enum dis_fmt {
+	DIS_INVALID,
+	DIS_R,      /* op rd,rs1,rs2 */
+	DIS_R2,     /* op rd,rs1 */
+	DIS_R4,     /* op rd,rs1,rs2,rs3 */
+	DIS_I,      /* op rd,rs1,imm */
+	DIS_LOAD,   /* op rd,imm(rs1) */
+	DIS_STORE,  /* op rs2,imm(rs1) */
+	DIS_BRANCH, /* op rs1,rs2,target */
+	DIS_U,      /* op rd,imm */
+	DIS_JAL,    /* op rd,target */
+	DIS_JALR,   /* op rd,rs1,target */
+	DIS_SYSTEM, /* op */
+	DIS_AMO,    /* op rd,rs2,(rs1) or op rd,(rs1) for lr.w */
+	DIS_CSR,    /* op rd,csr,rs1, the CSR number is in imm */
+	DIS_CSRI,   /* op rd,csr,uimm */
+};
+
+struct dis_insn {
+	const char *name; /* mnemonic, "invalid" if unknown */
+	enum dis_fmt fmt;
+	int rd;           /* register fields, -1 if not used */
+	int rs1;
+	int rs2;
+	int rs3;
+	int fregs;        /* DIS_F_* of the fields naming f registers */
+	int rm;           /* rounding mode field, -1 if none */
+	int32_t imm;
+	int size;         /* memory access size in bytes, 0 if none */
+};
+
+#define DIS_F_RD  (1 << 0)
+#define DIS_F_RS1 (1 << 1)
+#define DIS_F_RS2 (1 << 2)
+#define DIS_F_RS3 (1 << 3)
+
+extern void disasm_decode(uint32_t instr, struct dis_insn *d);
+
+/* Write the assembly for instr at pc into buf, same syntax as the -v
+   trace. Returns the snprintf() result. */
+extern int disasm(uint32_t pc, uint32_t instr, char *buf, size_t size);
+
+#endif /* RVSIM_DISASM_H */
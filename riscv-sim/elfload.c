@@ -0,0 +1,209 @@
+#define _GNU_SOURCE 1
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "elfload.h"
+#include "mem.h"
+
+#define HOST_PAGE 4096
+
+struct elf_symbol *elf_symbols = NULL;
+size_t elf_n_symbols = 0;
+
+static const char *elf_path;
+
+static void fail(const char *msg) {
+	fprintf(stderr, "%s: %s\n", elf_path, msg);
+	exit(EXIT_FAILURE);
+}
+
+bool elf_probe(const char *path) {
+	unsigned char ident[SELFMAG];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool is_elf = read(fd, ident, SELFMAG) == SELFMAG &&
+		memcmp(ident, ELFMAG, SELFMAG) == 0;
+	close(fd);
+	return is_elf;
+}
+
+static void check_header(const Elf32_Ehdr *eh, size_t size) {
+	if (size < sizeof *eh || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0)
+		fail("not an ELF file");
+	if (eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+			eh->e_ident[EI_DATA] != ELFDATA2LSB)
+		fail("not a 32-bit little endian ELF file");
+	if (eh->e_machine != EM_RISCV)
+		fail("not a RISC-V ELF file");
+	if (eh->e_type != ET_EXEC)
+		fail("not an executable");
+	if (eh->e_phentsize != sizeof(Elf32_Phdr) ||
+			eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf32_Phdr) > size)
+		fail("bad program headers");
+}
+
+/* Copy-on-write map the whole pages at the start of a segment if the file
+   offset, guest address and host address all agree on page alignment.
+   RETURN VALUE: number of bytes mapped */
+static size_t map_pages(int fd, uint8_t *dst, uint32_t addr, uint32_t offset,
+		uint32_t filesz) {
+	size_t len = filesz & ~(HOST_PAGE - 1);
+	if (len == 0 || (addr | offset) & (HOST_PAGE - 1) ||
+			(uintptr_t)dst & (HOST_PAGE - 1))
+		return 0;
+
+	void *p = mmap(dst, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+			fd, offset);
+	if (p == MAP_FAILED)
+		return 0;
+	return len;
+}
+
+static void load_segment(int fd, const uint8_t *file, size_t size,
+		const Elf32_Phdr *ph) {
+	if (ph->p_filesz > ph->p_memsz ||
+			(uint64_t)ph->p_offset + ph->p_filesz > size)
+		fail("bad segment");
+
+	uint32_t addr = ph->p_paddr;
+	uint8_t *dst = mem_backing(addr, ph->p_memsz);
+	if (dst == NULL) {
+		addr = ph->p_vaddr;
+		dst = mem_backing(addr, ph->p_memsz);
+	}
+	if (dst == NULL) {
+		fprintf(stderr, "%s: segment at 0x%.8x-0x%.8x is not in memory\n",
+				elf_path, ph->p_vaddr, ph->p_vaddr + ph->p_memsz - 1);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t done = 0;
+	if (!(ph->p_flags & PF_W))
+		done = map_pages(fd, dst, addr, ph->p_offset, ph->p_filesz);
+	memcpy(dst + done, file + ph->p_offset + done, ph->p_filesz - done);
+	memset(dst + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+}
+
+static int symbol_cmp(const void *a, const void *b) {
+	const struct elf_symbol *sa = a, *sb = b;
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	return (int)sa->func - (int)sb->func; /* functions win ties */
+}
+
+static void load_symbols(const uint8_t *file, size_t size,
+		const Elf32_Ehdr *eh) {
+	for (size_t i = 0; i < elf_n_symbols; ++i)
+		free(elf_symbols[i].name);
+	free(elf_symbols);
+	elf_symbols = NULL;
+	elf_n_symbols = 0;
+
+	if (eh->e_shoff == 0 || eh->e_shentsize != sizeof(Elf32_Shdr) ||
+			eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf32_Shdr) > size)
+		return;
+	const Elf32_Shdr *sh = (const Elf32_Shdr *)(file + eh->e_shoff);
+
+	for (int i = 0; i < eh->e_shnum; ++i) {
+		if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+			continue;
+		const Elf32_Shdr *strtab = &sh[sh[i].sh_link];
+		if ((uint64_t)sh[i].sh_offset + sh[i].sh_size > size ||
+				(uint64_t)strtab->sh_offset + strtab->sh_size > size)
+			fail("bad symbol table");
+
+		const Elf32_Sym *syms = (const Elf32_Sym *)(file + sh[i].sh_offset);
+		const char *strs = (const char *)file + strtab->sh_offset;
+		size_t n = sh[i].sh_size / sizeof(Elf32_Sym);
+
+		elf_symbols = calloc(n, sizeof *elf_symbols);
+		if (elf_symbols == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t j = 0; j < n; ++j) {
+			int type = ELF32_ST_TYPE(syms[j].st_info);
+			if (syms[j].st_name == 0 || syms[j].st_name >= strtab->sh_size ||
+					syms[j].st_shndx == SHN_UNDEF)
+				continue;
+			if (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE)
+				continue;
+
+			struct elf_symbol *s = &elf_symbols[elf_n_symbols++];
+			s->addr = syms[j].st_value;
+			s->size = syms[j].st_size;
+			s->func = type == STT_FUNC;
+			s->name = strndup(strs + syms[j].st_name,
+					strtab->sh_size - syms[j].st_name);
+		}
+		qsort(elf_symbols, elf_n_symbols, sizeof *elf_symbols, symbol_cmp);
+		return;
+	}
+}
+
+uint32_t elf_load(const char *path) {
+	elf_path = path;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+	size_t size = st.st_size;
+
+	uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	const Elf32_Ehdr *eh = (const Elf32_Ehdr *)file;
+	check_header(eh, size);
+
+	const Elf32_Phdr *ph = (const Elf32_Phdr *)(file + eh->e_phoff);
+	for (int i = 0; i < eh->e_phnum; ++i) {
+		if (ph[i].p_type == PT_LOAD && ph[i].p_memsz)
+			load_segment(fd, file, size, &ph[i]);
+	}
+	load_symbols(file, size, eh);
+
+	uint32_t entry = eh->e_entry;
+	munmap(file, size);
+	close(fd); /* segment mappings keep their own reference */
+	return entry;
+}
+
+const struct elf_symbol *elf_symbol_at(uint32_t addr) {
+	size_t lo = 0, hi = elf_n_symbols;
+	while (lo < hi) { /* first symbol above addr */
+		size_t mid = (lo + hi) / 2;
+		if (elf_symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? &elf_symbols[lo - 1] : NULL;
+}
+
+const struct elf_symbol *elf_symbol_by_name(const char *name) {
+	for (size_t i = 0; i < elf_n_symbols; ++i) {
+		if (strcmp(elf_symbols[i].name, name) == 0)
+			return &elf_symbols[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef RVSIM_ELFLOAD_H
+#define RVSIM_ELFLOAD_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct elf_symbol {
+	uint32_t addr;
+	uint32_t size;
+	bool func;
+	char *name;
+};
+
+/* Symbol table of the last loaded executable, sorted by address */
+extern struct elf_symbol *elf_symbols;
+extern size_t elf_n_symbols;
+
+/* True if path starts with the ELF magic */
+extern bool elf_probe(const char *path);
+
+/* Load an ELF32 RISC-V executable into guest memory. Each PT_LOAD segment
+   goes to its load address (LMA), or to its VMA if the LMA is not backed
+   by memory. Whole pages of read-only segments are mapped copy-on-write
+   from the file instead of being copied. Exits on error.
+   RETURN VALUE: entry point */
+extern uint32_t elf_load(const char *path);
+
+/* Closest symbol at or below addr, preferring functions. NULL if none. */
+extern const struct elf_symbol *elf_symbol_at(uint32_t addr);
+extern const struct elf_symbol *elf_symbol_by_name(const char *name);
+
+#endif /* RVSIM_ELFLOAD_H */
@@ -0,0 +1,316 @@
+#include <fenv.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "csr/mstatus.h"
+#include "fpu.h"
+
+__thread uint32_t fpu_fflags;
+
+static __thread uint32_t frm;
+
+/* Whether the host FPU runs for the guest, and the host's own
+   environment meanwhile */
+static __thread bool active;
+static __thread fenv_t host_env;
+
+static const int host_rm[] = {
+	[FPU_RNE] = FE_TONEAREST,
+	[FPU_RTZ] = FE_TOWARDZERO,
+	[FPU_RDN] = FE_DOWNWARD,
+	[FPU_RUP] = FE_UPWARD,
+};
+
+/* The guest's flags the host FPU holds */
+static uint32_t host_flags(void) {
+	int e = fetestexcept(FE_ALL_EXCEPT);
+	return (e & FE_INEXACT ? FPU_NX : 0) |
+		(e & FE_UNDERFLOW ? FPU_UF : 0) |
+		(e & FE_OVERFLOW ? FPU_OF : 0) |
+		(e & FE_DIVBYZERO ? FPU_DZ : 0) |
+		(e & FE_INVALID ? FPU_NV : 0);
+}
+
+/* frm on the host, if it has it. Instructions do not run with the
+   others, see fpu_dyn_rm(). */
+static void set_host_rm(void) {
+	fesetround(frm <= FPU_RUP ? host_rm[frm] : FE_TONEAREST);
+}
+
+void fpu_update(void) {
+	bool on = (mstatus_get() & MST_FS) != 0;
+
+	if (on && !active) {
+		fegetenv(&host_env);
+		set_host_rm();
+		feclearexcept(FE_ALL_EXCEPT);
+		active = true;
+	} else if (!on && active) {
+		fpu_leave();
+	}
+}
+
+void fpu_leave(void) {
+	if (!active)
+		return;
+	fpu_fflags |= host_flags();
+	fesetenv(&host_env);
+	active = false;
+}
+
+uint32_t fpu_get_fcsr(void) {
+	return frm << 5 | fpu_fflags | (active ? host_flags() : 0);
+}
+
+void fpu_set_fcsr(uint32_t value) {
+	fpu_set_fflags(value);
+	fpu_set_frm(value >> 5);
+}
+
+void fpu_set_fflags(uint32_t value) {
+	fpu_fflags = value & FPU_FLAGS;
+	if (active)
+		feclearexcept(FE_ALL_EXCEPT);
+}
+
+void fpu_set_frm(uint32_t value) {
+	frm = value & 0x7;
+	if (active)
+		set_host_rm();
+}
+
+uint32_t fpu_dyn_rm(void) {
+	if (frm <= FPU_RUP)
+		return FPU_DYN;
+	return frm == FPU_RMM ? FPU_RMM : FPU_RM_RESERVED;
+}
+
+/* mant >> shift, rounded by rm, for a value of the given sign */
+static uint64_t round_bits(uint64_t mant, int shift, uint32_t sign,
+		uint32_t rm) {
+	uint64_t q = mant >> shift;
+	uint64_t rem = mant & ((1ull << shift) - 1);
+	uint64_t half = 1ull << (shift - 1);
+
+	switch (rm) {
+	case FPU_RNE:
+		return q + (rem > half || (rem == half && (q & 1)));
+	case FPU_RMM:
+		return q + (rem >= half);
+	case FPU_RDN:
+		return q + (sign && rem);
+	case FPU_RUP:
+		return q + (!sign && rem);
+	default: /* FPU_RTZ */
+		return q;
+	}
+}
+
+/* The largest finite value or infinity, whichever rm overflows to */
+static uint32_t overflow(uint32_t sign, uint32_t rm) {
+	bool inf = rm == FPU_RNE || rm == FPU_RMM ||
+		(rm == FPU_RDN && sign) || (rm == FPU_RUP && !sign);
+	return sign | (inf ? 0x7f800000 : 0x7f7fffff);
+}
+
+/* d rounded to single precision by rm, with the flags that raises.
+   inexact: d itself is inexact. For the nearest modes d must have been
+   rounded to odd, so that rounding it again does not round twice. */
+static uint32_t round_f32(double d, bool inexact, uint32_t rm) {
+	uint64_t u;
+	memcpy(&u, &d, sizeof u);
+	uint32_t sign = (uint32_t)(u >> 32) & FPU_SIGN;
+	int exp = (u >> 52) & 0x7ff;
+	uint64_t mant = u & ((1ull << 52) - 1);
+
+	if (exp == 0x7ff)
+		return mant ? FPU_CANONICAL_NAN : sign | 0x7f800000;
+	if (exp == 0) /* single precision operands give no subnormal doubles */
+		return sign;
+
+	/* d = mant * 2^(e - 52), and the result keeps 24 bits of mant */
+	mant |= 1ull << 52;
+	int e = exp - 1023;
+	int shift = 29;
+	bool tiny = false;
+	if (e < -126) {
+		/* Tininess is detected after rounding, as if the exponent range
+		   were unbounded */
+		tiny = e < -127 || round_bits(mant, 29, sign, rm) >> 24 == 0;
+		shift += -126 - e;
+		if (shift > 54)
+			shift = 54;
+	}
+	uint64_t q = round_bits(mant, shift, sign, rm);
+	inexact |= (mant & ((1ull << shift) - 1)) != 0;
+
+	uint32_t r;
+	if (e < -126) {
+		r = sign | (uint32_t)q; /* 1 << 23 is the smallest normal */
+	} else {
+		if (q >> 24) {
+			q >>= 1;
+			e++;
+		}
+		if (e > 127) {
+			fpu_fflags |= FPU_OF | FPU_NX;
+			return overflow(sign, rm);
+		}
+		r = sign | (uint32_t)(e + 127) << 23 | ((uint32_t)q & 0x7fffff);
+	}
+	if (inexact)
+		fpu_fflags |= FPU_NX | (tiny ? FPU_UF : 0);
+	return r;
+}
+
+uint32_t fpu_static_rm(enum fpu_op op, uint32_t a, uint32_t b, uint32_t c,
+		uint32_t rm) {
+	/* The host computes in double precision, rounded to odd for the
+	   nearest modes and in the direction of rm for the others, and
+	   round_f32() does the rest. The inexact flag of that step must not
+	   count, so it is taken out of the host flags first. */
+	static const int host_mode[] = {
+		[FPU_RNE] = FE_TOWARDZERO,
+		[FPU_RTZ] = FE_TOWARDZERO,
+		[FPU_RDN] = FE_DOWNWARD,
+		[FPU_RUP] = FE_UPWARD,
+		[FPU_RMM] = FE_TOWARDZERO,
+	};
+	if (fetestexcept(FE_INEXACT)) {
+		fpu_fflags |= FPU_NX;
+		feclearexcept(FE_INEXACT);
+	}
+	int saved = fegetround();
+	fesetround(host_mode[rm]);
+
+	/* a is an integer for the conversions, which as a float might signal */
+	volatile double x = op < FPU_OP_CVT_S_W ? fpu_f(a) : 0;
+	volatile double y = fpu_f(b), z = fpu_f(c);
+	volatile double r;
+	switch (op) {
+	case FPU_OP_ADD:
+		r = x + y;
+		break;
+	case FPU_OP_SUB:
+		r = x - y;
+		break;
+	case FPU_OP_MUL:
+		r = x * y; /* exact */
+		break;
+	case FPU_OP_DIV:
+		r = x / y;
+		break;
+	case FPU_OP_SQRT:
+		r = sqrt(x);
+		break;
+	case FPU_OP_FMA:
+		r = fma(x, y, z);
+		break;
+	case FPU_OP_CVT_S_W:
+		r = (int32_t)a; /* exact */
+		break;
+	default: /* FPU_OP_CVT_S_WU */
+		r = a;
+		break;
+	}
+
+	bool inexact = fetestexcept(FE_INEXACT);
+	feclearexcept(FE_INEXACT);
+	fesetround(saved);
+
+	double d = r;
+	if (inexact && host_mode[rm] == FE_TOWARDZERO) {
+		uint64_t u;
+		memcpy(&u, &d, sizeof u);
+		u |= 1;
+		memcpy(&d, &u, sizeof d);
+	}
+	if (op == FPU_OP_FMA && d != d)
+		return fpu_fma_nan(a, b);
+	return round_f32(d, inexact, rm);
+}
+
+/* RISC-V signals invalid for infinity times zero even if c is a quiet
+   NaN, where the host may not */
+uint32_t fpu_fma_nan(uint32_t a, uint32_t b) {
+	uint32_t ma = a & ~FPU_SIGN, mb = b & ~FPU_SIGN;
+	if ((ma == 0 && mb == 0x7f800000) || (ma == 0x7f800000 && mb == 0))
+		fpu_fflags |= FPU_NV;
+	return FPU_CANONICAL_NAN;
+}
+
+/* fmin and fmax of a NaN and a number are the number */
+uint32_t fpu_minmax_nan(uint32_t a, uint32_t b) {
+	if (fpu_is_snan(a) || fpu_is_snan(b))
+		fpu_fflags |= FPU_NV;
+	if (fpu_is_nan(a))
+		return fpu_is_nan(b) ? FPU_CANONICAL_NAN : b;
+	return a;
+}
+
+/* a to an integer, rounded by rm. Out of range values and NaNs raise
+   only the invalid flag and give the nearest limit, NaNs the largest. */
+static uint32_t cvt_w(uint32_t a, uint32_t rm, bool is_signed) {
+	uint32_t sign = a & FPU_SIGN;
+	int exp = (a >> 23) & 0xff;
+	uint64_t mant = a & 0x7fffff;
+
+	if (rm == FPU_DYN)
+		rm = frm;
+	if (fpu_is_nan(a))
+		sign = 0;
+	else if (exp < 127 + 32) {
+		/* a = mant * 2^(exp - 150) */
+		if (exp)
+			mant |= 1 << 23;
+		else
+			exp = 1;
+		uint64_t v;
+		bool inexact = false;
+		if (exp >= 150) {
+			v = mant << (exp - 150);
+		} else {
+			int shift = 150 - exp > 26 ? 26 : 150 - exp;
+			v = round_bits(mant, shift, sign, rm);
+			inexact = (mant & ((1ull << shift) - 1)) != 0;
+		}
+		bool valid = is_signed ? v <= (sign ? 0x80000000u : 0x7fffffffu) :
+			(sign ? v == 0 : v <= 0xffffffffu);
+		if (valid) {
+			if (inexact)
+				fpu_fflags |= FPU_NX;
+			return sign ? -(uint32_t)v : (uint32_t)v;
+		}
+	}
+	fpu_fflags |= FPU_NV;
+	if (is_signed)
+		return sign ? 0x80000000 : 0x7fffffff;
+	return sign ? 0 : 0xffffffff;
+}
+
+uint32_t fpu_cvt_w_s(uint32_t a, uint32_t rm) {
+	return cvt_w(a, rm, true);
+}
+
+uint32_t fpu_cvt_wu_s(uint32_t a, uint32_t rm) {
+	return cvt_w(a, rm, false);
+}
+
+uint32_t fpu_class(uint32_t a) {
+	bool neg = a & FPU_SIGN;
+	uint32_t exp = (a >> 23) & 0xff;
+	uint32_t frac = a & 0x7fffff;
+
+	if (exp == 0xff) {
+		if (frac)
+			return frac & 0x400000 ? 1 << 9 : 1 << 8; /* quiet, signaling NaN */
+		return neg ? 1 << 0 : 1 << 7; /* infinity */
+	}
+	if (exp == 0) {
+		if (frac == 0)
+			return neg ? 1 << 3 : 1 << 4; /* zero */
+		return neg ? 1 << 2 : 1 << 5; /* subnormal */
+	}
+	return neg ? 1 << 1 : 1 << 6; /* normal */
+}
@@ -0,0 +1,219 @@
+#ifndef RVSIM_FPU_H
+#define RVSIM_FPU_H 1
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* F extension arithmetic. f registers hold the bits of single precision
+   values, and the operations here take and return them as uint32_t.
+
+   While the guest runs with mstatus.FS on, the host FPU has the rounding
+   mode from frm and collects the guest's exception flags: cpu_run()
+   swaps the host environment in and out with fpu_update() and
+   fpu_leave(), and no host code uses floating point in between. An
+   operation with the dynamic rounding mode is then a single host
+   instruction, plus the fixups where RISC-V and the host differ: NaN
+   results are the canonical NaN, and min, max, compares and the
+   conversions to integers follow the RISC-V rules. Static rounding modes
+   and RMM, which the host cannot do, go through fpu_static_rm(). */
+
+/* Rounding modes, as in the rm field and frm */
+#define FPU_RNE 0
+#define FPU_RTZ 1
+#define FPU_RDN 2
+#define FPU_RUP 3
+#define FPU_RMM 4
+#define FPU_RM_RESERVED 5 /* 5 and 6 */
+#define FPU_DYN 7 /* frm, only in instructions */
+
+/* fflags */
+#define FPU_NX 0x01 /* inexact */
+#define FPU_UF 0x02 /* underflow */
+#define FPU_OF 0x04 /* overflow */
+#define FPU_DZ 0x08 /* divide by zero */
+#define FPU_NV 0x10 /* invalid */
+#define FPU_FLAGS 0x1f
+
+#define FPU_SIGN 0x80000000
+#define FPU_CANONICAL_NAN 0x7fc00000
+
+/* Flags accrued so far, without those the host FPU holds meanwhile */
+extern __thread uint32_t fpu_fflags;
+
+/* Call at the start of cpu_run() and whenever mstatus.FS may have
+   changed: takes the host FPU over for the guest while FS is on, gives
+   it back while it is off. */
+extern void fpu_update(void);
+
+/* Call at the end of cpu_run(): gives the host FPU back */
+extern void fpu_leave(void);
+
+/* fcsr, fflags in bits 4..0 and frm in bits 7..5 */
+extern uint32_t fpu_get_fcsr(void);
+extern void fpu_set_fcsr(uint32_t value);
+extern void fpu_set_fflags(uint32_t value);
+extern void fpu_set_frm(uint32_t value);
+
+/* What rm == FPU_DYN decodes as: FPU_DYN if the host FPU follows frm,
+   FPU_RMM, or FPU_RM_RESERVED if frm holds an invalid mode */
+extern uint32_t fpu_dyn_rm(void);
+
+/* Operations with a static rounding mode other than FPU_DYN */
+enum fpu_op {
+	FPU_OP_ADD,
+	FPU_OP_SUB,
+	FPU_OP_MUL,
+	FPU_OP_DIV,
+	FPU_OP_SQRT,
+	FPU_OP_FMA,
+	FPU_OP_CVT_S_W,
+	FPU_OP_CVT_S_WU,
+};
+
+/* a op b, or a * b + c for FPU_OP_FMA, rounded by rm in software. The
+   conversions take an integer in a. */
+extern uint32_t fpu_static_rm(enum fpu_op op, uint32_t a, uint32_t b,
+		uint32_t c, uint32_t rm);
+
+/* The out of line rest of the operations below */
+extern uint32_t fpu_fma_nan(uint32_t a, uint32_t b);
+extern uint32_t fpu_minmax_nan(uint32_t a, uint32_t b);
+extern uint32_t fpu_cvt_w_s(uint32_t a, uint32_t rm);
+extern uint32_t fpu_cvt_wu_s(uint32_t a, uint32_t rm);
+extern uint32_t fpu_class(uint32_t a);
+
+static inline float fpu_f(uint32_t a) {
+	float f;
+	memcpy(&f, &a, sizeof f);
+	return f;
+}
+
+static inline uint32_t fpu_bits(float f) {
+	uint32_t a;
+	memcpy(&a, &f, sizeof a);
+	return a;
+}
+
+static inline bool fpu_is_nan(uint32_t a) {
+	return (a & ~FPU_SIGN) > 0x7f800000;
+}
+
+static inline bool fpu_is_snan(uint32_t a) {
+	return fpu_is_nan(a) && !(a & 0x00400000);
+}
+
+/* A host result with NaNs made canonical */
+static inline uint32_t fpu_canon(float r) {
+	return r != r ? FPU_CANONICAL_NAN : fpu_bits(r);
+}
+
+static inline uint32_t fpu_add(uint32_t a, uint32_t b, uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_ADD, a, b, 0, rm);
+	return fpu_canon(fpu_f(a) + fpu_f(b));
+}
+
+static inline uint32_t fpu_sub(uint32_t a, uint32_t b, uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_SUB, a, b, 0, rm);
+	return fpu_canon(fpu_f(a) - fpu_f(b));
+}
+
+static inline uint32_t fpu_mul(uint32_t a, uint32_t b, uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_MUL, a, b, 0, rm);
+	return fpu_canon(fpu_f(a) * fpu_f(b));
+}
+
+static inline uint32_t fpu_div(uint32_t a, uint32_t b, uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_DIV, a, b, 0, rm);
+	return fpu_canon(fpu_f(a) / fpu_f(b));
+}
+
+static inline uint32_t fpu_sqrt(uint32_t a, uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_SQRT, a, 0, 0, rm);
+	return fpu_canon(sqrtf(fpu_f(a)));
+}
+
+/* a * b + c; fmsub, fnmsub and fnmadd negate a and/or c first */
+static inline uint32_t fpu_fma(uint32_t a, uint32_t b, uint32_t c,
+		uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_FMA, a, b, c, rm);
+	float r = fmaf(fpu_f(a), fpu_f(b), fpu_f(c));
+	return r != r ? fpu_fma_nan(a, b) : fpu_bits(r);
+}
+
+static inline uint32_t fpu_cvt_s_w(uint32_t a, uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_CVT_S_W, a, 0, 0, rm);
+	return fpu_bits((float)(int32_t)a);
+}
+
+static inline uint32_t fpu_cvt_s_wu(uint32_t a, uint32_t rm) {
+	if (rm != FPU_DYN)
+		return fpu_static_rm(FPU_OP_CVT_S_WU, a, 0, 0, rm);
+	return fpu_bits((float)a);
+}
+
+static inline uint32_t fpu_sgnj(uint32_t a, uint32_t b) {
+	return (a & ~FPU_SIGN) | (b & FPU_SIGN);
+}
+
+static inline uint32_t fpu_sgnjn(uint32_t a, uint32_t b) {
+	return (a & ~FPU_SIGN) | (~b & FPU_SIGN);
+}
+
+static inline uint32_t fpu_sgnjx(uint32_t a, uint32_t b) {
+	return a ^ (b & FPU_SIGN);
+}
+
+/* -0 is less than +0 here */
+static inline uint32_t fpu_min(uint32_t a, uint32_t b) {
+	if (fpu_is_nan(a) || fpu_is_nan(b))
+		return fpu_minmax_nan(a, b);
+	if (((a | b) & ~FPU_SIGN) == 0)
+		return a | b;
+	return fpu_f(a) < fpu_f(b) ? a : b;
+}
+
+static inline uint32_t fpu_max(uint32_t a, uint32_t b) {
+	if (fpu_is_nan(a) || fpu_is_nan(b))
+		return fpu_minmax_nan(a, b);
+	if (((a | b) & ~FPU_SIGN) == 0)
+		return a & b;
+	return fpu_f(a) > fpu_f(b) ? a : b;
+}
+
+/* feq is quiet, it only signals for signaling NaNs; flt and fle signal
+   for any NaN */
+static inline uint32_t fpu_eq(uint32_t a, uint32_t b) {
+	if (fpu_is_nan(a) || fpu_is_nan(b)) {
+		if (fpu_is_snan(a) || fpu_is_snan(b))
+			fpu_fflags |= FPU_NV;
+		return 0;
+	}
+	return fpu_f(a) == fpu_f(b);
+}
+
+static inline uint32_t fpu_lt(uint32_t a, uint32_t b) {
+	if (fpu_is_nan(a) || fpu_is_nan(b)) {
+		fpu_fflags |= FPU_NV;
+		return 0;
+	}
+	return fpu_f(a) < fpu_f(b);
+}
+
+static inline uint32_t fpu_le(uint32_t a, uint32_t b) {
+	if (fpu_is_nan(a) || fpu_is_nan(b)) {
+		fpu_fflags |= FPU_NV;
+		return 0;
+	}
+	return fpu_f(a) <= fpu_f(b);
+}
+
+#endif /* RVSIM_FPU_H */
@@ -0,0 +1,572 @@
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "csr.h"
+#include "disasm.h"
+#include "fpu.h"
+#include "gdb.h"
+#include "mem.h"
+#include "uart.h"
+
+#define GDB_MAX_PACKET 4096 /* PacketSize, bytes of data */
+#define GDB_N_REGS 33       /* x0-x31, then pc, in 'g' packets */
+#define GDB_F0 33           /* f0-f31, 'p' and 'P' only */
+#define GDB_FFLAGS 66       /* frm and fcsr follow, 65 + CSR number */
+#define GDB_FCSR 68
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+#define GDB_INTERRUPT 0x03  /* ^C, outside of packets */
+
+enum action {
+	GDB_CONTINUE,
+	GDB_STEP,
+	GDB_DETACH,
+	GDB_KILL,
+};
+
+static int conn = -1;
+static uint8_t in_buf[GDB_MAX_PACKET];
+static size_t in_len, in_pos;
+static char packet[GDB_MAX_PACKET + 1];
+static char reply[GDB_MAX_PACKET + 1];
+static char target_xml[8192];
+static char last_stop[64]; /* for '?' */
+static bool stepping;
+static bool stop_reported = true; /* GDB asks for the first one with '?' */
+
+static void disconnect(void) {
+	close(conn);
+	conn = -1;
+	uart_wake_on(-1);
+}
+
+/* RETURN VALUE: next byte from GDB, -1 once the connection is gone */
+static int get_byte(void) {
+	if (in_pos == in_len) {
+		ssize_t n;
+		do {
+			n = read(conn, in_buf, sizeof in_buf);
+		} while (n < 0 && errno == EINTR);
+		if (n <= 0)
+			return -1;
+		in_len = n;
+		in_pos = 0;
+	}
+	return in_buf[in_pos++];
+}
+
+/* Errors show up as the end of the connection on the next read */
+static void put_bytes(const char *s, size_t len) {
+	while (len) {
+		ssize_t n = write(conn, s, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		s += n;
+		len -= n;
+	}
+}
+
+static int hex_digit(int c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Receive "$data#checksum" into packet and acknowledge it. Anything
+   outside of packets, like a late ^C, is dropped.
+   RETURN VALUE: false once the connection is gone */
+static bool get_packet(void) {
+	for (;;) {
+		int c;
+		while ((c = get_byte()) != '$') {
+			if (c < 0)
+				return false;
+		}
+
+		size_t len = 0;
+		uint8_t sum = 0;
+		while ((c = get_byte()) != '#') {
+			if (c < 0)
+				return false;
+			if (len < GDB_MAX_PACKET)
+				packet[len] = c;
+			len++;
+			sum += c;
+		}
+		int hi = hex_digit(get_byte());
+		int lo = hex_digit(get_byte());
+		if (hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum &&
+				len < GDB_MAX_PACKET) {
+			packet[len] = '\0';
+			put_bytes("+", 1);
+			return true;
+		}
+		put_bytes("-", 1);
+	}
+}
+
+/* Send data until GDB acknowledges it */
+static void put_packet(const char *data) {
+	static char frame[GDB_MAX_PACKET + 5];
+	size_t len = strlen(data);
+	uint8_t sum = 0;
+	for (size_t i = 0; i < len; ++i)
+		sum += data[i];
+	frame[0] = '$';
+	memcpy(frame + 1, data, len);
+	snprintf(frame + 1 + len, 4, "#%.2x", sum);
+
+	for (;;) {
+		put_bytes(frame, len + 4);
+		int c;
+		do {
+			c = get_byte();
+		} while (c >= 0 && c != '+' && c != '-');
+		if (c != '-')
+			return;
+	}
+}
+
+/* RETURN VALUE: false if *s does not start with a hex number */
+static bool parse_hex(const char **s, uint32_t *v) {
+	const char *p = *s;
+	*v = 0;
+	while (hex_digit(*p) >= 0)
+		*v = *v << 4 | hex_digit(*p++);
+	if (p == *s)
+		return false;
+	*s = p;
+	return true;
+}
+
+/* Registers go as target (little endian) bytes */
+static char *put_word(char *p, uint32_t v) {
+	for (int i = 0; i < 4; ++i, v >>= 8)
+		p += sprintf(p, "%.2x", v & 0xff);
+	return p;
+}
+
+static bool parse_word(const char **s, uint32_t *v) {
+	*v = 0;
+	for (int i = 0; i < 4; ++i) {
+		int hi = hex_digit((*s)[0]);
+		int lo = hex_digit(hi >= 0 ? (*s)[1] : 0);
+		if (hi < 0 || lo < 0)
+			return false;
+		*v |= (uint32_t)(hi << 4 | lo) << (8 * i);
+		*s += 2;
+	}
+	return true;
+}
+
+static bool has_fpu(void) {
+	uint32_t misa = 0;
+	csr_get(CSR_MISA, &misa);
+	return misa & (1 << ('F' - 'A'));
+}
+
+/* Register numbers as GDB's RISC-V target has them */
+static bool is_reg(uint32_t i) {
+	return i < GDB_N_REGS || (has_fpu() && (i - GDB_F0 < 32 ||
+			i - GDB_FFLAGS <= GDB_FCSR - GDB_FFLAGS));
+}
+
+static uint32_t get_reg(uint32_t i) {
+	if (i < 32)
+		return M.regs[i];
+	if (i == 32)
+		return M.pc;
+	if (i - GDB_F0 < 32)
+		return M.fregs[i - GDB_F0];
+	uint32_t fcsr = fpu_get_fcsr();
+	if (i == GDB_FFLAGS)
+		return fcsr & FPU_FLAGS;
+	if (i == GDB_FFLAGS + 1)
+		return fcsr >> 5;
+	return fcsr;
+}
+
+/* frm changes take effect when cpu_run() next starts */
+static void set_reg(uint32_t i, uint32_t v) {
+	if (i == 32)
+		M.pc = v;
+	else if (i - GDB_F0 < 32)
+		M.fregs[i - GDB_F0] = v;
+	else if (i == GDB_FFLAGS)
+		fpu_set_fflags(v);
+	else if (i == GDB_FCSR)
+		fpu_set_fcsr(v);
+	else if (i == GDB_FFLAGS + 1)
+		fpu_set_frm(v);
+	else if (i != 0)
+		M.regs[i] = v;
+}
+
+/* Memory is written like a loader would, so ROM can be patched too */
+static bool poke(uint32_t addr, uint8_t b) {
+	uint8_t *p = mem_backing(addr, 1);
+	if (p == NULL)
+		return mem_store_byte(addr, b) == 0;
+	*p = b;
+	cpu_invalidate(addr, 1);
+	return true;
+}
+
+static void read_memory(const char *s) {
+	uint32_t addr, len;
+	if (!parse_hex(&s, &addr) || *s++ != ',' || !parse_hex(&s, &len)) {
+		strcpy(reply, "E01");
+		return;
+	}
+	if (len > GDB_MAX_PACKET / 2)
+		len = GDB_MAX_PACKET / 2;
+	char *p = reply;
+	for (uint32_t i = 0; i < len; ++i) {
+		uint8_t b;
+		if (mem_load_byte(addr + i, &b) < 0)
+			break;
+		p += sprintf(p, "%.2x", b);
+	}
+	if (p == reply && len)
+		strcpy(reply, "E14"); /* EFAULT */
+}
+
+static void write_memory(const char *s) {
+	uint32_t addr, len;
+	if (!parse_hex(&s, &addr) || *s++ != ',' || !parse_hex(&s, &len) ||
+			*s++ != ':') {
+		strcpy(reply, "E01");
+		return;
+	}
+	for (uint32_t i = 0; i < len; ++i, s += 2) {
+		int hi = hex_digit(s[0]);
+		int lo = hex_digit(hi >= 0 ? s[1] : 0);
+		if (hi < 0 || lo < 0) {
+			strcpy(reply, "E01");
+			return;
+		}
+		if (!poke(addr + i, hi << 4 | lo)) {
+			strcpy(reply, "E14");
+			return;
+		}
+	}
+	strcpy(reply, "OK");
+}
+
+/* "Z<type>,<addr>,<kind>" and "z...": types 0 and 1 are breakpoints, 2 to
+   4 write, read and access watchpoints */
+static void set_point(const char *s, bool set) {
+	static const int kinds[5] = {
+		[2] = CPU_WATCH_WRITE,
+		[3] = CPU_WATCH_READ,
+		[4] = CPU_WATCH_ACCESS,
+	};
+	int type = *s++ - '0';
+	uint32_t addr, len;
+	if (type < 0 || type > 4)
+		return; /* unsupported, empty reply */
+	if (*s++ != ',' || !parse_hex(&s, &addr) || *s++ != ',' ||
+			!parse_hex(&s, &len)) {
+		strcpy(reply, "E01");
+		return;
+	}
+
+	int err = type <= 1 ? cpu_set_breakpoint(addr, set) :
+		cpu_set_watchpoint(addr, len ? len : 1, kinds[type], set);
+	strcpy(reply, err < 0 ? "E01" : "OK");
+}
+
+/* qXfer:features:read:target.xml:<offset>,<length> */
+static void read_features(const char *s) {
+	uint32_t offset, len;
+	if (strncmp(s, "target.xml:", 11) != 0) {
+		strcpy(reply, "E00");
+		return;
+	}
+	s += 11;
+	if (!parse_hex(&s, &offset) || *s++ != ',' || !parse_hex(&s, &len)) {
+		strcpy(reply, "E01");
+		return;
+	}
+
+	size_t total = strlen(target_xml);
+	size_t n = offset < total ? total - offset : 0;
+	if (len > GDB_MAX_PACKET - 1)
+		len = GDB_MAX_PACKET - 1;
+	reply[0] = n > len ? 'm' : 'l';
+	if (n > len)
+		n = len;
+	memcpy(reply + 1, target_xml + (n ? offset : 0), n);
+	reply[n + 1] = '\0';
+}
+
+static void query(const char *s) {
+	if (strncmp(s, "Supported", 9) == 0)
+		snprintf(reply, sizeof reply, "PacketSize=%x;qXfer:features:read+",
+				GDB_MAX_PACKET);
+	else if (strcmp(s, "Attached") == 0)
+		strcpy(reply, "1");
+	else if (strncmp(s, "Xfer:features:read:", 19) == 0)
+		read_features(s + 19);
+}
+
+/* Serve requests until GDB resumes the machine */
+static enum action serve(void) {
+	for (;;) {
+		if (!get_packet())
+			return GDB_DETACH;
+
+		const char *s = packet + 1;
+		uint32_t i, v;
+		char *p = reply;
+		reply[0] = '\0';
+
+		switch (packet[0]) {
+		case '?':
+			strcpy(reply, last_stop);
+			break;
+		case 'g':
+			for (i = 0; i < GDB_N_REGS; ++i)
+				p = put_word(p, get_reg(i));
+			break;
+		case 'G':
+			for (i = 0; i < GDB_N_REGS && parse_word(&s, &v); ++i)
+				set_reg(i, v);
+			strcpy(reply, "OK");
+			break;
+		case 'p':
+			if (parse_hex(&s, &i) && is_reg(i))
+				put_word(reply, get_reg(i));
+			else
+				strcpy(reply, "E01");
+			break;
+		case 'P':
+			if (parse_hex(&s, &i) && is_reg(i) && *s++ == '=' &&
+					parse_word(&s, &v)) {
+				set_reg(i, v);
+				strcpy(reply, "OK");
+			} else {
+				strcpy(reply, "E01");
+			}
+			break;
+		case 'm':
+			read_memory(s);
+			break;
+		case 'M':
+			write_memory(s);
+			break;
+		case 'c':
+		case 's':
+			if (parse_hex(&s, &v))
+				M.pc = v;
+			return packet[0] == 'c' ? GDB_CONTINUE : GDB_STEP;
+		case 'Z':
+		case 'z':
+			set_point(s, packet[0] == 'Z');
+			break;
+		case 'D':
+			put_packet("OK");
+			return GDB_DETACH;
+		case 'k':
+			return GDB_KILL;
+		case 'v':
+			if (strcmp(s, "Kill") == 0) {
+				put_packet("OK");
+				return GDB_KILL;
+			}
+			break;
+		case 'H':
+		case 'T':
+			strcpy(reply, "OK"); /* one thread */
+			break;
+		case 'q':
+			query(s);
+			break;
+		}
+		put_packet(reply);
+	}
+}
+
+/* Look for ^C without blocking */
+static bool interrupted(void) {
+	struct pollfd p = { .fd = conn, .events = POLLIN };
+	while (in_pos < in_len || poll(&p, 1, 0) > 0) {
+		int c = get_byte();
+		if (c < 0) {
+			disconnect();
+			return false;
+		}
+		if (c == GDB_INTERRUPT)
+			return true;
+	}
+	return false;
+}
+
+static void set_stop_reply(int sig) {
+	if (sig == GDB_SIGTRAP && cpu_stopped == CPU_STOP_WATCH) {
+		const char *kind = cpu_stop_watch == CPU_WATCH_WRITE ? "watch" :
+			cpu_stop_watch == CPU_WATCH_READ ? "rwatch" : "awatch";
+		snprintf(last_stop, sizeof last_stop, "T%.2x%s:%x;", sig, kind,
+				cpu_stop_addr);
+	} else {
+		snprintf(last_stop, sizeof last_stop, "S%.2x", sig);
+	}
+}
+
+uint64_t gdb_poll(uint64_t n) {
+	if (conn < 0) {
+		/* breakpoints left behind by a lost connection */
+		if (cpu_stopped != CPU_STOP_NONE)
+			cpu_resume();
+		return n;
+	}
+
+	if (!stop_reported) {
+		int sig = 0;
+		if (cpu_stopped != CPU_STOP_NONE || stepping)
+			sig = GDB_SIGTRAP;
+		else if (interrupted())
+			sig = GDB_SIGINT;
+		if (conn < 0 || sig == 0)
+			return n;
+		set_stop_reply(sig);
+		put_packet(last_stop);
+	}
+
+	enum action action = serve();
+	stop_reported = false;
+	stepping = action == GDB_STEP;
+	cpu_resume();
+	switch (action) {
+	case GDB_KILL:
+		return 0;
+	case GDB_STEP:
+		return 1;
+	case GDB_DETACH:
+		disconnect();
+		return n;
+	default:
+		return n;
+	}
+}
+
+/* Registers in 'g' packet order, with the names GDB expects, then the
+   FPU's by number */
+static void build_target_xml(void) {
+	char *p = target_xml;
+	p += sprintf(p, "<?xml version=\"1.0\"?>\n"
+			"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+			"<target version=\"1.0\">\n"
+			"<architecture>riscv:rv32</architecture>\n"
+			"<feature name=\"org.gnu.gdb.riscv.cpu\">\n");
+	for (int i = 0; i < 32; ++i)
+		p += sprintf(p, "<reg name=\"%s\" bitsize=\"32\" type=\"%s\"/>\n",
+				regname[i], i == 2 ? "data_ptr" : i == 1 ? "code_ptr" : "int");
+	p += sprintf(p, "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>\n"
+			"</feature>\n");
+	if (has_fpu()) {
+		p += sprintf(p, "<feature name=\"org.gnu.gdb.riscv.fpu\">\n");
+		for (int i = 0; i < 32; ++i)
+			p += sprintf(p, "<reg name=\"%s\" bitsize=\"32\" "
+					"type=\"ieee_single\" regnum=\"%d\"/>\n",
+					fregname[i], GDB_F0 + i);
+		p += sprintf(p, "<reg name=\"fflags\" bitsize=\"32\" type=\"int\" "
+				"regnum=\"%d\"/>\n"
+				"<reg name=\"frm\" bitsize=\"32\" type=\"int\" "
+				"regnum=\"%d\"/>\n"
+				"<reg name=\"fcsr\" bitsize=\"32\" type=\"int\" "
+				"regnum=\"%d\"/>\n"
+				"</feature>\n", GDB_FFLAGS, GDB_FFLAGS + 1, GDB_FCSR);
+	}
+	sprintf(p, "</target>\n");
+}
+
+static int listen_unix(const char *path) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof sa.sun_path) {
+		fprintf(stderr, "%s: path too long\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(sa.sun_path, path);
+	unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0 ||
+			listen(fd, 1) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+static int listen_tcp(const char *port) {
+	char *end;
+	long n = strtol(port, &end, 10);
+	if (*end != '\0' || n <= 0 || n > 65535) {
+		fprintf(stderr, "%s: invalid port\n", port);
+		exit(EXIT_FAILURE);
+	}
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons(n),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) < 0 ||
+			bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0 ||
+			listen(fd, 1) < 0) {
+		perror("gdb: listen");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+void gdb_init(const char *addr) {
+	bool unix_socket = strchr(addr, '/') != NULL;
+	int fd = unix_socket ? listen_unix(addr) : listen_tcp(addr);
+
+	printf("Waiting for GDB on %s\n", addr);
+	fflush(stdout);
+	do {
+		conn = accept(fd, NULL, NULL);
+	} while (conn < 0 && errno == EINTR);
+	if (conn < 0) {
+		perror("gdb: accept");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	if (unix_socket)
+		unlink(addr);
+
+	/* replies are small and latency bound */
+	int one = 1;
+	if (!unix_socket)
+		setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	build_target_xml();
+	strcpy(last_stop, "S05");
+	stop_reported = true;
+	uart_wake_on(conn);
+}
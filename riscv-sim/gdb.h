@@ -0,0 +1,24 @@
+#ifndef RVSIM_GDB_H
+#define RVSIM_GDB_H 1
+
+#include <stdint.h>
+
+/* GDB remote serial protocol server. It runs in the main loop, between
+   batches of instructions: while GDB has the machine stopped, everything
+   including device time stands still. Supports registers (the x and f
+   registers, pc and fcsr), memory, continue, single step, breakpoints (Z0/Z1) and watchpoints (Z2-Z4)
+   through the debugger support in cpu.h, and stopping with ^C. Single
+   hart only. Reads of device registers have their usual side effects. */
+
+/* Listen on addr, a TCP port on localhost or, if it contains a '/', the
+   path of a Unix socket, and wait for GDB to connect. The machine starts
+   stopped. Exits on failure. */
+extern void gdb_init(const char *addr);
+
+/* Call before running the next batch of n instructions: if the machine
+   stopped, tell GDB and serve its requests until it resumes the machine.
+   RETURN VALUE: instructions to run before the next call, 0 once GDB
+   killed the machine */
+extern uint64_t gdb_poll(uint64_t n);
+
+#endif /* RVSIM_GDB_H */
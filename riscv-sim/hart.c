@@ -0,0 +1,113 @@
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "hart.h"
+#include "irq.h"
+#include "mem.h"
+#include "sched.h"
+#include "uart.h"
+
+struct hart {
+	pthread_t thread;
+	uint32_t id;
+};
+
+static int n_harts = 1;
+static uint64_t quantum;
+static enum cpu_engine engine;
+static uint32_t entry;
+
+/* Shared by every hart, set up by hart 0 */
+static struct mem_image *memory;
+static struct sched_queue *queue;
+static struct uart *uart;
+static struct irq *irq;
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Harts 1.. wait at start until hart 0 has set target, run up to it and
+   meet hart 0 again at done */
+static pthread_barrier_t start;
+static pthread_barrier_t done;
+static uint64_t target;
+
+static void run_due(void) {
+	pthread_mutex_lock(&device_lock);
+	sched_run_due();
+	pthread_mutex_unlock(&device_lock);
+}
+
+static void *hart_main(void *arg) {
+	struct hart *h = arg;
+
+	mem_init(memory);
+	mem_device_lock = &device_lock;
+	sched_attach(queue);
+	uart_attach(uart);
+	irq_attach(irq);
+	cpu_init(engine, false, false, false, false, false);
+	cpu_hartid = h->id;
+	M.pc = entry;
+
+	for (;;) {
+		pthread_barrier_wait(&start);
+		while (M.instret < target)
+			cpu_run(target); /* no events of its own */
+		pthread_barrier_wait(&done);
+	}
+	return NULL;
+}
+
+void hart_init(int n, uint64_t q, enum cpu_engine e) {
+	n_harts = n;
+	quantum = q;
+	engine = e;
+	entry = M.pc;
+
+	memory = mem_image_share();
+	queue = sched_share();
+	uart = uart_share();
+	irq = irq_share();
+	mem_device_lock = &device_lock;
+
+	if (pthread_barrier_init(&start, NULL, n) ||
+			pthread_barrier_init(&done, NULL, n)) {
+		perror("pthread_barrier_init");
+		exit(EXIT_FAILURE);
+	}
+
+	struct hart *harts = calloc(n, sizeof *harts);
+	if (harts == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 1; i < n; ++i) {
+		harts[i].id = i;
+		int err = pthread_create(&harts[i].thread, NULL, hart_main,
+				&harts[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void hart_run(uint64_t n) {
+	uint64_t end = M.instret + n;
+	while (M.instret < end) {
+		target = M.instret + quantum < end ? M.instret + quantum : end;
+		pthread_barrier_wait(&start);
+		while (M.instret < target) {
+			cpu_run(target);
+			run_due();
+		}
+		pthread_barrier_wait(&done);
+		run_due(); /* events raised by the other harts */
+	}
+}
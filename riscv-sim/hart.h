@@ -0,0 +1,27 @@
+#ifndef RVSIM_HART_H
+#define RVSIM_HART_H 1
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/* Multi-hart machines. Hart 0 is the calling thread's machine; each other
+   hart runs on a thread of its own with its own registers and caches but
+   the same memory, devices and event queue. Harts run in lockstep
+   quanta: every hart retires quantum instructions, then all of them wait
+   for each other. Device events raised by hart 0 are exact, those raised
+   by other harts take effect at the latest at the end of the quantum.
+   Device accesses are serialized with a lock. Only hart 0 takes
+   interrupts; WFI does not wait on the others. */
+
+#define HART_DEFAULT_QUANTUM 10000
+
+/* Start harts 1 to n_harts - 1 at M.pc. Call once hart 0 is fully set up
+   (memory loaded, cpu_init() done, devices initialized). */
+extern void hart_init(int n_harts, uint64_t quantum, enum cpu_engine engine);
+
+/* Run every hart for n instructions, in place of cpu_run() and
+   sched_run_due() */
+extern void hart_run(uint64_t n);
+
+#endif /* RVSIM_HART_H */
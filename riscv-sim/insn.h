@@ -0,0 +1,96 @@
+#ifndef RVSIM_INSN_H
+#define RVSIM_INSN_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Every instruction the decoder knows, as X(ID, name). The interpreter
+   variants generate one handler per entry. */
+#define INSN_LIST(X) \
+	X(INVALID, invalid) \
+	/* OP_LOAD */ \
+	X(LB, lb) X(LH, lh) X(LW, lw) X(LBU, lbu) X(LHU, lhu) \
+	/* OP_IMM */ \
+	X(ADDI, addi) X(SLLI, slli) X(SLTI, slti) X(SLTIU, sltiu) \
+	X(XORI, xori) X(SRLI, srli) X(SRAI, srai) X(ORI, ori) X(ANDI, andi) \
+	/* OP_AUIPC, OP_LUI */ \
+	X(AUIPC, auipc) X(LUI, lui) \
+	/* OP_STORE */ \
+	X(SB, sb) X(SH, sh) X(SW, sw) \
+	/* OP */ \
+	X(ADD, add) X(SUB, sub) X(SLL, sll) X(SLT, slt) X(SLTU, sltu) \
+	X(XOR, xor) X(SRL, srl) X(SRA, sra) X(OR, or) X(AND, and) \
+	/* OP, RV32M */ \
+	X(MUL, mul) X(MULH, mulh) X(MULHSU, mulhsu) X(MULHU, mulhu) \
+	X(DIV, div) X(DIVU, divu) X(REM, rem) X(REMU, remu) \
+	/* OP_BRANCH */ \
+	X(BEQ, beq) X(BNE, bne) X(BLT, blt) X(BGE, bge) X(BLTU, bltu) X(BGEU, bgeu) \
+	/* OP_JALR, OP_JAL */ \
+	X(JALR, jalr) X(JAL, jal) \
+	/* OP_MISC_MEM */ \
+	X(FENCE, fence) X(FENCE_I, fence_i) \
+	/* OP_AMO */ \
+	X(LR_W, lr_w) X(SC_W, sc_w) X(AMOSWAP_W, amoswap_w) \
+	X(AMOADD_W, amoadd_w) X(AMOXOR_W, amoxor_w) X(AMOAND_W, amoand_w) \
+	X(AMOOR_W, amoor_w) X(AMOMIN_W, amomin_w) X(AMOMAX_W, amomax_w) \
+	X(AMOMINU_W, amominu_w) X(AMOMAXU_W, amomaxu_w) \
+	/* OP_SYSTEM */ \
+	X(SYSTEM, system) \
+	X(CSRRW, csrrw) X(CSRRS, csrrs) X(CSRRC, csrrc) \
+	X(CSRRWI, csrrwi) X(CSRRSI, csrrsi) X(CSRRCI, csrrci) \
+	/* OP_LOAD_FP, OP_STORE_FP, RV32F */ \
+	X(FLW, flw) X(FSW, fsw) \
+	/* OP_MADD, OP_MSUB, OP_NMSUB, OP_NMADD */ \
+	X(FMADD_S, fmadd_s) X(FMSUB_S, fmsub_s) X(FNMSUB_S, fnmsub_s) \
+	X(FNMADD_S, fnmadd_s) \
+	/* OP_FP, with an f register result */ \
+	X(FADD_S, fadd_s) X(FSUB_S, fsub_s) X(FMUL_S, fmul_s) X(FDIV_S, fdiv_s) \
+	X(FSQRT_S, fsqrt_s) X(FSGNJ_S, fsgnj_s) X(FSGNJN_S, fsgnjn_s) \
+	X(FSGNJX_S, fsgnjx_s) X(FMIN_S, fmin_s) X(FMAX_S, fmax_s) \
+	X(FCVT_S_W, fcvt_s_w) X(FCVT_S_WU, fcvt_s_wu) X(FMV_W_X, fmv_w_x) \
+	/* OP_FP, with an x register result */ \
+	X(FCVT_W_S, fcvt_w_s) X(FCVT_WU_S, fcvt_wu_s) X(FMV_X_W, fmv_x_w) \
+	X(FEQ_S, feq_s) X(FLT_S, flt_s) X(FLE_S, fle_s) X(FCLASS_S, fclass_s)
+
+#define INSN_ENUM(id, name) I_##id,
+enum insn_id {
+	INSN_LIST(INSN_ENUM)
+	N_INSN_IDS
+};
+#undef INSN_ENUM
+
+struct insn;
+typedef void exec_f(const struct insn *in);
+
+/* Predecoded instruction */
+struct insn {
+	uint32_t pc; /* tag, DCACHE_INVALID if empty */
+	uint32_t raw; /* 16 bits wide if compressed */
+	exec_f *exec;
+	uint8_t id; /* enum insn_id */
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	uint32_t imm; /* already sign extended; rm for F instructions that
+	                 round, with rs3 << 3 for the fused ones */
+};
+
+/* Length in bytes, 2 for compressed instructions */
+static inline uint32_t insn_len(const struct insn *in) {
+	return (in->raw & 0x3) == 0x3 ? 4 : 2;
+}
+
+/* F instructions, and those of them with an f register result */
+static inline bool insn_fp(int id) {
+	return id >= I_FLW && id <= I_FCLASS_S;
+}
+
+static inline bool insn_fp_rd(int id) {
+	return id >= I_FLW && id <= I_FMV_W_X && id != I_FSW;
+}
+
+/* Shared by the execution engines in cpu.c and threaded.c */
+extern const struct insn *cpu_fetch(uint32_t pc); /* NULL if unmapped */
+extern void cpu_interp_run(uint64_t end); /* plain interpreter */
+
+#endif /* RVSIM_INSN_H */
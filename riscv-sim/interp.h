@@ -0,0 +1,755 @@
+/* Interpreter template. cpu.c includes this file once per variant, so the
+   handlers and dispatch loop are compiled with the tracing for that
+   variant only. Before including, define:
+
+     INTERP_NAME   prefix for the generated functions and tables
+     INTERP_TRACE  1 to print a disassembly of every instruction
+     INTERP_DEBUG  1 to dump the registers after every instruction; the
+                   disassembly is then printed only when verbose is set
+     INTERP_RECORD 1 to append a binary record of every instruction to
+                   the trace file
+     INTERP_PROFILE 1 to count the executions of every instruction, see
+                   prof.h
+     INTERP_CACHE  1 to run instruction fetches, loads and stores through
+                   the cache model, see cache.h
+     INTERP_WATCH  1 to check loads and stores against the watchpoints
+
+   No include guard on purpose. */
+
+#define INTERP_CAT2(a, b) a##_##b
+#define INTERP_CAT(a, b) INTERP_CAT2(a, b)
+#define FN(name) INTERP_CAT(INTERP_NAME, name)
+
+#if INTERP_DEBUG
+#define TRACE(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
+#elif INTERP_TRACE
+#define TRACE(...) printf(__VA_ARGS__)
+#else
+#define TRACE(...) do { } while (0)
+#endif
+
+#if INTERP_RECORD
+#define REC_MEM(f, addr, data) do { \
+		rec_cur->flags = (f); \
+		rec_cur->mem_addr = (addr); \
+		rec_cur->mem_data = (data); \
+	} while (0)
+#else
+#define REC_MEM(f, addr, data) do { } while (0)
+#endif
+
+#if INTERP_CACHE
+#define CACHE_DATA(addr, store) cache_data(M.pc, (addr), (store))
+#else
+#define CACHE_DATA(addr, store) do { } while (0)
+#endif
+
+#if INTERP_WATCH
+#define WATCH_DATA(addr, len, kind) watch((addr), (len), (kind))
+#else
+#define WATCH_DATA(addr, len, kind) do { } while (0)
+#endif
+
+static void FN(invalid)(const struct insn *in) {
+	TRACE("illegal instruction ");
+	exception(CAUSE_ILLEGAL_INSN, in->raw);
+}
+
+/* OP_LOAD */
+
+static void FN(lb)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	uint8_t m;
+	if (mem_load_byte(eff, &m) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.regs[in->rd] = sign_extend((uint32_t)m, 7);
+	REC_MEM(TRACE_F_LOAD, eff, m);
+	CACHE_DATA(eff, false);
+	WATCH_DATA(eff, 1, CPU_WATCH_READ);
+	TRACE("lb %s,%d(%s) ", regname[in->rd], (int32_t)in->imm, regname[in->rs1]);
+}
+
+static void FN(lh)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	uint16_t m;
+	if (eff % 2) {
+		TRACE("unaligned memory access ");
+		return;
+	}
+	if (mem_load_half(eff, &m) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.regs[in->rd] = sign_extend((uint32_t)m, 15);
+	REC_MEM(TRACE_F_LOAD, eff, m);
+	CACHE_DATA(eff, false);
+	WATCH_DATA(eff, 2, CPU_WATCH_READ);
+	TRACE("lh %s,%d(%s) ", regname[in->rd], (int32_t)in->imm, regname[in->rs1]);
+}
+
+static void FN(lw)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	uint32_t m;
+	if (eff % 4) {
+		TRACE("unaligned memory access ");
+		return;
+	}
+	if (mem_load_word(eff, &m) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.regs[in->rd] = m;
+	REC_MEM(TRACE_F_LOAD, eff, m);
+	CACHE_DATA(eff, false);
+	WATCH_DATA(eff, 4, CPU_WATCH_READ);
+	TRACE("lw %s,%d(%s) ", regname[in->rd], (int32_t)in->imm, regname[in->rs1]);
+}
+
+static void FN(lbu)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	uint8_t m;
+	if (mem_load_byte(eff, &m) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.regs[in->rd] = (uint32_t)m;
+	REC_MEM(TRACE_F_LOAD, eff, m);
+	CACHE_DATA(eff, false);
+	WATCH_DATA(eff, 1, CPU_WATCH_READ);
+	TRACE("lbu %s,%d(%s) ", regname[in->rd], (int32_t)in->imm, regname[in->rs1]);
+}
+
+static void FN(lhu)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	uint16_t m;
+	if (eff % 2) {
+		TRACE("unaligned memory access ");
+		return;
+	}
+	if (mem_load_half(eff, &m) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.regs[in->rd] = (uint32_t)m;
+	REC_MEM(TRACE_F_LOAD, eff, m);
+	CACHE_DATA(eff, false);
+	WATCH_DATA(eff, 2, CPU_WATCH_READ);
+	TRACE("lhu %s,%d(%s) ", regname[in->rd], (int32_t)in->imm, regname[in->rs1]);
+}
+
+/* OP_IMM */
+
+static void FN(addi)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] + in->imm;
+	TRACE("addi %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(slli)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] << in->imm;
+	TRACE("slli %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(slti)(const struct insn *in) {
+	M.regs[in->rd] = (int32_t)M.regs[in->rs1] < (int32_t)in->imm;
+	TRACE("slti %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(sltiu)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] < in->imm;
+	TRACE("sltiu %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(xori)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] ^ in->imm;
+	TRACE("xori %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(srli)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] >> in->imm;
+	TRACE("srli %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(srai)(const struct insn *in) {
+	M.regs[in->rd] = (uint32_t)(((int32_t)M.regs[in->rs1]) >> in->imm);
+	TRACE("srai %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(ori)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] | in->imm;
+	TRACE("ori %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+static void FN(andi)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] & in->imm;
+	TRACE("andi %s,%s,%d ", regname[in->rd], regname[in->rs1], in->imm);
+}
+
+/* OP_AUIPC / OP_LUI */
+
+static void FN(auipc)(const struct insn *in) {
+	M.regs[in->rd] = M.pc + in->imm;
+	TRACE("auipc %s,%u ", regname[in->rd], in->imm);
+}
+
+static void FN(lui)(const struct insn *in) {
+	M.regs[in->rd] = in->imm;
+	TRACE("lui %s,0x%x ", regname[in->rd], in->imm >> 12);
+}
+
+/* OP_STORE */
+
+static void FN(sb)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	if (mem_store_byte(eff, M.regs[in->rs2]) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	REC_MEM(TRACE_F_STORE, eff, M.regs[in->rs2]);
+	CACHE_DATA(eff, true);
+	WATCH_DATA(eff, 1, CPU_WATCH_WRITE);
+	TRACE("sb %s,%d(%s) ", regname[in->rs2], (int32_t)in->imm, regname[in->rs1]);
+}
+
+static void FN(sh)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	if (eff % 2) {
+		TRACE("unaligned memory access ");
+		return;
+	}
+	if (mem_store_half(eff, M.regs[in->rs2]) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	REC_MEM(TRACE_F_STORE, eff, M.regs[in->rs2]);
+	CACHE_DATA(eff, true);
+	WATCH_DATA(eff, 2, CPU_WATCH_WRITE);
+	TRACE("sh %s,%d(%s) ", regname[in->rs2], (int32_t)in->imm, regname[in->rs1]);
+}
+
+static void FN(sw)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	if (eff % 4) {
+		TRACE("unaligned memory access ");
+		return;
+	}
+	if (mem_store_word(eff, M.regs[in->rs2]) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	REC_MEM(TRACE_F_STORE, eff, M.regs[in->rs2]);
+	CACHE_DATA(eff, true);
+	WATCH_DATA(eff, 4, CPU_WATCH_WRITE);
+	TRACE("sw %s,%d(%s) ", regname[in->rs2], (int32_t)in->imm, regname[in->rs1]);
+}
+
+/* OP */
+
+static void FN(add)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] + M.regs[in->rs2];
+	TRACE("add %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(sub)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] - M.regs[in->rs2];
+	TRACE("sub %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(sll)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] << (M.regs[in->rs2] & 0x1F); /* 1 1111 */
+	TRACE("sll %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(slt)(const struct insn *in) {
+	M.regs[in->rd] = (int32_t)M.regs[in->rs1] < (int32_t)M.regs[in->rs2];
+	TRACE("slt %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(sltu)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] < M.regs[in->rs2];
+	TRACE("sltu %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(xor)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] ^ M.regs[in->rs2];
+	TRACE("xor %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(srl)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] >> (M.regs[in->rs2] & 0x1F);
+	TRACE("srl %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(sra)(const struct insn *in) {
+	M.regs[in->rd] = (int32_t)M.regs[in->rs1] >> (M.regs[in->rs2] & 0x1F);
+	TRACE("sra %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(or)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] | M.regs[in->rs2];
+	TRACE("or %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(and)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] & M.regs[in->rs2];
+	TRACE("and %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+/* OP, RV32M
+   Division by zero and the overflow of DIV/REM do not trap; they give the
+   results the spec defines. */
+
+static void FN(mul)(const struct insn *in) {
+	M.regs[in->rd] = M.regs[in->rs1] * M.regs[in->rs2];
+	TRACE("mul %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(mulh)(const struct insn *in) {
+	M.regs[in->rd] = ((int64_t)(int32_t)M.regs[in->rs1] *
+			(int32_t)M.regs[in->rs2]) >> 32;
+	TRACE("mulh %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(mulhsu)(const struct insn *in) {
+	M.regs[in->rd] = ((int64_t)(int32_t)M.regs[in->rs1] *
+			(uint64_t)M.regs[in->rs2]) >> 32;
+	TRACE("mulhsu %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(mulhu)(const struct insn *in) {
+	M.regs[in->rd] = ((uint64_t)M.regs[in->rs1] * M.regs[in->rs2]) >> 32;
+	TRACE("mulhu %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(div)(const struct insn *in) {
+	int32_t a = M.regs[in->rs1], b = M.regs[in->rs2];
+	if (b == 0)
+		M.regs[in->rd] = UINT32_MAX;
+	else if (a == INT32_MIN && b == -1)
+		M.regs[in->rd] = a;
+	else
+		M.regs[in->rd] = a / b;
+	TRACE("div %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(divu)(const struct insn *in) {
+	uint32_t a = M.regs[in->rs1], b = M.regs[in->rs2];
+	M.regs[in->rd] = b == 0 ? UINT32_MAX : a / b;
+	TRACE("divu %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(rem)(const struct insn *in) {
+	int32_t a = M.regs[in->rs1], b = M.regs[in->rs2];
+	if (b == 0)
+		M.regs[in->rd] = a;
+	else if (a == INT32_MIN && b == -1)
+		M.regs[in->rd] = 0;
+	else
+		M.regs[in->rd] = a % b;
+	TRACE("rem %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+static void FN(remu)(const struct insn *in) {
+	uint32_t a = M.regs[in->rs1], b = M.regs[in->rs2];
+	M.regs[in->rd] = b == 0 ? a : a % b;
+	TRACE("remu %s,%s,%s ", regname[in->rd], regname[in->rs1], regname[in->rs2]);
+}
+
+/* OP_BRANCH
+   The branch target is kept pc relative in imm. Taken branches and jumps
+   redirect next_pc, which becomes M.pc once the instruction completes.
+   Until then it is the address of the next instruction, the link for
+   jumps. */
+
+static void FN(beq)(const struct insn *in) {
+	uint32_t eff = M.pc + in->imm;
+	if (M.regs[in->rs1] == M.regs[in->rs2])
+		next_pc = eff;
+	TRACE("beq %s,%s,0x%x ", regname[in->rs1], regname[in->rs2], eff);
+}
+
+static void FN(bne)(const struct insn *in) {
+	uint32_t eff = M.pc + in->imm;
+	if (M.regs[in->rs1] != M.regs[in->rs2])
+		next_pc = eff;
+	TRACE("bne %s,%s,0x%x ", regname[in->rs1], regname[in->rs2], eff);
+}
+
+static void FN(blt)(const struct insn *in) {
+	uint32_t eff = M.pc + in->imm;
+	if ((int32_t)M.regs[in->rs1] < (int32_t)M.regs[in->rs2])
+		next_pc = eff;
+	TRACE("blt %s,%s,0x%x ", regname[in->rs1], regname[in->rs2], eff);
+}
+
+static void FN(bge)(const struct insn *in) {
+	uint32_t eff = M.pc + in->imm;
+	if ((int32_t)M.regs[in->rs1] >= (int32_t)M.regs[in->rs2])
+		next_pc = eff;
+	TRACE("bge %s,%s,0x%x ", regname[in->rs1], regname[in->rs2], eff);
+}
+
+static void FN(bltu)(const struct insn *in) {
+	uint32_t eff = M.pc + in->imm;
+	if (M.regs[in->rs1] < M.regs[in->rs2])
+		next_pc = eff;
+	TRACE("bltu %s,%s,0x%x ", regname[in->rs1], regname[in->rs2], eff);
+}
+
+static void FN(bgeu)(const struct insn *in) {
+	uint32_t eff = M.pc + in->imm;
+	if (M.regs[in->rs1] >= M.regs[in->rs2])
+		next_pc = eff;
+	TRACE("bgeu %s,%s,0x%x ", regname[in->rs1], regname[in->rs2], eff);
+}
+
+/* OP_JALR / OP_JAL */
+
+static void FN(jalr)(const struct insn *in) {
+	uint32_t eff = (M.regs[in->rs1] + in->imm) & ~0x1;
+	M.regs[in->rd] = next_pc;
+	next_pc = eff;
+	TRACE("jalr %s,%s,0x%x", regname[in->rd], regname[in->rs1], eff);
+}
+
+static void FN(jal)(const struct insn *in) {
+	uint32_t eff = M.pc + in->imm;
+	M.regs[in->rd] = next_pc;
+	next_pc = eff;
+	TRACE("jal %s,0x%x ", regname[in->rd], eff);
+}
+
+/* OP_MISC_MEM */
+
+static void FN(fence)(const struct insn *in) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	TRACE("fence ");
+}
+
+static void FN(fence_i)(const struct insn *in) {
+	flush_code();
+	TRACE("fence.i ");
+}
+
+/* OP_AMO */
+
+static void FN(lr_w)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1];
+	uint32_t m;
+	if (load_reserved(eff, &m) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.regs[in->rd] = m;
+	REC_MEM(TRACE_F_LOAD, eff, m);
+	CACHE_DATA(eff, false);
+	WATCH_DATA(eff, 4, CPU_WATCH_READ);
+	TRACE("lr.w %s,(%s)", regname[in->rd], regname[in->rs1]);
+}
+
+static void FN(sc_w)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1];
+	uint32_t value = M.regs[in->rs2];
+	int r = store_conditional(eff, value);
+	if (r < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.regs[in->rd] = r;
+	if (r == 0) {
+		REC_MEM(TRACE_F_STORE, eff, value);
+		CACHE_DATA(eff, true);
+		WATCH_DATA(eff, 4, CPU_WATCH_WRITE);
+	}
+	TRACE("sc.w %s,%s,(%s)", regname[in->rd], regname[in->rs2],
+			regname[in->rs1]);
+}
+
+#define AMO(name, ID, mnemonic) \
+static void FN(name)(const struct insn *in) { \
+	uint32_t eff = M.regs[in->rs1]; \
+	uint32_t m; \
+	if (amo(I_##ID, eff, M.regs[in->rs2], &m) < 0) { \
+		TRACE("illegal memory access "); \
+		return; \
+	} \
+	M.regs[in->rd] = m; \
+	REC_MEM(TRACE_F_LOAD, eff, m); \
+	CACHE_DATA(eff, true); \
+	WATCH_DATA(eff, 4, CPU_WATCH_ACCESS); \
+	TRACE(mnemonic " %s,%s,(%s)", regname[in->rd], regname[in->rs2], \
+			regname[in->rs1]); \
+}
+
+AMO(amoswap_w, AMOSWAP_W, "amoswap.w")
+AMO(amoadd_w, AMOADD_W, "amoadd.w")
+AMO(amoxor_w, AMOXOR_W, "amoxor.w")
+AMO(amoand_w, AMOAND_W, "amoand.w")
+AMO(amoor_w, AMOOR_W, "amoor.w")
+AMO(amomin_w, AMOMIN_W, "amomin.w")
+AMO(amomax_w, AMOMAX_W, "amomax.w")
+AMO(amominu_w, AMOMINU_W, "amominu.w")
+AMO(amomaxu_w, AMOMAXU_W, "amomaxu.w")
+#undef AMO
+
+/* OP_SYSTEM */
+
+static void FN(system)(const struct insn *in) {
+	switch (in->raw) {
+	case ECALL:
+		TRACE("ecall ");
+		exception(CAUSE_ECALL_M, 0);
+		break;
+	case EBREAK:
+	case C_EBREAK:
+		TRACE("ebreak ");
+		if (halt_on_ebreak) {
+			next_pc = M.pc;
+			sched_at(&halt_event, M.instret);
+		}
+		break;
+	case MRET:
+		TRACE("mret ");
+		next_pc = csr_mret();
+		break;
+	case WFI:
+		TRACE("wfi ");
+		wfi();
+		break;
+	default:
+		TRACE("illegal instruction ");
+		exception(CAUSE_ILLEGAL_INSN, in->raw);
+		break;
+	}
+}
+
+/* Zicsr, see csr_rw(). The immediate forms take the uimm from the rs1
+   field. */
+
+#define CSR(name, format, src, operand) \
+static void FN(name)(const struct insn *in) { \
+	uint32_t old; \
+	if (csr_rw(in, (src), &old) < 0) { \
+		TRACE("illegal instruction "); \
+		exception(CAUSE_ILLEGAL_INSN, in->raw); \
+		return; \
+	} \
+	M.regs[in->rd] = old; \
+	TRACE(format, regname[in->rd], csr_name(in->imm), (operand)); \
+}
+
+CSR(csrrw, "csrrw %s,%s,%s ", M.regs[in->rs1], regname[in->rs1])
+CSR(csrrs, "csrrs %s,%s,%s ", M.regs[in->rs1], regname[in->rs1])
+CSR(csrrc, "csrrc %s,%s,%s ", M.regs[in->rs1], regname[in->rs1])
+CSR(csrrwi, "csrrwi %s,%s,%u ", in->rs1, in->rs1)
+CSR(csrrsi, "csrrsi %s,%s,%u ", in->rs1, in->rs1)
+CSR(csrrci, "csrrci %s,%s,%u ", in->rs1, in->rs1)
+#undef CSR
+
+/* RV32F, see fpu.h. Decoding leaves them I_INVALID while mstatus.FS is
+   off, and resolves the dynamic rounding mode into in->imm. */
+
+/* Rounding mode operand as written, for traces */
+#define RM(in) rmname[((in)->raw >> 12) & 0x7]
+
+static void FN(flw)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	uint32_t m;
+	if (eff % 4) {
+		TRACE("unaligned memory access ");
+		return;
+	}
+	if (mem_load_word(eff, &m) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	M.fregs[in->rd] = m;
+	REC_MEM(TRACE_F_LOAD, eff, m);
+	CACHE_DATA(eff, false);
+	WATCH_DATA(eff, 4, CPU_WATCH_READ);
+	TRACE("flw %s,%d(%s) ", fregname[in->rd], (int32_t)in->imm, regname[in->rs1]);
+}
+
+static void FN(fsw)(const struct insn *in) {
+	uint32_t eff = M.regs[in->rs1] + in->imm;
+	if (eff % 4) {
+		TRACE("unaligned memory access ");
+		return;
+	}
+	if (mem_store_word(eff, M.fregs[in->rs2]) < 0) {
+		TRACE("illegal memory access ");
+		return;
+	}
+	REC_MEM(TRACE_F_STORE, eff, M.fregs[in->rs2]);
+	CACHE_DATA(eff, true);
+	WATCH_DATA(eff, 4, CPU_WATCH_WRITE);
+	TRACE("fsw %s,%d(%s) ", fregname[in->rs2], (int32_t)in->imm, regname[in->rs1]);
+}
+
+/* in->imm is rm | rs3 << 3 */
+#define FMA(name, mnemonic, neg_a, neg_c) \
+static void FN(name)(const struct insn *in) { \
+	uint32_t rs3 = in->imm >> 3; \
+	M.fregs[in->rd] = fpu_fma(M.fregs[in->rs1] ^ (neg_a), \
+			M.fregs[in->rs2], M.fregs[rs3] ^ (neg_c), in->imm & 0x7); \
+	TRACE(mnemonic " %s,%s,%s,%s%s ", fregname[in->rd], \
+			fregname[in->rs1], fregname[in->rs2], fregname[rs3], RM(in)); \
+}
+
+FMA(fmadd_s, "fmadd.s", 0, 0)
+FMA(fmsub_s, "fmsub.s", 0, FPU_SIGN)
+FMA(fnmsub_s, "fnmsub.s", FPU_SIGN, 0)
+FMA(fnmadd_s, "fnmadd.s", FPU_SIGN, FPU_SIGN)
+#undef FMA
+
+/* fd = expr of a = fs1 and b = fs2, with rounding mode rm if it has one */
+#define FP_OP(name, mnemonic, expr, rm) \
+static void FN(name)(const struct insn *in) { \
+	uint32_t a = M.fregs[in->rs1], b = M.fregs[in->rs2]; \
+	M.fregs[in->rd] = (expr); \
+	TRACE(mnemonic " %s,%s,%s%s ", fregname[in->rd], fregname[in->rs1], \
+			fregname[in->rs2], (rm)); \
+}
+
+FP_OP(fadd_s, "fadd.s", fpu_add(a, b, in->imm), RM(in))
+FP_OP(fsub_s, "fsub.s", fpu_sub(a, b, in->imm), RM(in))
+FP_OP(fmul_s, "fmul.s", fpu_mul(a, b, in->imm), RM(in))
+FP_OP(fdiv_s, "fdiv.s", fpu_div(a, b, in->imm), RM(in))
+FP_OP(fsgnj_s, "fsgnj.s", fpu_sgnj(a, b), "")
+FP_OP(fsgnjn_s, "fsgnjn.s", fpu_sgnjn(a, b), "")
+FP_OP(fsgnjx_s, "fsgnjx.s", fpu_sgnjx(a, b), "")
+FP_OP(fmin_s, "fmin.s", fpu_min(a, b), "")
+FP_OP(fmax_s, "fmax.s", fpu_max(a, b), "")
+#undef FP_OP
+
+/* rd = expr of a = fs1 and b = fs2 */
+#define FP_CMP(name, mnemonic, expr) \
+static void FN(name)(const struct insn *in) { \
+	uint32_t a = M.fregs[in->rs1], b = M.fregs[in->rs2]; \
+	M.regs[in->rd] = (expr); \
+	TRACE(mnemonic " %s,%s,%s ", regname[in->rd], fregname[in->rs1], \
+			fregname[in->rs2]); \
+}
+
+FP_CMP(feq_s, "feq.s", fpu_eq(a, b))
+FP_CMP(flt_s, "flt.s", fpu_lt(a, b))
+FP_CMP(fle_s, "fle.s", fpu_le(a, b))
+#undef FP_CMP
+
+/* One source operand, the names of the destination and source register
+   files given by rd_names and rs1_names */
+#define FP_UNARY(name, mnemonic, rd_reg, expr, rd_names, rs1_names, rm) \
+static void FN(name)(const struct insn *in) { \
+	rd_reg = (expr); \
+	TRACE(mnemonic " %s,%s%s ", rd_names[in->rd], rs1_names[in->rs1], (rm)); \
+}
+
+FP_UNARY(fsqrt_s, "fsqrt.s", M.fregs[in->rd],
+		fpu_sqrt(M.fregs[in->rs1], in->imm), fregname, fregname, RM(in))
+FP_UNARY(fcvt_w_s, "fcvt.w.s", M.regs[in->rd],
+		fpu_cvt_w_s(M.fregs[in->rs1], in->imm), regname, fregname, RM(in))
+FP_UNARY(fcvt_wu_s, "fcvt.wu.s", M.regs[in->rd],
+		fpu_cvt_wu_s(M.fregs[in->rs1], in->imm), regname, fregname, RM(in))
+FP_UNARY(fcvt_s_w, "fcvt.s.w", M.fregs[in->rd],
+		fpu_cvt_s_w(M.regs[in->rs1], in->imm), fregname, regname, RM(in))
+FP_UNARY(fcvt_s_wu, "fcvt.s.wu", M.fregs[in->rd],
+		fpu_cvt_s_wu(M.regs[in->rs1], in->imm), fregname, regname, RM(in))
+FP_UNARY(fmv_x_w, "fmv.x.w", M.regs[in->rd], M.fregs[in->rs1],
+		regname, fregname, "")
+FP_UNARY(fmv_w_x, "fmv.w.x", M.fregs[in->rd], M.regs[in->rs1],
+		fregname, regname, "")
+FP_UNARY(fclass_s, "fclass.s", M.regs[in->rd], fpu_class(M.fregs[in->rs1]),
+		regname, fregname, "")
+#undef FP_UNARY
+#undef RM
+
+/* The step function takes every instruction to be 4 bytes long, so that
+   the next pc does not wait for the decode cache entry. Compressed
+   instructions run these instead, which correct it. */
+#define INSN_C_HANDLER(id, name) \
+static void FN(c_##name)(const struct insn *in) { \
+	next_pc = M.pc + 2; \
+	FN(name)(in); \
+}
+INSN_LIST(INSN_C_HANDLER)
+#undef INSN_C_HANDLER
+
+/* Indexed by RVC_COMPRESSED(in->raw), then by in->id */
+#define INSN_HANDLER(id, name) [I_##id] = FN(name),
+#define INSN_C_HANDLER(id, name) [I_##id] = FN(c_##name),
+static exec_f *const FN(ops)[2][N_INSN_IDS] = {
+	{ INSN_LIST(INSN_HANDLER) },
+	{ INSN_LIST(INSN_C_HANDLER) },
+};
+#undef INSN_HANDLER
+#undef INSN_C_HANDLER
+
+static inline void FN(step)(void) {
+	M.instret++;
+
+	/* Only the interpreter meets a pc it cannot fetch from: the other
+	   engines leave such blocks to it */
+	const struct insn *in = fetch(M.pc);
+	if (in == NULL) {
+		TRACE("%.8x: instruction access fault\n", M.pc);
+		exception(CAUSE_FETCH_ACCESS, M.pc);
+		M.pc = next_pc;
+		return;
+	}
+
+	TRACE("%.8x: %8.*x - ", M.pc, (int)insn_len(in) * 2, in->raw);
+	next_pc = M.pc + 4; /* see FN(ops) */
+
+#if INTERP_PROFILE
+	prof_count(M.pc, in->id);
+#endif
+#if INTERP_CACHE
+	cache_fetch(M.pc);
+#endif
+
+#if INTERP_RECORD
+	struct trace_rec *rec = trace_next();
+	rec->pc = M.pc;
+	rec->instr = in->raw;
+	rec->flags = 0;
+	rec->mem_addr = 0;
+	rec->mem_data = 0;
+	rec_cur = rec;
+#endif
+
+	in->exec(in);
+
+	M.regs[0] = 0;
+
+#if INTERP_RECORD
+	rec->rd_value = insn_fp_rd(in->id) ? M.fregs[in->rd] : M.regs[in->rd];
+#endif
+
+	TRACE("\n");
+#if INTERP_DEBUG
+	cpu_print_regs();
+	printf("\n");
+#endif
+
+	M.pc = next_pc;
+}
+
+static void FN(run)(uint64_t end) {
+	if (end > sched_next_event)
+		end = sched_next_event;
+	while (M.instret < end) {
+		FN(step)();
+		/* a device access may have scheduled an earlier event */
+		if (sched_next_event < end)
+			end = sched_next_event;
+	}
+}
+
+#undef TRACE
+#undef REC_MEM
+#undef CACHE_DATA
+#undef WATCH_DATA
+#undef FN
+#undef INTERP_CAT
+#undef INTERP_CAT2
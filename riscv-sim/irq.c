@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "irq.h"
+#include "mem.h"
+#include "sched.h"
+
+struct irq {
+	uint32_t lines; /* mip, but for the external line */
+	uint32_t sources; /* one bit per external source */
+	uint32_t msip;
+	uint64_t mtimecmp;
+	uint64_t mtime_offset;
+	struct sched_event check; /* due immediately, see irq_update() */
+	struct sched_event timer; /* mtime reaches mtimecmp */
+};
+
+/* Per machine like the UART, see uart.c */
+static __thread struct irq own;
+static __thread struct irq *ic;
+
+uint32_t irq_pending(void) {
+	uint32_t mip = ic->lines;
+	if (ic->sources)
+		mip |= 1u << IRQ_MEI;
+	return mip;
+}
+
+/* Taking the interrupt is left to the event, as it has to happen between
+   two instructions: the run loops leave as soon as an event is due */
+void irq_update(void) {
+	if (irq_pending())
+		sched_at(&ic->check, M.instret);
+}
+
+static void check(void *arg) {
+	cpu_interrupt();
+}
+
+static void set_line(int irq, bool level) {
+	if (level) {
+		ic->lines |= 1u << irq;
+		irq_update();
+	} else {
+		ic->lines &= ~(1u << irq);
+	}
+}
+
+void irq_set_source(int src, bool level) {
+	if (level) {
+		ic->sources |= 1u << src;
+		irq_update();
+	} else {
+		ic->sources &= ~(1u << src);
+	}
+}
+
+uint64_t irq_mtime(void) {
+	return M.instret + ic->mtime_offset;
+}
+
+/* The timer line is high while mtime >= mtimecmp. Raise it now, or
+   schedule the event for when mtime gets there. */
+static void timer_update(void) {
+	uint64_t now = irq_mtime();
+	sched_cancel(&ic->timer);
+	if (now >= ic->mtimecmp) {
+		set_line(IRQ_MTI, true);
+		return;
+	}
+	set_line(IRQ_MTI, false);
+	uint64_t delay = ic->mtimecmp - now;
+	if (delay < SCHED_NEVER - M.instret)
+		sched_after(&ic->timer, delay);
+}
+
+static void timer(void *arg) {
+	timer_update();
+}
+
+static uint8_t get_byte(uint64_t v, uint32_t i) {
+	return v >> (8 * i);
+}
+
+static uint64_t set_byte(uint64_t v, uint32_t i, uint8_t b) {
+	return (v & ~((uint64_t)0xff << (8 * i))) | (uint64_t)b << (8 * i);
+}
+
+uint8_t irq_clint_load(uint32_t offset) {
+	if (offset - IRQ_CLINT_MSIP < 4)
+		return get_byte(ic->msip, offset - IRQ_CLINT_MSIP);
+	if (offset - IRQ_CLINT_MTIMECMP < 8)
+		return get_byte(ic->mtimecmp, offset - IRQ_CLINT_MTIMECMP);
+	if (offset - IRQ_CLINT_MTIME < 8) {
+		/* mtime moves on without any event, so its readers never idle */
+		mem_read_effects++;
+		return get_byte(irq_mtime(), offset - IRQ_CLINT_MTIME);
+	}
+	return 0;
+}
+
+void irq_clint_store(uint32_t offset, uint8_t value) {
+	if (offset - IRQ_CLINT_MSIP < 4) {
+		ic->msip = set_byte(ic->msip, offset - IRQ_CLINT_MSIP, value) & 0x1;
+		set_line(IRQ_MSI, ic->msip);
+	} else if (offset - IRQ_CLINT_MTIMECMP < 8) {
+		ic->mtimecmp = set_byte(ic->mtimecmp, offset - IRQ_CLINT_MTIMECMP,
+				value);
+		timer_update();
+	} else if (offset - IRQ_CLINT_MTIME < 8) {
+		uint64_t mtime = set_byte(irq_mtime(), offset - IRQ_CLINT_MTIME,
+				value);
+		ic->mtime_offset = mtime - M.instret;
+		timer_update();
+	}
+}
+
+void irq_save(struct irq_state *s) {
+	memset(s, 0, sizeof *s);
+	s->mtimecmp = ic->mtimecmp;
+	s->mtime_offset = ic->mtime_offset;
+	s->msip = ic->msip;
+}
+
+/* Call with M.instret restored. The devices restore their sources. */
+void irq_restore(const struct irq_state *s) {
+	ic->mtimecmp = s->mtimecmp;
+	ic->mtime_offset = s->mtime_offset;
+	ic->msip = s->msip & 0x1;
+	set_line(IRQ_MSI, ic->msip);
+	timer_update();
+}
+
+struct irq *irq_share(void) {
+	return ic;
+}
+
+void irq_attach(struct irq *shared) {
+	ic = shared;
+}
+
+void irq_init(void) {
+	ic = &own;
+	memset(ic, 0, sizeof *ic);
+	ic->mtimecmp = UINT64_MAX; /* no timer interrupt until programmed */
+	sched_event_init(&ic->check, check, NULL);
+	sched_event_init(&ic->timer, timer, NULL);
+}
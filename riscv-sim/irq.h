@@ -0,0 +1,71 @@
+#ifndef RVSIM_IRQ_H
+#define RVSIM_IRQ_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Interrupt controller. It owns the machine's interrupt lines, which are
+   the bits of mip, and holds a CLINT for the timer and software
+   interrupts. The external interrupt line is the OR of the device
+   sources. Whenever a line rises or mie or mstatus.MIE may have enabled
+   one, an event due immediately makes the core leave its run loop and
+   cpu_interrupt() take the interrupt. Only hart 0 takes interrupts. */
+
+/* Interrupt numbers, also the bits of mip and mie */
+#define IRQ_MSI 3  /* machine software, CLINT msip */
+#define IRQ_MTI 7  /* machine timer, CLINT mtime >= mtimecmp */
+#define IRQ_MEI 11 /* machine external, any device source */
+
+/* External sources */
+enum {
+	IRQ_SRC_UART,
+};
+
+/* CLINT registers, offsets from IRQ_CLINT_BASE. mtime counts core
+   clock cycles. */
+#define IRQ_CLINT_BASE     0x82000000
+#define IRQ_CLINT_SIZE     0x10000
+#define IRQ_CLINT_MSIP     0x0000
+#define IRQ_CLINT_MTIMECMP 0x4000
+#define IRQ_CLINT_MTIME    0xbff8
+
+/* CLINT state, for checkpoints. Line levels follow from it and from the
+   devices. */
+struct irq_state {
+	uint64_t mtimecmp;
+	uint64_t mtime_offset; /* mtime - M.instret */
+	uint32_t msip;
+	uint32_t pad;
+};
+
+/* Reset the controller of this thread's machine. Call after sched_init()
+   if the thread ran another machine before. */
+extern void irq_init(void);
+
+/* The harts of one machine share the controller of the thread that
+   initialized it. Accesses must be serialized by the machine's device
+   lock. */
+struct irq;
+extern struct irq *irq_share(void);
+extern void irq_attach(struct irq *shared);
+
+/* Drive external source src */
+extern void irq_set_source(int src, bool level);
+
+/* Value of mip */
+extern uint32_t irq_pending(void);
+
+/* Check for an interrupt to take once the current instruction completes,
+   after a write to mie or mstatus */
+extern void irq_update(void);
+
+extern uint64_t irq_mtime(void);
+
+/* CLINT registers, byte at a time like every device */
+extern uint8_t irq_clint_load(uint32_t offset);
+extern void irq_clint_store(uint32_t offset, uint8_t value);
+
+extern void irq_save(struct irq_state *s);
+extern void irq_restore(const struct irq_state *s);
+
+#endif /* RVSIM_IRQ_H */
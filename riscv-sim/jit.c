@@ -0,0 +1,904 @@
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "fpu.h"
+#include "insn.h"
+#include "jit.h"
+#include "mem.h"
+#include "sched.h"
+
+#if defined(__x86_64__)
+
+/* Native code runs with rbx pointing at M. Everything else it touches
+   (page table pointer, limit, exit site, indirect jump table) is thread
+   local like M, so it sits in the same TLS block and is addressed relative
+   to rbx with a 32 bit displacement. Each thread has its own code cache
+   and only ever runs code it generated itself.
+
+   Block layout:
+     entry:  if (M.instret + n > limit) leave with M.pc = pc
+             M.instret += n
+             body, one piece of code per guest instruction
+             jump to the successor(s)
+     stubs:  leave with M.pc = successor, recording the jump so that it
+             can be patched to go straight to the successor later */
+
+#define JIT_CACHE_SIZE (32 << 20)
+#define JIT_BLOCK_MAX (16 << 10) /* bound on the code of one block */
+#define JIT_MAX_FIXUPS (3 * 64)
+#define IND_BITS 12
+#define IND_SIZE (1 << IND_BITS)
+#define IND_NONE 0xffffffff /* never a jalr target, bit 0 is cleared */
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/* x86 condition codes */
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+	CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd };
+
+/* Guest registers kept in host registers while native code runs. rax,
+   rcx and rdx are scratch, rbx is M, the rest hold the registers gcc
+   uses most (ra, sp, s0/s1, t0 and a0-a5). */
+static const struct {
+	uint8_t guest;
+	uint8_t host;
+} reg_map[] = {
+	{ 1, RSI }, { 2, R12 }, { 5, RDI }, { 8, R13 }, { 9, R8 }, { 10, R14 },
+	{ 11, R15 }, { 12, R9 }, { 13, R10 }, { 14, R11 }, { 15, RBP },
+};
+#define N_MAPPED (sizeof reg_map / sizeof reg_map[0])
+
+static __thread int8_t host_of[32]; /* -1 if the guest register stays in M */
+
+struct ind_entry {
+	uint32_t pc;
+	uint32_t pad;
+	void *entry;
+};
+
+/* State shared with native code */
+static __thread uint64_t limit;
+static __thread uint8_t *exit_site;
+static __thread struct ind_entry ind_table[IND_SIZE];
+
+static __thread bool flushed; /* set by jit_flush(), polled by the store helpers */
+
+static __thread uint8_t *cache;
+static __thread uint8_t *code_start; /* first byte after the fixed routines */
+static __thread uint8_t *cp; /* emit position */
+
+static __thread void (*enter)(void *entry);
+static __thread uint8_t *exit_common; /* eax = M.pc, rdx = exit site */
+static __thread uint8_t *indirect; /* eax = target */
+
+struct fixup {
+	uint8_t *rel; /* rel32 to point at the exit stub */
+	uint32_t pc;
+	bool link;
+};
+
+static __thread struct fixup fixups[JIT_MAX_FIXUPS];
+static __thread int n_fixups;
+
+/* Emitter */
+
+static void emit8(uint8_t b) {
+	*cp++ = b;
+}
+
+static void emit32(uint32_t v) {
+	memcpy(cp, &v, 4);
+	cp += 4;
+}
+
+static void emit64(uint64_t v) {
+	memcpy(cp, &v, 8);
+	cp += 8;
+}
+
+static void rex(int w, int reg, int index, int base) {
+	uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) |
+		(base >> 3);
+	if (r != 0x40)
+		emit8(r);
+}
+
+static void opcode(unsigned opc) {
+	if (opc > 0xff)
+		emit8(opc >> 8);
+	emit8(opc);
+}
+
+/* opc reg, rm (register direct) */
+static void rr(int w, unsigned opc, int reg, int rm) {
+	rex(w, reg, 0, rm);
+	opcode(opc);
+	emit8(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* opc reg, [base + index + disp], index < 0 for none */
+static void rm(int w, unsigned opc, int reg, int base, int index, int32_t disp) {
+	rex(w, reg, index < 0 ? 0 : index, base);
+	opcode(opc);
+	if (index < 0 && (base & 7) != RSP) {
+		emit8(0x80 | (reg & 7) << 3 | (base & 7));
+	} else {
+		emit8(0x80 | (reg & 7) << 3 | RSP);
+		emit8((index < 0 ? RSP : index & 7) << 3 | (base & 7));
+	}
+	emit32(disp);
+}
+
+static void mov_imm(int reg, uint32_t imm) {
+	rex(0, 0, 0, reg);
+	emit8(0xb8 + (reg & 7));
+	emit32(imm);
+}
+
+static void mov_imm64(int reg, uint64_t imm) {
+	rex(1, 0, 0, reg);
+	emit8(0xb8 + (reg & 7));
+	emit64(imm);
+}
+
+/* group 1 ALU with an immediate: /0 add, /1 or, /4 and, /5 sub, /6 xor, /7 cmp */
+static void alu_imm(int w, int digit, int reg, uint32_t imm) {
+	rr(w, 0x81, digit, reg);
+	emit32(imm);
+}
+
+static void push(int reg) {
+	rex(0, 0, 0, reg);
+	emit8(0x50 + (reg & 7));
+}
+
+static void pop(int reg) {
+	rex(0, 0, 0, reg);
+	emit8(0x58 + (reg & 7));
+}
+
+/* jcc/jmp with a rel32 to fill in later, returns the rel32 */
+static uint8_t *jcc(int cc) {
+	emit8(0x0f);
+	emit8(0x80 | cc);
+	emit32(0);
+	return cp - 4;
+}
+
+static uint8_t *jmp(void) {
+	emit8(0xe9);
+	emit32(0);
+	return cp - 4;
+}
+
+static void set_rel(uint8_t *rel, const uint8_t *target) {
+	int32_t d = target - (rel + 4);
+	memcpy(rel, &d, 4);
+}
+
+static void jmp_to(const uint8_t *target) {
+	set_rel(jmp(), target);
+}
+
+static void call(void *fn) {
+	mov_imm64(RAX, (uintptr_t)fn);
+	rr(0, 0xff, 2, RAX);
+}
+
+/* Displacement of a variable from M */
+static int32_t disp(const void *p) {
+	intptr_t d = (const uint8_t *)p - (const uint8_t *)&M;
+	if (d != (int32_t)d) {
+		fprintf(stderr, "jit: globals too far apart\n");
+		exit(EXIT_FAILURE);
+	}
+	return d;
+}
+
+#define REG_DISP(x) (int32_t)(offsetof(struct machine, regs) + 4 * (x))
+#define PC_DISP (int32_t)offsetof(struct machine, pc)
+#define INSTRET_DISP (int32_t)offsetof(struct machine, instret)
+#define FREG_DISP(x) (int32_t)(offsetof(struct machine, fregs) + 4 * (x))
+
+/* Guest register access */
+
+static void load_guest(int host, int x) {
+	if (x == 0)
+		rr(0, 0x31, host, host); /* xor */
+	else if (host_of[x] >= 0)
+		rr(0, 0x89, host_of[x], host);
+	else
+		rm(0, 0x8b, host, RBX, -1, REG_DISP(x));
+}
+
+static void store_guest(int x, int host) {
+	if (x == 0)
+		return;
+	else if (host_of[x] >= 0)
+		rr(0, 0x89, host, host_of[x]);
+	else
+		rm(0, 0x89, host, RBX, -1, REG_DISP(x));
+}
+
+/* f registers always stay in M */
+static void load_freg(int host, int f) {
+	rm(0, 0x8b, host, RBX, -1, FREG_DISP(f));
+}
+
+static void store_freg(int f, int host) {
+	rm(0, 0x89, host, RBX, -1, FREG_DISP(f));
+}
+
+static bool caller_saved(int host) {
+	return host == RSI || host == RDI || (host >= R8 && host <= R11);
+}
+
+/* Around helper calls */
+static void spill(void) {
+	for (int i = 0; i < N_MAPPED; ++i) {
+		if (caller_saved(reg_map[i].host))
+			rm(0, 0x89, reg_map[i].host, RBX, -1, REG_DISP(reg_map[i].guest));
+	}
+}
+
+static void reload(void) {
+	for (int i = 0; i < N_MAPPED; ++i) {
+		if (caller_saved(reg_map[i].host))
+			rm(0, 0x8b, reg_map[i].host, RBX, -1, REG_DISP(reg_map[i].guest));
+	}
+}
+
+static void adjust_instret(int digit, uint32_t n) {
+	if (n)
+		rm(1, 0x81, digit, RBX, -1, INSTRET_DISP), emit32(n);
+}
+
+/* Leave the block for pc, through a stub emitted after the body */
+static void fixup(uint8_t *rel, uint32_t pc, bool link) {
+	struct fixup *f = &fixups[n_fixups++];
+	f->rel = rel;
+	f->pc = pc;
+	f->link = link;
+}
+
+/* Slow path helpers, called with M.instret exact. A device access may
+   have scheduled an earlier event, which ends the run at the next block
+   boundary. */
+
+static void sync_limit(void) {
+	if (limit > sched_next_event)
+		limit = sched_next_event;
+}
+
+static uint32_t load_lb(uint32_t addr, uint32_t old) {
+	uint8_t m;
+	if (mem_load_byte(addr, &m) < 0)
+		return old;
+	sync_limit();
+	return (int8_t)m;
+}
+
+static uint32_t load_lbu(uint32_t addr, uint32_t old) {
+	uint8_t m;
+	if (mem_load_byte(addr, &m) < 0)
+		return old;
+	sync_limit();
+	return m;
+}
+
+static uint32_t load_lh(uint32_t addr, uint32_t old) {
+	uint16_t m;
+	if (addr % 2 || mem_load_half(addr, &m) < 0)
+		return old;
+	sync_limit();
+	return (int16_t)m;
+}
+
+static uint32_t load_lhu(uint32_t addr, uint32_t old) {
+	uint16_t m;
+	if (addr % 2 || mem_load_half(addr, &m) < 0)
+		return old;
+	sync_limit();
+	return m;
+}
+
+static uint32_t load_lw(uint32_t addr, uint32_t old) {
+	uint32_t m;
+	if (addr % 4 || mem_load_word(addr, &m) < 0)
+		return old;
+	sync_limit();
+	return m;
+}
+
+/* RETURN VALUE: true if the store flushed the translations */
+static int store_sb(uint32_t addr, uint32_t value) {
+	flushed = false;
+	mem_store_byte(addr, value);
+	sync_limit();
+	return flushed;
+}
+
+static int store_sh(uint32_t addr, uint32_t value) {
+	flushed = false;
+	if (!(addr % 2))
+		mem_store_half(addr, value);
+	sync_limit();
+	return flushed;
+}
+
+static int store_sw(uint32_t addr, uint32_t value) {
+	flushed = false;
+	if (!(addr % 4))
+		mem_store_word(addr, value);
+	sync_limit();
+	return flushed;
+}
+
+/* The F instructions without code of their own below. op is the
+   instruction id with the rounding mode from bit 8, a is fs1, or rs1 for
+   the conversions from integers, b fs2 and c fs3. */
+static uint32_t fp_helper(uint32_t op, uint32_t a, uint32_t b, uint32_t c) {
+	uint32_t rm = op >> 8;
+	switch (op & 0xff) {
+	case I_FMADD_S:   return fpu_fma(a, b, c, rm);
+	case I_FMSUB_S:   return fpu_fma(a, b, c ^ FPU_SIGN, rm);
+	case I_FNMSUB_S:  return fpu_fma(a ^ FPU_SIGN, b, c, rm);
+	case I_FNMADD_S:  return fpu_fma(a ^ FPU_SIGN, b, c ^ FPU_SIGN, rm);
+	case I_FADD_S:    return fpu_add(a, b, rm);
+	case I_FSUB_S:    return fpu_sub(a, b, rm);
+	case I_FMUL_S:    return fpu_mul(a, b, rm);
+	case I_FDIV_S:    return fpu_div(a, b, rm);
+	case I_FSQRT_S:   return fpu_sqrt(a, rm);
+	case I_FMIN_S:    return fpu_min(a, b);
+	case I_FMAX_S:    return fpu_max(a, b);
+	case I_FCVT_S_W:  return fpu_cvt_s_w(a, rm);
+	case I_FCVT_S_WU: return fpu_cvt_s_wu(a, rm);
+	case I_FCVT_W_S:  return fpu_cvt_w_s(a, rm);
+	case I_FCVT_WU_S: return fpu_cvt_wu_s(a, rm);
+	case I_FEQ_S:     return fpu_eq(a, b);
+	case I_FLT_S:     return fpu_lt(a, b);
+	case I_FLE_S:     return fpu_le(a, b);
+	case I_FCLASS_S:  return fpu_class(a);
+	default:          return 0;
+	}
+}
+
+/* Code generation */
+
+/* rdx = &mem_page_table[eax >> MEM_PAGE_BITS] */
+static void page_entry(void) {
+	rr(0, 0x89, RAX, RDX);
+	rr(0, 0xc1, 5, RDX), emit8(MEM_PAGE_BITS); /* shr */
+	rr(1, 0xc1, 4, RDX), emit8(4); /* shl, sizeof(struct mem_page) */
+	rm(1, 0x03, RDX, RBX, -1, disp(&mem_page_table)); /* add */
+}
+
+/* fp: rd is an f register */
+static void gen_load(const struct insn *in, int size, unsigned movx,
+		void *helper, uint32_t back, bool fp) {
+	load_guest(RAX, in->rs1);
+	if (in->imm)
+		alu_imm(0, 0, RAX, in->imm);
+
+	page_entry();
+	rm(1, 0x8b, RCX, RDX, -1, offsetof(struct mem_page, load));
+	rr(1, 0x85, RCX, RCX);
+	uint8_t *slow1 = jcc(CC_E);
+	uint8_t *slow2 = NULL;
+	if (size > 1) {
+		emit8(0xa8), emit8(size - 1); /* test al */
+		slow2 = jcc(CC_NE);
+	}
+	rr(0, 0x89, RAX, RDX);
+	alu_imm(0, 4, RDX, MEM_PAGE_MASK);
+	rm(0, movx, RAX, RCX, RDX, 0);
+	uint8_t *done = jmp();
+
+	set_rel(slow1, cp);
+	if (slow2)
+		set_rel(slow2, cp);
+	if (fp)
+		load_freg(RCX, in->rd);
+	else
+		load_guest(RCX, in->rd);
+	spill();
+	adjust_instret(5, back);
+	rr(0, 0x89, RAX, RDI);
+	rr(0, 0x89, RCX, RSI);
+	call(helper);
+	adjust_instret(0, back);
+	reload();
+
+	set_rel(done, cp);
+	if (fp)
+		store_freg(in->rd, RAX);
+	else
+		store_guest(in->rd, RAX);
+}
+
+/* fp: rs2 is an f register */
+static void gen_store(const struct insn *in, int size, void *helper,
+		uint32_t back, uint32_t next_pc, bool fp) {
+	load_guest(RAX, in->rs1);
+	if (in->imm)
+		alu_imm(0, 0, RAX, in->imm);
+
+	page_entry();
+	rm(1, 0x8b, RDX, RDX, -1, offsetof(struct mem_page, store));
+	rr(1, 0x85, RDX, RDX);
+	uint8_t *slow1 = jcc(CC_E);
+	uint8_t *slow2 = NULL;
+	if (size > 1) {
+		emit8(0xa8), emit8(size - 1);
+		slow2 = jcc(CC_NE);
+	}
+	alu_imm(0, 4, RAX, MEM_PAGE_MASK);
+	if (fp)
+		load_freg(RCX, in->rs2);
+	else
+		load_guest(RCX, in->rs2);
+	if (size == 1) {
+		rm(0, 0x88, RCX, RDX, RAX, 0);
+	} else {
+		if (size == 2)
+			emit8(0x66);
+		rm(0, 0x89, RCX, RDX, RAX, 0);
+	}
+	uint8_t *done = jmp();
+
+	set_rel(slow1, cp);
+	if (slow2)
+		set_rel(slow2, cp);
+	if (fp)
+		load_freg(RCX, in->rs2);
+	else
+		load_guest(RCX, in->rs2);
+	spill();
+	adjust_instret(5, back);
+	rr(0, 0x89, RAX, RDI);
+	rr(0, 0x89, RCX, RSI);
+	call(helper);
+	reload();
+	rr(0, 0x85, RAX, RAX);
+	fixup(jcc(CC_NE), next_pc, false); /* M.instret is exact there */
+	adjust_instret(0, back);
+
+	set_rel(done, cp);
+}
+
+/* rd = rs1 op rs2, opc is the x86 "op r/m32, r32" opcode */
+static void gen_op(const struct insn *in, unsigned opc) {
+	load_guest(RAX, in->rs1);
+	load_guest(RCX, in->rs2);
+	rr(0, opc, RCX, RAX);
+	store_guest(in->rd, RAX);
+}
+
+static void gen_op_imm(const struct insn *in, int digit) {
+	load_guest(RAX, in->rs1);
+	alu_imm(0, digit, RAX, in->imm);
+	store_guest(in->rd, RAX);
+}
+
+static void gen_shift(const struct insn *in, int digit, bool imm) {
+	load_guest(RAX, in->rs1);
+	if (imm) {
+		rr(0, 0xc1, digit, RAX), emit8(in->imm);
+	} else {
+		load_guest(RCX, in->rs2);
+		rr(0, 0xd3, digit, RAX); /* by cl, masked to 5 bits like RV32 */
+	}
+	store_guest(in->rd, RAX);
+}
+
+/* RV32M. The high words come from a 64 bit product of the zero or sign
+   extended operands. Signed division is done in 64 bits too, where
+   INT32_MIN / -1 does not fault and gives what RV32 wants. Division by
+   zero skips the divide: the quotient is all ones, the remainder the
+   dividend, which is still in eax. */
+static void gen_mul(const struct insn *in, bool high, bool sign1, bool sign2) {
+	load_guest(RAX, in->rs1);
+	load_guest(RCX, in->rs2);
+	if (!high) {
+		rr(0, 0x0faf, RAX, RCX); /* imul eax, ecx */
+	} else {
+		if (sign1)
+			rr(1, 0x63, RAX, RAX); /* movsxd rax, eax */
+		if (sign2)
+			rr(1, 0x63, RCX, RCX);
+		rr(1, 0x0faf, RAX, RCX); /* imul rax, rcx */
+		rr(1, 0xc1, 5, RAX), emit8(32); /* shr rax, 32 */
+	}
+	store_guest(in->rd, RAX);
+}
+
+static void gen_div(const struct insn *in, bool sign, bool rem) {
+	load_guest(RAX, in->rs1);
+	load_guest(RCX, in->rs2);
+	rr(0, 0x85, RCX, RCX);
+	uint8_t *zero = jcc(CC_E);
+	if (sign) {
+		rr(1, 0x63, RAX, RAX);
+		rr(1, 0x63, RCX, RCX);
+		emit8(0x48), emit8(0x99); /* cqo */
+		rr(1, 0xf7, 7, RCX); /* idiv rcx */
+	} else {
+		rr(0, 0x31, RDX, RDX);
+		rr(0, 0xf7, 6, RCX); /* div ecx */
+	}
+	if (rem) {
+		rr(0, 0x89, RDX, RAX);
+		set_rel(zero, cp);
+	} else {
+		uint8_t *done = jmp();
+		set_rel(zero, cp);
+		mov_imm(RAX, UINT32_MAX);
+		set_rel(done, cp);
+	}
+	store_guest(in->rd, RAX);
+}
+
+static void gen_set(const struct insn *in, int cc, bool imm) {
+	load_guest(RAX, in->rs1);
+	if (imm) {
+		alu_imm(0, 7, RAX, in->imm);
+	} else {
+		load_guest(RCX, in->rs2);
+		rr(0, 0x39, RCX, RAX);
+	}
+	rr(0, 0x0f90 | cc, 0, RAX); /* setcc al */
+	rr(0, 0x0fb6, RAX, RAX); /* movzx eax, al */
+	store_guest(in->rd, RAX);
+}
+
+static void gen_branch(const struct insn *in, int cc, uint32_t pc,
+		uint32_t next) {
+	load_guest(RAX, in->rs1);
+	load_guest(RCX, in->rs2);
+	rr(0, 0x39, RCX, RAX);
+	fixup(jcc(cc), pc + in->imm, true);
+	fixup(jmp(), next, true);
+}
+
+/* RV32F. The host FPU has the guest's rounding mode and flags while
+   native code runs (see fpu.h), so the arithmetic with the dynamic
+   rounding mode is a single SSE instruction, with NaN results made
+   canonical after it. The rest calls fp_helper(). x_src: rs1 is an x
+   register, x_dst: so is rd. */
+static void gen_fp_call(const struct insn *in, bool x_src, bool x_dst) {
+	if (x_src)
+		load_guest(RAX, in->rs1);
+	spill();
+	if (x_src)
+		rr(0, 0x89, RAX, RSI);
+	else
+		load_freg(RSI, in->rs1);
+	load_freg(RDX, in->rs2);
+	load_freg(RCX, in->imm >> 3); /* rs3 of the fused ones, else f0 */
+	mov_imm(RDI, in->id | (in->imm & 0x7) << 8);
+	call(fp_helper);
+	reload();
+	if (x_dst)
+		store_guest(in->rd, RAX);
+	else
+		store_freg(in->rd, RAX);
+}
+
+/* fd = fs1 op fs2, opc is the scalar single SSE opcode: 0x58 addss,
+   0x5c subss, 0x59 mulss, 0x5e divss or 0x51 sqrtss (of fs1 alone) */
+static void gen_fp_sse(const struct insn *in, unsigned opc) {
+	if (in->imm != FPU_DYN) {
+		gen_fp_call(in, false, false);
+		return;
+	}
+	if (opc == 0x51) {
+		emit8(0xf3), rm(0, 0x0f51, 0, RBX, -1, FREG_DISP(in->rs1));
+	} else {
+		emit8(0xf3), rm(0, 0x0f10, 0, RBX, -1, FREG_DISP(in->rs1)); /* movss xmm0 */
+		emit8(0xf3), rm(0, 0x0f00 | opc, 0, RBX, -1, FREG_DISP(in->rs2));
+	}
+	emit8(0xf3), rm(0, 0x0f11, 0, RBX, -1, FREG_DISP(in->rd)); /* movss fd, xmm0 */
+	rr(0, 0x0f2e, 0, 0); /* ucomiss xmm0, xmm0: unordered if NaN */
+	uint8_t *number = jcc(CC_NP);
+	rm(0, 0xc7, 0, RBX, -1, FREG_DISP(in->rd)), emit32(FPU_CANONICAL_NAN);
+	set_rel(number, cp);
+}
+
+/* fd = rs1 converted, signed or unsigned */
+static void gen_fcvt_s_w(const struct insn *in, bool sign) {
+	if (in->imm != FPU_DYN) {
+		gen_fp_call(in, true, false);
+		return;
+	}
+	load_guest(RAX, in->rs1); /* zero extended to rax */
+	emit8(0xf3), rr(!sign, 0x0f2a, 0, RAX); /* cvtsi2ss xmm0, eax or rax */
+	emit8(0xf3), rm(0, 0x0f11, 0, RBX, -1, FREG_DISP(in->rd));
+}
+
+/* The sign of fs2, inverted for fsgnjn, xored into fs1 for fsgnjx */
+static void gen_fsgnj(const struct insn *in) {
+	load_freg(RAX, in->rs1);
+	load_freg(RCX, in->rs2);
+	if (in->id == I_FSGNJN_S)
+		rr(0, 0xf7, 2, RCX); /* not */
+	alu_imm(0, 4, RCX, FPU_SIGN);
+	if (in->id != I_FSGNJX_S)
+		alu_imm(0, 4, RAX, ~FPU_SIGN);
+	rr(0, in->id == I_FSGNJX_S ? 0x31 : 0x09, RCX, RAX);
+	store_freg(in->rd, RAX);
+}
+
+/* RETURN VALUE: true if in ends the block */
+static bool gen_insn(const struct insn *in, uint32_t pc, uint32_t back) {
+	bool alu = in->rd != 0; /* results written to x0 are dropped */
+	uint32_t next = pc + insn_len(in);
+
+	switch (in->id) {
+	case I_LB:  gen_load(in, 1, 0x0fbe, load_lb, back, false); break;
+	case I_LH:  gen_load(in, 2, 0x0fbf, load_lh, back, false); break;
+	case I_LW:  gen_load(in, 4, 0x8b, load_lw, back, false); break;
+	case I_LBU: gen_load(in, 1, 0x0fb6, load_lbu, back, false); break;
+	case I_LHU: gen_load(in, 2, 0x0fb7, load_lhu, back, false); break;
+
+	case I_ADDI:  if (alu) gen_op_imm(in, 0); break;
+	case I_XORI:  if (alu) gen_op_imm(in, 6); break;
+	case I_ORI:   if (alu) gen_op_imm(in, 1); break;
+	case I_ANDI:  if (alu) gen_op_imm(in, 4); break;
+	case I_SLTI:  if (alu) gen_set(in, CC_L, true); break;
+	case I_SLTIU: if (alu) gen_set(in, CC_B, true); break;
+	case I_SLLI:  if (alu) gen_shift(in, 4, true); break;
+	case I_SRLI:  if (alu) gen_shift(in, 5, true); break;
+	case I_SRAI:  if (alu) gen_shift(in, 7, true); break;
+
+	case I_LUI:
+		if (alu) {
+			mov_imm(RAX, in->imm);
+			store_guest(in->rd, RAX);
+		}
+		break;
+	case I_AUIPC:
+		if (alu) {
+			mov_imm(RAX, pc + in->imm);
+			store_guest(in->rd, RAX);
+		}
+		break;
+
+	case I_SB: gen_store(in, 1, store_sb, back, next, false); break;
+	case I_SH: gen_store(in, 2, store_sh, back, next, false); break;
+	case I_SW: gen_store(in, 4, store_sw, back, next, false); break;
+
+	case I_ADD:  if (alu) gen_op(in, 0x01); break;
+	case I_SUB:  if (alu) gen_op(in, 0x29); break;
+	case I_XOR:  if (alu) gen_op(in, 0x31); break;
+	case I_OR:   if (alu) gen_op(in, 0x09); break;
+	case I_AND:  if (alu) gen_op(in, 0x21); break;
+	case I_SLT:  if (alu) gen_set(in, CC_L, false); break;
+	case I_SLTU: if (alu) gen_set(in, CC_B, false); break;
+	case I_SLL:  if (alu) gen_shift(in, 4, false); break;
+	case I_SRL:  if (alu) gen_shift(in, 5, false); break;
+	case I_SRA:  if (alu) gen_shift(in, 7, false); break;
+
+	case I_MUL:    if (alu) gen_mul(in, false, false, false); break;
+	case I_MULH:   if (alu) gen_mul(in, true, true, true); break;
+	case I_MULHSU: if (alu) gen_mul(in, true, true, false); break;
+	case I_MULHU:  if (alu) gen_mul(in, true, false, false); break;
+	case I_DIV:    if (alu) gen_div(in, true, false); break;
+	case I_DIVU:   if (alu) gen_div(in, false, false); break;
+	case I_REM:    if (alu) gen_div(in, true, true); break;
+	case I_REMU:   if (alu) gen_div(in, false, true); break;
+
+	case I_FLW: gen_load(in, 4, 0x8b, load_lw, back, true); break;
+	case I_FSW: gen_store(in, 4, store_sw, back, next, true); break;
+
+	case I_FADD_S:  gen_fp_sse(in, 0x58); break;
+	case I_FSUB_S:  gen_fp_sse(in, 0x5c); break;
+	case I_FMUL_S:  gen_fp_sse(in, 0x59); break;
+	case I_FDIV_S:  gen_fp_sse(in, 0x5e); break;
+	case I_FSQRT_S: gen_fp_sse(in, 0x51); break;
+	case I_FSGNJ_S: case I_FSGNJN_S: case I_FSGNJX_S:
+		gen_fsgnj(in);
+		break;
+	case I_FCVT_S_W:  gen_fcvt_s_w(in, true); break;
+	case I_FCVT_S_WU: gen_fcvt_s_w(in, false); break;
+	case I_FMV_W_X:
+		load_guest(RAX, in->rs1);
+		store_freg(in->rd, RAX);
+		break;
+	case I_FMV_X_W:
+		if (alu) {
+			load_freg(RAX, in->rs1);
+			store_guest(in->rd, RAX);
+		}
+		break;
+	case I_FMADD_S: case I_FMSUB_S: case I_FNMSUB_S: case I_FNMADD_S:
+	case I_FMIN_S: case I_FMAX_S:
+		gen_fp_call(in, false, false);
+		break;
+	case I_FCVT_W_S: case I_FCVT_WU_S:
+	case I_FEQ_S: case I_FLT_S: case I_FLE_S: case I_FCLASS_S:
+		gen_fp_call(in, false, true); /* also with rd == 0, for the flags */
+		break;
+
+	case I_BEQ:  gen_branch(in, CC_E, pc, next); return true;
+	case I_BNE:  gen_branch(in, CC_NE, pc, next); return true;
+	case I_BLT:  gen_branch(in, CC_L, pc, next); return true;
+	case I_BGE:  gen_branch(in, CC_GE, pc, next); return true;
+	case I_BLTU: gen_branch(in, CC_B, pc, next); return true;
+	case I_BGEU: gen_branch(in, CC_AE, pc, next); return true;
+
+	case I_JAL:
+		if (alu) {
+			mov_imm(RCX, next);
+			store_guest(in->rd, RCX);
+		}
+		fixup(jmp(), pc + in->imm, true);
+		return true;
+	case I_JALR:
+		load_guest(RAX, in->rs1);
+		if (in->imm)
+			alu_imm(0, 0, RAX, in->imm);
+		alu_imm(0, 4, RAX, ~0x1);
+		if (alu) {
+			mov_imm(RCX, next);
+			store_guest(in->rd, RCX);
+		}
+		jmp_to(indirect);
+		return true;
+	}
+	return false;
+}
+
+void *jit_compile(uint32_t pc, uint32_t n_insns) {
+	if (cache + JIT_CACHE_SIZE - cp < JIT_BLOCK_MAX)
+		return NULL;
+
+	uint8_t *entry = cp;
+	n_fixups = 0;
+
+	rm(1, 0x8b, RAX, RBX, -1, INSTRET_DISP);
+	alu_imm(1, 0, RAX, n_insns);
+	rm(1, 0x3b, RAX, RBX, -1, disp(&limit));
+	fixup(jcc(CC_A), pc, false);
+	rm(1, 0x89, RAX, RBX, -1, INSTRET_DISP);
+
+	bool jump = false;
+	uint32_t ipc = pc;
+	for (uint32_t i = 0; i < n_insns && !jump; ++i) {
+		const struct insn *in = cpu_fetch(ipc);
+		if (in == NULL) {
+			cp = entry;
+			return NULL;
+		}
+		jump = gen_insn(in, ipc, n_insns - i - 1);
+		ipc += insn_len(in);
+	}
+	if (!jump)
+		fixup(jmp(), ipc, true);
+
+	for (int i = 0; i < n_fixups; ++i) {
+		struct fixup *f = &fixups[i];
+		set_rel(f->rel, cp);
+		mov_imm(RAX, f->pc);
+		if (f->link) {
+			/* lea rdx, [rip + rel] */
+			emit8(0x48), emit8(0x8d), emit8(0x15);
+			emit32(f->rel - (cp + 4));
+		} else {
+			rr(0, 0x31, RDX, RDX);
+		}
+		jmp_to(exit_common);
+	}
+
+	struct ind_entry *e = &ind_table[(pc >> 1) & (IND_SIZE - 1)];
+	e->pc = pc;
+	e->entry = entry;
+	return entry;
+}
+
+void *jit_exec(void *entry, uint64_t end) {
+	limit = end < sched_next_event ? end : sched_next_event;
+	exit_site = NULL;
+	enter(entry);
+	return exit_site;
+}
+
+void jit_link(void *site, void *entry) {
+	set_rel(site, entry);
+}
+
+void jit_flush(void) {
+	flushed = true;
+	cp = code_start;
+	for (int i = 0; i < IND_SIZE; ++i)
+		ind_table[i].pc = IND_NONE;
+}
+
+static const uint8_t saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+void jit_init(void) {
+	if (cache == NULL) {
+		cache = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (cache == MAP_FAILED) {
+			perror("jit: mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+	cp = cache;
+
+	for (int x = 0; x < 32; ++x)
+		host_of[x] = -1;
+	for (int i = 0; i < N_MAPPED; ++i)
+		host_of[reg_map[i].guest] = reg_map[i].host;
+
+	/* void enter(void *entry) */
+	enter = (void (*)(void *))cp;
+	for (int i = 0; i < sizeof saved; ++i)
+		push(saved[i]);
+	alu_imm(1, 5, RSP, 8); /* keep the stack 16 byte aligned for calls */
+	mov_imm64(RBX, (uintptr_t)&M);
+	rr(1, 0x89, RDI, RAX);
+	for (int i = 0; i < N_MAPPED; ++i)
+		rm(0, 0x8b, reg_map[i].host, RBX, -1, REG_DISP(reg_map[i].guest));
+	rr(0, 0xff, 4, RAX); /* jmp rax */
+
+	exit_common = cp;
+	rm(0, 0x89, RAX, RBX, -1, PC_DISP);
+	rm(1, 0x89, RDX, RBX, -1, disp(&exit_site));
+	for (int i = 0; i < N_MAPPED; ++i)
+		rm(0, 0x89, reg_map[i].host, RBX, -1, REG_DISP(reg_map[i].guest));
+	alu_imm(1, 0, RSP, 8);
+	for (int i = sizeof saved - 1; i >= 0; --i)
+		pop(saved[i]);
+	emit8(0xc3); /* ret */
+
+	/* jalr: try the target in the indirect jump table */
+	indirect = cp;
+	rr(0, 0x89, RAX, RDX);
+	rr(0, 0xc1, 5, RDX), emit8(1); /* shr edx, 1 */
+	alu_imm(0, 4, RDX, IND_SIZE - 1);
+	rr(1, 0xc1, 4, RDX), emit8(4); /* sizeof(struct ind_entry) */
+	rm(0, 0x3b, RAX, RBX, RDX, disp(ind_table));
+	uint8_t *miss = jcc(CC_NE);
+	rm(0, 0xff, 4, RBX, RDX, disp(ind_table) + offsetof(struct ind_entry, entry));
+	set_rel(miss, cp);
+	rr(0, 0x31, RDX, RDX);
+	jmp_to(exit_common);
+
+	code_start = cp;
+	jit_flush();
+}
+
+#else /* !__x86_64__ */
+
+void *jit_compile(uint32_t pc, uint32_t n_insns) {
+	return NULL;
+}
+
+void *jit_exec(void *entry, uint64_t end) {
+	return NULL;
+}
+
+void jit_link(void *site, void *entry) {
+}
+
+void jit_flush(void) {
+}
+
+void jit_init(void) {
+	fprintf(stderr, "jit: only x86-64 hosts are supported\n");
+	exit(EXIT_FAILURE);
+}
+
+#endif
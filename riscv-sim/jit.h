@@ -0,0 +1,32 @@
+#ifndef RVSIM_JIT_H
+#define RVSIM_JIT_H 1
+
+#include <stdint.h>
+
+/* x86-64 translator for hot blocks of the threaded engine. Native blocks
+   keep the most used guest registers in host registers, access directly
+   mapped memory inline and call back into mem_*() for everything else.
+   Stores to pages holding code always take the slow path, which
+   invalidates the translations through cpu_invalidate(). */
+
+/* Executions of a threaded block before it is translated */
+#define JIT_HOT 32
+
+extern void jit_init(void);
+
+/* Translate the n_insns instructions at pc.
+   RETURN VALUE: native entry point, NULL if the code cache is full */
+extern void *jit_compile(uint32_t pc, uint32_t n_insns);
+
+/* Run native code from entry until it reaches a block that is not
+   translated, an indirect jump misses, or the next block would pass end
+   or the next device event. M.pc and M.instret are exact on return.
+   RETURN VALUE: jump to patch with jit_link() once the block at M.pc is
+   translated, NULL if there is none */
+extern void *jit_exec(void *entry, uint64_t end);
+extern void jit_link(void *site, void *entry);
+
+/* Forget all native code */
+extern void jit_flush(void);
+
+#endif /* RVSIM_JIT_H */
@@ -1,5 +1,9 @@
+#define _GNU_SOURCE 1
+
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,41 +12,52 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "cpu.h"
+#include "irq.h"
 #include "mem.h"
 #include "uart.h"
 
 #define ROM_SIZE (1 << 16)
-#define RAM_SIZE (1 << 16)
 
 
 typedef int storefunc_t(uint32_t addr, uint8_t value);
 typedef int loadfunc_t(uint32_t addr, uint8_t *value);
 
+/* A region either has a backing store, which is mapped directly into
+   mem_page_table, or byte access callbacks. */
 struct mem_region {
 	char *name;
 	uint32_t s_addr;
 	uint32_t e_addr;
+	bool backed; /* store in backing[] at the region's index */
+	bool writable;
+	bool sparse; /* host memory only for the pages the guest writes */
 	storefunc_t *do_store;
 	loadfunc_t *do_load;
 };
 
-static uint8_t *internal_ram = NULL;
-static uint8_t *internal_rom = NULL;
+__thread struct mem_page *mem_page_table;
+__thread pthread_mutex_t *mem_device_lock;
+__thread uint32_t mem_read_effects;
 
-static int store_ram(uint32_t addr, uint8_t value) {
-	internal_ram[addr & 0xffff] = value;
-	return 0;
-}
+bool mem_huge_pages;
 
-static int load_ram(uint32_t addr, uint8_t *value) {
-	*value = internal_ram[addr & 0xffff];
-	return 0;
-}
+#define N_MEMREGIONS 5
 
-static int load_rom(uint32_t addr, uint8_t *value) {
-	*value = internal_rom[addr & 0xffff];
-	return 0;
-}
+static __thread uint8_t *backing[N_MEMREGIONS];
+static __thread bool owned[N_MEMREGIONS]; /* false if shared from an image */
+
+/* Pages of sparse regions that may be nonzero, one bit per page. Only
+   these are copied into images and checkpoints. A page is marked by its
+   first slow path store, which then maps it for direct stores. */
+static __thread uint8_t *present[N_MEMREGIONS];
+
+/* Backing stores of every memory backed region, see mem_image_save() */
+struct mem_image {
+	uint8_t *backing[N_MEMREGIONS];
+	uint8_t *present[N_MEMREGIONS];
+	bool share_writable; /* see mem_image_share() */
+};
 
 static int load_uart(uint32_t addr, uint8_t *value) {
 	if (addr & 0x1)
@@ -60,22 +75,38 @@ static int store_uart(uint32_t addr, uint8_t value) {
 	return 0;
 }
 
+static int load_clint(uint32_t addr, uint8_t *value) {
+	*value = irq_clint_load(addr - IRQ_CLINT_BASE);
+	return 0;
+}
+
+static int store_clint(uint32_t addr, uint8_t value) {
+	irq_clint_store(addr - IRQ_CLINT_BASE, value);
+	return 0;
+}
 
-#define N_MEMREGIONS 3
-static struct mem_region mem_space[N_MEMREGIONS] = {
+static const struct mem_region mem_space[N_MEMREGIONS] = {
 	{
 		.name = "Internal ROM",
 		.s_addr = 0x00000000,
 		.e_addr = 0x0000ffff,
-		.do_store = NULL,
-		.do_load = load_rom,
+		.backed = true,
+		.writable = false,
 	},
 	{
 		.name = "Internal RAM",
 		.s_addr = 0x00010000,
 		.e_addr = 0x0001ffff,
-		.do_store = store_ram,
-		.do_load = load_ram,
+		.backed = true,
+		.writable = true,
+	},
+	{
+		.name = "External SDRAM",
+		.s_addr = 0x10000000,
+		.e_addr = 0x4fffffff,
+		.backed = true,
+		.writable = true,
+		.sparse = true,
 	},
 	{
 		.name = "UART",
@@ -84,52 +115,316 @@ static struct mem_region mem_space[N_MEMREGIONS] = {
 		.do_store = store_uart,
 		.do_load = load_uart,
 	},
+	{
+		.name = "CLINT",
+		.s_addr = IRQ_CLINT_BASE,
+		.e_addr = IRQ_CLINT_BASE + IRQ_CLINT_SIZE - 1,
+		.do_store = store_clint,
+		.do_load = load_clint,
+	},
 
 };
 
+static const struct mem_region *find_region(uint32_t addr) {
+	for (int i = 0; i < N_MEMREGIONS; ++i) {
+		const struct mem_region *r = &mem_space[i];
+		if ((addr >= r->s_addr) && (addr <= r->e_addr))
+			return r;
+	}
+	return NULL;
+}
+
+static bool test_present(int i, uint32_t page) {
+	return __atomic_load_n(&present[i][page >> 3], __ATOMIC_RELAXED) &
+		(1 << (page & 7));
+}
+
+/* Atomic, as the harts of a machine share the bitmap */
+static void set_present(int i, uint32_t page) {
+	uint8_t bit = 1 << (page & 7);
+	if (!(__atomic_load_n(&present[i][page >> 3], __ATOMIC_RELAXED) & bit))
+		__atomic_fetch_or(&present[i][page >> 3], bit, __ATOMIC_RELAXED);
+}
+
+/* Mark the page of a sparse region written, and map it for direct stores
+   unless it holds code that cpu.c wants stores to it trapped for */
+static void touch_page(const struct mem_region *r, uint32_t addr) {
+	int i = r - mem_space;
+	set_present(i, (addr - r->s_addr) >> MEM_PAGE_BITS);
+	if (!(cpu_code_map[addr >> (CPU_CODE_PAGE_BITS + 3)] &
+			(1 << ((addr >> CPU_CODE_PAGE_BITS) & 7)))) {
+		struct mem_page *p = &mem_page_table[addr >> MEM_PAGE_BITS];
+		p->store = p->load;
+	}
+}
+
+static int store_byte(uint32_t addr, uint8_t value) {
+	const struct mem_region *r = find_region(addr);
+	if (r == NULL)
+		return -EINVAL;
+
+	if (r->backed && r->writable) {
+		if (r->sparse)
+			touch_page(r, addr);
+		backing[r - mem_space][addr - r->s_addr] = value;
+		cpu_invalidate(addr, 1);
+		return 0;
+	} else if (r->do_store) {
+		if (mem_device_lock)
+			pthread_mutex_lock(mem_device_lock);
+		int ret = r->do_store(addr, value);
+		if (mem_device_lock)
+			pthread_mutex_unlock(mem_device_lock);
+		return ret;
+	} else {
+		return -EACCES;
+	}
+}
+
+static int load_byte(uint32_t addr, uint8_t *value) {
+	const struct mem_region *r = find_region(addr);
+	if (r == NULL)
+		return -EINVAL;
+
+	if (r->backed) {
+		*value = backing[r - mem_space][addr - r->s_addr];
+		return 0;
+	} else if (r->do_load) {
+		if (mem_device_lock)
+			pthread_mutex_lock(mem_device_lock);
+		int ret = r->do_load(addr, value);
+		if (mem_device_lock)
+			pthread_mutex_unlock(mem_device_lock);
+		return ret;
+	} else {
+		return -EACCES;
+	}
+}
+
+int mem_store_slow(uint32_t addr, const void *value, int n_bytes) {
+	const uint8_t *bytes = value;
+	for (int i = 0; i < n_bytes; ++i) {
+		int r = store_byte(addr + i, bytes[i]);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+int mem_load_slow(uint32_t addr, void *result, int n_bytes) {
+	uint8_t *bytes = result;
+	for (int i = 0; i < n_bytes; ++i) {
+		int r = load_byte(addr + i, &bytes[i]);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+uint32_t *mem_atomic_slow(uint32_t addr) {
+	const struct mem_region *r = find_region(addr);
+	if (r == NULL || !r->backed || !r->writable)
+		return NULL;
+	if (r->sparse)
+		touch_page(r, addr);
+	return (uint32_t *)(backing[r - mem_space] + (addr - r->s_addr));
+}
 
-int mem_store_byte(uint32_t addr, uint8_t value) {
+/* Map every whole page of the memory backed regions. Nothing else in the
+   table is ever set, so a thread's table can be reused as it is. Stores
+   to sparse pages not yet written take the slow path once. */
+static void map_pages(void) {
 	for (int i = 0; i < N_MEMREGIONS; ++i) {
-		struct mem_region r = mem_space[i];
-		if ((addr >= r.s_addr) && (addr <= r.e_addr)) {
-			if (r.do_store) {
-				return r.do_store(addr, value);
-			} else {
-				return -EACCES;
-			}
+		const struct mem_region *r = &mem_space[i];
+		if (!r->backed)
+			continue;
+		if ((r->s_addr & MEM_PAGE_MASK) || ((r->e_addr + 1) & MEM_PAGE_MASK))
+			continue; /* partial pages use the slow path */
+
+		for (uint64_t a = r->s_addr; a <= r->e_addr; a += MEM_PAGE_SIZE) {
+			struct mem_page *p = &mem_page_table[a >> MEM_PAGE_BITS];
+			p->load = backing[i] + (a - r->s_addr);
+			p->store = r->writable ? p->load : NULL;
+			if (r->sparse && !test_present(i, (a - r->s_addr) >> MEM_PAGE_BITS))
+				p->store = NULL;
 		}
 	}
-	return -EINVAL;
 }
 
-int mem_load_byte(uint32_t addr, uint8_t *value) {
+void mem_write_protect(uint32_t addr) {
+	mem_page_table[addr >> MEM_PAGE_BITS].store = NULL;
+}
+
+uint8_t *mem_backing(uint32_t addr, uint32_t len) {
+	const struct mem_region *r = find_region(addr);
+	if (r == NULL || !r->backed || len == 0 || len - 1 > r->e_addr - addr)
+		return NULL;
+	mem_mark_present(addr, len);
+	return backing[r - mem_space] + (addr - r->s_addr);
+}
+
+void mem_mark_present(uint32_t addr, uint32_t len) {
+	const struct mem_region *r = find_region(addr);
+	if (r == NULL || !r->sparse || len == 0)
+		return;
+	uint32_t last = (uint32_t)(addr + len - 1);
+	if (last > r->e_addr)
+		last = r->e_addr;
+	for (uint32_t p = (addr - r->s_addr) >> MEM_PAGE_BITS;
+			p <= (last - r->s_addr) >> MEM_PAGE_BITS; ++p)
+		set_present(r - mem_space, p);
+}
+
+int mem_region_at(uint32_t addr) {
+	const struct mem_region *r = find_region(addr);
+	return r ? r - mem_space : -1;
+}
+
+const char *mem_region_info(int i, bool *backed) {
+	*backed = mem_space[i].backed;
+	return mem_space[i].name;
+}
+
+bool mem_page_present(uint32_t addr) {
+	const struct mem_region *r = find_region(addr);
+	if (r == NULL || !r->sparse)
+		return r != NULL && r->backed;
+	return test_present(r - mem_space, (addr - r->s_addr) >> MEM_PAGE_BITS);
+}
+
+uint8_t *mem_backed_region(int i, uint32_t *addr, uint32_t *size,
+		bool *sparse) {
+	for (int j = 0; j < N_MEMREGIONS; ++j) {
+		const struct mem_region *r = &mem_space[j];
+		if (!r->backed || i--)
+			continue;
+		*addr = r->s_addr;
+		*size = r->e_addr - r->s_addr + 1;
+		*sparse = r->sparse;
+		return backing[j];
+	}
+	return NULL;
+}
+
+static size_t region_size(const struct mem_region *r) {
+	return (size_t)r->e_addr - r->s_addr + 1;
+}
+
+static size_t bitmap_size(const struct mem_region *r) {
+	return (region_size(r) >> (MEM_PAGE_BITS + 3)) + 1;
+}
+
+/* Page aligned and zero filled, so that image pages can be mapped over it.
+   Sparse regions reserve no swap; the host commits their pages as the
+   guest writes them. */
+static uint8_t *alloc_backing(const struct mem_region *r) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (r->sparse)
+		flags |= MAP_NORESERVE;
+	void *p = mmap(NULL, region_size(r), PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+#ifdef MADV_HUGEPAGE
+	if (r->sparse && mem_huge_pages)
+		madvise(p, region_size(r), MADV_HUGEPAGE); /* only a hint */
+#endif
+	return p;
+}
+
+static uint8_t *alloc_bitmap(const struct mem_region *r) {
+	uint8_t *p = calloc(1, bitmap_size(r));
+	if (p == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* Copy a region of img, only the pages present for sparse ones */
+static void copy_region(int i, uint8_t *dst, uint8_t *dst_present,
+		uint8_t *const *src, uint8_t *const *src_present) {
+	const struct mem_region *r = &mem_space[i];
+	if (!r->sparse) {
+		memcpy(dst, src[i], region_size(r));
+		return;
+	}
+	memcpy(dst_present, src_present[i], bitmap_size(r));
+	for (size_t p = 0; p < region_size(r) >> MEM_PAGE_BITS; ++p) {
+		if (src_present[i][p >> 3] & (1 << (p & 7)))
+			memcpy(dst + (p << MEM_PAGE_BITS), src[i] + (p << MEM_PAGE_BITS),
+					MEM_PAGE_SIZE);
+	}
+}
+
+void mem_init(const struct mem_image *img) {
+	if (mem_page_table == NULL) {
+		mem_page_table = mmap(NULL, MEM_N_PAGES * sizeof(struct mem_page),
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem_page_table == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	for (int i = 0; i < N_MEMREGIONS; ++i) {
-		struct mem_region r = mem_space[i];
-		if ((addr >= r.s_addr) && (addr <= r.e_addr)) {
-			if (r.do_load)
-				return r.do_load(addr, value);
-			else
-				return -EACCES;
+		const struct mem_region *r = &mem_space[i];
+		if (owned[i]) {
+			munmap(backing[i], region_size(r));
+			free(present[i]);
+		}
+		backing[i] = NULL;
+		present[i] = NULL;
+		owned[i] = false;
+		if (!r->backed)
+			continue;
+
+		if (img && (!r->writable || img->share_writable)) {
+			backing[i] = img->backing[i];
+			present[i] = img->present[i];
+		} else {
+			backing[i] = alloc_backing(r);
+			if (r->sparse)
+				present[i] = alloc_bitmap(r);
+			owned[i] = true;
+			if (img)
+				copy_region(i, backing[i], present[i], img->backing,
+						img->present);
 		}
 	}
-	return -EINVAL;
+	map_pages();
 }
 
-void mem_init(void) {
-	internal_rom = malloc(ROM_SIZE);
-	if (internal_rom == NULL)
-		goto fail;
-	internal_ram = malloc(RAM_SIZE);
-	if (internal_ram == NULL)
-		goto fail;
-
-	memset(internal_rom, 0, ROM_SIZE);
-	memset(internal_ram, 0, RAM_SIZE);
-	return;
+struct mem_image *mem_image_share(void) {
+	struct mem_image *img = calloc(1, sizeof *img);
+	if (img == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(img->backing, backing, sizeof img->backing);
+	memcpy(img->present, present, sizeof img->present);
+	img->share_writable = true;
+	return img;
+}
 
-fail:
-	perror("malloc");
-	exit(EXIT_FAILURE);
+struct mem_image *mem_image_save(void) {
+	struct mem_image *img = calloc(1, sizeof *img);
+	if (img == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < N_MEMREGIONS; ++i) {
+		const struct mem_region *r = &mem_space[i];
+		if (!r->backed)
+			continue;
+		img->backing[i] = alloc_backing(r);
+		if (r->sparse)
+			img->present[i] = alloc_bitmap(r);
+		copy_region(i, img->backing[i], img->present[i], backing, present);
+	}
+	return img;
 }
 
 void mem_rom_load_flatbin(uint32_t offset, char *filepath) {
@@ -156,7 +451,7 @@ void mem_rom_load_flatbin(uint32_t offset, char *filepath) {
 		exit(EXIT_FAILURE);
 	}
 
-	for (int i = 0; i < programSize; ++i) {
-		internal_rom[offset + i] = program[i];
-	}
+	memcpy(mem_backing(0, ROM_SIZE) + offset, program, programSize);
+	munmap(program, programSize);
+	close(fd);
 }
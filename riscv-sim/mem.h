@@ -1,14 +1,161 @@
 #ifndef RVSIM_MEM_H
 #define RVSIM_MEM_H 1
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
-extern void mem_init(void);
+#include "cpu.h"
+
+#define MEM_PAGE_BITS 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_BITS)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_N_PAGES (1 << (32 - MEM_PAGE_BITS))
+
+/* Guest page to host memory translation. Pages of ROM/RAM/SDRAM regions
+   point straight at their backing store; load/store is NULL for pages that
+   must go through the slow path (MMIO, unmapped, read-only, holding code
+   or not yet written sparse pages). */
+struct mem_page {
+	uint8_t *load;
+	uint8_t *store;
+};
+
+/* MEM_N_PAGES entries, one table per thread */
+extern __thread struct mem_page *mem_page_table;
+
+/* Taken around every device access when several harts share the devices */
+extern __thread pthread_mutex_t *mem_device_lock;
+
+/* Bumped by device reads that change the device's state, like popping a
+   FIFO, or whose value changes by itself, like mtime. Polling loops are
+   only idle if none of their reads does. */
+extern __thread uint32_t mem_read_effects;
+
+/* Advise the host to back sparse regions (SDRAM) with transparent huge
+   pages. Fewer TLB misses, but each touched 2M chunk is committed. */
+extern bool mem_huge_pages;
+
+struct mem_image;
+
+/* Give this thread's machine fresh memory, releasing what it had. With
+   img NULL all of it is zero filled; otherwise writable regions start as
+   copies of img (or share it, see mem_image_share()) and read-only ones
+   share img's pages. */
+extern void mem_init(const struct mem_image *img);
+
+/* Snapshot the current contents of the memory backed regions, typically
+   right after loading an image, to start any number of machines from */
+extern struct mem_image *mem_image_save(void);
+
+/* All of the current memory, writable regions included, for the other
+   harts of the same machine */
+extern struct mem_image *mem_image_share(void);
 extern void mem_rom_load_flatbin(uint32_t offset, char *filepath);
 
+/* Host address of [addr, addr + len) if it lies within one memory backed
+   region (writable or not), NULL otherwise. For loaders. */
+extern uint8_t *mem_backing(uint32_t addr, uint32_t len);
+
+/* Memory backed region number i, for checkpoints. *sparse is set if the
+   host commits its pages only as they are written.
+   RETURN VALUE: its backing store, NULL once i is past the last one */
+extern uint8_t *mem_backed_region(int i, uint32_t *addr, uint32_t *size,
+		bool *sparse);
+
+/* Index of the region containing addr, -1 if it is unmapped, and the
+   name of region i, with *backed set if it is memory rather than a
+   device. For statistics. */
+extern int mem_region_at(uint32_t addr);
+extern const char *mem_region_info(int i, bool *backed);
+
+/* False for pages of sparse regions that were never written, which
+   therefore read as zero. True for every page of other backed regions. */
+extern bool mem_page_present(uint32_t addr);
+
+/* Record that [addr, addr + len) was written behind the guest's back, as
+   mem_backing() does for its callers */
+extern void mem_mark_present(uint32_t addr, uint32_t len);
+
+/* Send stores to the page containing addr through the slow path, which
+   always calls cpu_invalidate() */
+extern void mem_write_protect(uint32_t addr);
+
+extern uint32_t *mem_atomic_slow(uint32_t addr);
+
+/* Host address of the aligned word at addr for host atomics, NULL if it
+   is not in writable memory. Callers must call cpu_invalidate(). */
+static inline uint32_t *mem_atomic_word(uint32_t addr) {
+	uint8_t *p = mem_page_table[addr >> MEM_PAGE_BITS].store;
+	if (p)
+		return (uint32_t *)(p + (addr & MEM_PAGE_MASK));
+	return mem_atomic_slow(addr);
+}
+
+/* Slow path used when a page is not directly mapped */
+extern int mem_load_slow(uint32_t addr, void *result, int n_bytes);
+extern int mem_store_slow(uint32_t addr, const void *value, int n_bytes);
+
 /* Memory access functions
+   Half word and word accesses must be naturally aligned to take the fast
+   path. Host is assumed to be little endian like the guest.
    RETURN VALUE: 0 on success, negative value on error */
-extern int mem_store_byte(uint32_t addr, uint8_t value);
-extern int mem_load_byte(uint32_t addr, uint8_t *result);
+static inline int mem_load_byte(uint32_t addr, uint8_t *result) {
+	const uint8_t *p = mem_page_table[addr >> MEM_PAGE_BITS].load;
+	if (p) {
+		*result = p[addr & MEM_PAGE_MASK];
+		return 0;
+	}
+	return mem_load_slow(addr, result, 1);
+}
+
+static inline int mem_load_half(uint32_t addr, uint16_t *result) {
+	const uint8_t *p = mem_page_table[addr >> MEM_PAGE_BITS].load;
+	if (p && !(addr & 0x1)) {
+		memcpy(result, p + (addr & MEM_PAGE_MASK), 2);
+		return 0;
+	}
+	return mem_load_slow(addr, result, 2);
+}
+
+static inline int mem_load_word(uint32_t addr, uint32_t *result) {
+	const uint8_t *p = mem_page_table[addr >> MEM_PAGE_BITS].load;
+	if (p && !(addr & 0x3)) {
+		memcpy(result, p + (addr & MEM_PAGE_MASK), 4);
+		return 0;
+	}
+	return mem_load_slow(addr, result, 4);
+}
+
+static inline int mem_store_byte(uint32_t addr, uint8_t value) {
+	uint8_t *p = mem_page_table[addr >> MEM_PAGE_BITS].store;
+	if (p) {
+		p[addr & MEM_PAGE_MASK] = value;
+		cpu_invalidate(addr, 1);
+		return 0;
+	}
+	return mem_store_slow(addr, &value, 1);
+}
+
+static inline int mem_store_half(uint32_t addr, uint16_t value) {
+	uint8_t *p = mem_page_table[addr >> MEM_PAGE_BITS].store;
+	if (p && !(addr & 0x1)) {
+		memcpy(p + (addr & MEM_PAGE_MASK), &value, 2);
+		cpu_invalidate(addr, 2);
+		return 0;
+	}
+	return mem_store_slow(addr, &value, 2);
+}
+
+static inline int mem_store_word(uint32_t addr, uint32_t value) {
+	uint8_t *p = mem_page_table[addr >> MEM_PAGE_BITS].store;
+	if (p && !(addr & 0x3)) {
+		memcpy(p + (addr & MEM_PAGE_MASK), &value, 4);
+		cpu_invalidate(addr, 4);
+		return 0;
+	}
+	return mem_store_slow(addr, &value, 4);
+}
 
 #endif /* RVSIM_MEM_H */
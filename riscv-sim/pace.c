@@ -0,0 +1,94 @@
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pace.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Real-time mode sleeps once per quantum of guest time. The core is
+   assumed to retire one instruction per clock cycle. */
+#define PACE_QUANTUM_NS  1000000ULL   /* 1 ms */
+#define PACE_MAX_LAG_NS  100000000ULL /* resync if 100 ms behind */
+#define PACE_FREE_BATCH  (1 << 16)
+
+static enum pace_mode mode = PACE_FREE;
+static uint64_t batch = PACE_FREE_BATCH;
+static double ns_per_instr;
+static double deadline_frac; /* sub-nanosecond remainder */
+static uint64_t deadline; /* monotonic, in ns */
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void pace_init(enum pace_mode m, double clock_mhz) {
+	mode = m;
+
+	switch (mode) {
+	case PACE_FREE:
+		batch = PACE_FREE_BATCH;
+		break;
+	case PACE_REALTIME:
+		if (clock_mhz <= 0) {
+			fprintf(stderr, "pace_init: invalid clock frequency\n");
+			exit(EXIT_FAILURE);
+		}
+		ns_per_instr = 1000.0 / clock_mhz;
+		batch = PACE_QUANTUM_NS / ns_per_instr;
+		if (batch == 0)
+			batch = 1;
+		deadline = now_ns();
+		deadline_frac = 0;
+		break;
+	case PACE_STEP:
+		batch = 1;
+		break;
+	}
+}
+
+uint64_t pace_batch(void) {
+	return batch;
+}
+
+static void sleep_until(uint64_t t) {
+	struct timespec ts = {
+		.tv_sec = t / NSEC_PER_SEC,
+		.tv_nsec = t % NSEC_PER_SEC,
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+void pace_wait(uint64_t n_retired) {
+	switch (mode) {
+	case PACE_FREE:
+		break;
+	case PACE_REALTIME: {
+		deadline_frac += n_retired * ns_per_instr;
+		uint64_t whole = (uint64_t)deadline_frac;
+		deadline += whole;
+		deadline_frac -= whole;
+
+		uint64_t now = now_ns();
+		if (now > deadline + PACE_MAX_LAG_NS) {
+			/* host cannot keep up (or we were stopped), don't try to
+			   catch up in a burst */
+			deadline = now;
+			deadline_frac = 0;
+		} else if (deadline > now) {
+			sleep_until(deadline);
+		}
+		break;
+	}
+	case PACE_STEP:
+		getchar();
+		break;
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef RVSIM_PACE_H
+#define RVSIM_PACE_H 1
+
+#include <stdint.h>
+
+enum pace_mode {
+	PACE_FREE,     /* run as fast as the host allows */
+	PACE_REALTIME, /* match a target core clock */
+	PACE_STEP,     /* wait for a key press after every instruction */
+};
+
+/* clock_mhz is only used in PACE_REALTIME mode */
+extern void pace_init(enum pace_mode mode, double clock_mhz);
+
+/* Number of instructions to run before the next call to pace_wait() */
+extern uint64_t pace_batch(void);
+
+/* Throttle after n_retired instructions have been executed */
+extern void pace_wait(uint64_t n_retired);
+
+#endif /* RVSIM_PACE_H */
@@ -0,0 +1,200 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "disasm.h"
+#include "elfload.h"
+#include "insn.h"
+#include "mem.h"
+#include "prof.h"
+
+#define PROF_N_HOT 20 /* hottest instructions listed */
+
+uint64_t *prof_pc_count;
+uint64_t prof_outside;
+uint64_t prof_insn_count[N_INSN_IDS];
+
+#define INSN_NAME(id, name) [I_##id] = #name,
+static const char *const insn_names[N_INSN_IDS] = {
+	INSN_LIST(INSN_NAME)
+};
+#undef INSN_NAME
+
+enum insn_class {
+	C_LOAD, C_STORE, C_ALU, C_MULDIV, C_FP, C_BRANCH, C_JUMP, C_FENCE,
+	C_ATOMIC, C_SYSTEM, C_INVALID,
+	N_CLASSES
+};
+
+static const char *const class_names[N_CLASSES] = {
+	[C_LOAD] = "load",
+	[C_STORE] = "store",
+	[C_ALU] = "alu",
+	[C_MULDIV] = "muldiv",
+	[C_FP] = "fp",
+	[C_BRANCH] = "branch",
+	[C_JUMP] = "jump",
+	[C_FENCE] = "fence",
+	[C_ATOMIC] = "atomic",
+	[C_SYSTEM] = "system",
+	[C_INVALID] = "invalid",
+};
+
+static enum insn_class class_of(int id) {
+	switch (id) {
+	case I_LB ... I_LHU:         return C_LOAD;
+	case I_SB ... I_SW:          return C_STORE;
+	case I_MUL ... I_REMU:       return C_MULDIV;
+	case I_BEQ ... I_BGEU:       return C_BRANCH;
+	case I_JALR ... I_JAL:       return C_JUMP;
+	case I_FENCE ... I_FENCE_I:  return C_FENCE;
+	case I_LR_W ... I_AMOMAXU_W: return C_ATOMIC;
+	case I_SYSTEM ... I_CSRRCI:  return C_SYSTEM;
+	case I_FLW:                  return C_LOAD;
+	case I_FSW:                  return C_STORE;
+	case I_FMADD_S ... I_FCLASS_S: return C_FP;
+	case I_INVALID:              return C_INVALID;
+	default:                     return C_ALU;
+	}
+}
+
+struct entry {
+	uint64_t n;
+	uint32_t key; /* symbol index, pc or instruction id */
+};
+
+static int cmp_entry(const void *a, const void *b) {
+	const struct entry *x = a, *y = b;
+	if (x->n != y->n)
+		return (x->n < y->n) - (x->n > y->n);
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static double percent(uint64_t n, uint64_t total) {
+	return total ? 100.0 * n / total : 0;
+}
+
+/* Executions per function, keyed by symbol index. Code before the first
+   symbol (or without any symbols) is counted under elf_n_symbols. */
+static void report_functions(FILE *f, uint64_t total) {
+	struct entry *funcs = calloc(elf_n_symbols + 1, sizeof *funcs);
+	if (funcs == NULL) {
+		perror("calloc");
+		return;
+	}
+	for (size_t i = 0; i <= elf_n_symbols; ++i)
+		funcs[i].key = i;
+
+	for (uint32_t i = 0; i < PROF_SPAN / 2; ++i) {
+		if (prof_pc_count[i] == 0)
+			continue;
+		const struct elf_symbol *s = elf_symbol_at(2 * i);
+		funcs[s ? s - elf_symbols : elf_n_symbols].n += prof_pc_count[i];
+	}
+	qsort(funcs, elf_n_symbols + 1, sizeof *funcs, cmp_entry);
+
+	fprintf(f, "%8s %8s %14s  %s\n", "%", "cumul%", "instructions",
+			"function");
+	uint64_t cumul = 0;
+	for (size_t i = 0; i <= elf_n_symbols && funcs[i].n; ++i) {
+		cumul += funcs[i].n;
+		const char *name = funcs[i].key < elf_n_symbols ?
+			elf_symbols[funcs[i].key].name : "(no symbol)";
+		fprintf(f, "%8.2f %8.2f %14llu  %s\n", percent(funcs[i].n, total),
+				percent(cumul, total), (unsigned long long)funcs[i].n, name);
+	}
+	if (prof_outside)
+		fprintf(f, "%8.2f %8s %14llu  (outside ROM/RAM)\n",
+				percent(prof_outside, total), "",
+				(unsigned long long)prof_outside);
+	free(funcs);
+}
+
+/* Keep the PROF_N_HOT most executed pcs, by insertion */
+static void report_hot(FILE *f, uint64_t total) {
+	struct entry hot[PROF_N_HOT];
+	int n_hot = 0;
+	for (uint32_t i = 0; i < PROF_SPAN / 2; ++i) {
+		uint64_t n = prof_pc_count[i];
+		if (n == 0 || (n_hot == PROF_N_HOT && n <= hot[n_hot - 1].n))
+			continue;
+		int j = n_hot < PROF_N_HOT ? n_hot++ : n_hot - 1;
+		for (; j > 0 && hot[j - 1].n < n; --j)
+			hot[j] = hot[j - 1];
+		hot[j] = (struct entry){ n, 2 * i };
+	}
+
+	fprintf(f, "%8s %14s  %-8s  %-28s  %s\n", "%", "executions", "pc",
+			"instruction", "function");
+	for (int i = 0; i < n_hot; ++i) {
+		uint32_t pc = hot[i].key, instr = 0;
+		char text[64] = "?";
+		if (mem_load_word(pc, &instr) == 0)
+			disasm(pc, instr, text, sizeof text);
+		const struct elf_symbol *s = elf_symbol_at(pc);
+		fprintf(f, "%8.2f %14llu  %.8x  %-28s  %s+0x%x\n",
+				percent(hot[i].n, total), (unsigned long long)hot[i].n,
+				pc, text, s ? s->name : "", s ? pc - s->addr : pc);
+	}
+}
+
+static void report_mix(FILE *f, uint64_t total) {
+	uint64_t classes[N_CLASSES] = { 0 };
+	struct entry insns[N_INSN_IDS];
+	for (int i = 0; i < N_INSN_IDS; ++i) {
+		insns[i] = (struct entry){ prof_insn_count[i], i };
+		classes[class_of(i)] += prof_insn_count[i];
+	}
+	qsort(insns, N_INSN_IDS, sizeof *insns, cmp_entry);
+
+	for (int i = 0; i < N_CLASSES; ++i) {
+		if (classes[i])
+			fprintf(f, "%-10s %14llu %8.2f%%\n", class_names[i],
+					(unsigned long long)classes[i], percent(classes[i], total));
+	}
+	fprintf(f, "\n");
+	for (int i = 0; i < N_INSN_IDS && insns[i].n; ++i) {
+		char name[16];
+		snprintf(name, sizeof name, "%s", insn_names[insns[i].key]);
+		for (char *c = name; *c; ++c) {
+			if (*c == '_')
+				*c = '.'; /* lr_w is lr.w */
+		}
+		fprintf(f, "%-10s %14llu %8.2f%%\n", name,
+				(unsigned long long)insns[i].n, percent(insns[i].n, total));
+	}
+}
+
+void prof_report(const char *path) {
+	if (prof_pc_count == NULL)
+		return;
+
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return;
+	}
+
+	uint64_t total = 0;
+	for (int i = 0; i < N_INSN_IDS; ++i)
+		total += prof_insn_count[i];
+
+	fprintf(f, "Profile of %llu instructions\n\n", (unsigned long long)total);
+	report_functions(f, total);
+	fprintf(f, "\nHottest instructions:\n");
+	report_hot(f, total);
+	fprintf(f, "\nInstruction mix:\n");
+	report_mix(f, total);
+	fclose(f);
+}
+
+void prof_init(void) {
+	if (prof_pc_count == NULL) {
+		prof_pc_count = calloc(PROF_SPAN / 2, sizeof *prof_pc_count);
+		if (prof_pc_count == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
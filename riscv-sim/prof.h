@@ -0,0 +1,34 @@
+#ifndef RVSIM_PROF_H
+#define RVSIM_PROF_H 1
+
+#include <stdint.h>
+
+#include "insn.h"
+
+/* Flat execution profile, gathered by the profile variant of the
+   interpreter: one counter per halfword of internal ROM and RAM, where
+   the firmware runs, directly indexed by pc (compressed instructions may
+   start at any halfword), and one per decoded instruction. Code anywhere else only adds to prof_outside. */
+
+#define PROF_SPAN 0x20000 /* ROM and RAM */
+
+extern uint64_t *prof_pc_count; /* PROF_SPAN / 2 entries */
+extern uint64_t prof_outside;
+extern uint64_t prof_insn_count[N_INSN_IDS];
+
+extern void prof_init(void);
+
+/* Write the profile to path: instructions executed per function, using
+   the symbols of the ELF file loaded last, the hottest instructions and
+   the instruction mix. Does nothing unless prof_init() was called. */
+extern void prof_report(const char *path);
+
+static inline void prof_count(uint32_t pc, int id) {
+	if (pc < PROF_SPAN)
+		prof_pc_count[pc >> 1]++;
+	else
+		prof_outside++;
+	prof_insn_count[id]++;
+}
+
+#endif /* RVSIM_PROF_H */
@@ -0,0 +1,63 @@
+#ifndef RVSIM_RING_H
+#define RVSIM_RING_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Lock-free single-producer/single-consumer byte FIFO. head is only
+   written by the producer and tail only by the consumer; each side reads
+   the other's index with acquire semantics. size must be a power of two. */
+
+#define RING_CACHELINE 64
+
+struct ring {
+	uint8_t *buf;
+	uint32_t mask;
+	uint32_t head __attribute__((aligned(RING_CACHELINE)));
+	uint32_t tail __attribute__((aligned(RING_CACHELINE)));
+};
+
+static inline bool ring_init(struct ring *r, uint32_t size) {
+	r->buf = malloc(size);
+	r->mask = size - 1;
+	r->head = 0;
+	r->tail = 0;
+	return r->buf != NULL;
+}
+
+static inline uint32_t ring_count(const struct ring *r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t ring_space(const struct ring *r) {
+	return r->mask + 1 - ring_count(r);
+}
+
+/* Producer side */
+static inline uint32_t ring_push(struct ring *r, const uint8_t *data, uint32_t n) {
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	uint32_t space = r->mask + 1 - (head - tail);
+	if (n > space)
+		n = space;
+	for (uint32_t i = 0; i < n; ++i)
+		r->buf[(head + i) & r->mask] = data[i];
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Consumer side */
+static inline uint32_t ring_pop(struct ring *r, uint8_t *data, uint32_t n) {
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (n > head - tail)
+		n = head - tail;
+	for (uint32_t i = 0; i < n; ++i)
+		data[i] = r->buf[(tail + i) & r->mask];
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+#endif /* RVSIM_RING_H */
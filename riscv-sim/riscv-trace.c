@@ -0,0 +1,224 @@
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disasm.h"
+#include "rvc.h"
+#include "trace.h"
+
+/* Offline decoder for traces written by riscv-sim -t */
+
+static struct arguments {
+	uint32_t pc_start;
+	uint32_t pc_end;   /* exclusive, 0 = no limit */
+	const char *mnemonic;
+	int reg;           /* -1 = any, f registers from 32 */
+	uint64_t max_recs; /* 0 = no limit */
+	bool summary;
+	char *trace_file;
+} args = {
+	.reg = -1,
+};
+
+static int parse_reg(const char *s) {
+	for (int i = 0; i < 32; ++i) {
+		if (strcmp(s, regname[i]) == 0)
+			return i;
+		if (strcmp(s, fregname[i]) == 0)
+			return 32 + i;
+	}
+	if (s[0] == 'x')
+		s++;
+	char *end;
+	long r = strtol(s, &end, 10);
+	if (*s == '\0' || *end != '\0' || r < 0 || r > 31)
+		return -1;
+	return r;
+}
+
+static void parse_args(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:e:o:r:n:c")) != -1) {
+		switch(opt) {
+		case 's':
+			args.pc_start = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			args.pc_end = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			args.mnemonic = optarg;
+			break;
+		case 'r':
+			args.reg = parse_reg(optarg);
+			if (args.reg < 0)
+				goto fail;
+			break;
+		case 'n':
+			args.max_recs = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			args.summary = true;
+			break;
+		default: /* '?' */
+			goto fail;
+		}
+	}
+
+	if (optind >= argc)
+		goto fail;
+	else
+		args.trace_file = argv[optind];
+
+	return;
+
+fail:
+	fprintf(stderr, "Usage: %s [-s startPC] [-e endPC] [-o mnemonic] [-r reg] [-n count] [-c] traceFile\n", argv[0]);
+	fprintf(stderr, "  -s/-e  only records with startPC <= pc < endPC\n");
+	fprintf(stderr, "  -o     only instructions with this mnemonic\n");
+	fprintf(stderr, "  -r     only instructions that read or write reg, x or f\n");
+	fprintf(stderr, "  -n     stop after printing count records\n");
+	fprintf(stderr, "  -c     print instruction counts instead of records\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Register field r, DIS_F_* field, as numbered by parse_reg() */
+static int reg_of(const struct dis_insn *d, int field, int r) {
+	if (r < 0)
+		return -1;
+	return (d->fregs & field) ? 32 + r : r;
+}
+
+static bool match(const struct trace_rec *r, const struct dis_insn *d) {
+	if (r->pc < args.pc_start)
+		return false;
+	if (args.pc_end && r->pc >= args.pc_end)
+		return false;
+	if (args.mnemonic && strcmp(d->name, args.mnemonic) != 0)
+		return false;
+	if (args.reg >= 0 && reg_of(d, DIS_F_RD, d->rd) != args.reg &&
+			reg_of(d, DIS_F_RS1, d->rs1) != args.reg &&
+			reg_of(d, DIS_F_RS2, d->rs2) != args.reg &&
+			reg_of(d, DIS_F_RS3, d->rs3) != args.reg)
+		return false;
+	return true;
+}
+
+static void print_rec(const struct trace_rec *r, const struct dis_insn *d) {
+	char text[64];
+	disasm(r->pc, r->instr, text, sizeof text);
+	/* compressed instructions as 4 digits, aligned with the others */
+	printf("%.8x: %8.*x  %-28s", r->pc, RVC_COMPRESSED(r->instr) ? 4 : 8,
+			r->instr, text);
+
+	if (d->fregs & DIS_F_RD)
+		printf(" %s=%.8x", fregname[d->rd], r->rd_value);
+	else if (d->rd > 0)
+		printf(" %s=%.8x", regname[d->rd], r->rd_value);
+
+	if (r->flags & (TRACE_F_LOAD | TRACE_F_STORE)) {
+		uint32_t data = r->mem_data;
+		if (d->size < 4)
+			data &= (1u << (8 * d->size)) - 1;
+		printf(" mem[%.8x]%s%.*x", r->mem_addr,
+				(r->flags & TRACE_F_STORE) ? "<-" : "->",
+				2 * d->size, data);
+	}
+	printf("\n");
+}
+
+struct count {
+	const char *name;
+	uint64_t n;
+};
+
+static int cmp_count(const void *a, const void *b) {
+	const struct count *x = a, *y = b;
+	return (x->n < y->n) - (x->n > y->n);
+}
+
+int main(int argc, char *argv[]) {
+	parse_args(argc, argv);
+
+	int fd = open(args.trace_file, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+	if ((size_t)st.st_size < sizeof(struct trace_header)) {
+		fprintf(stderr, "%s: not a trace file\n", args.trace_file);
+		exit(EXIT_FAILURE);
+	}
+
+	const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+	const struct trace_header *h = (const void *)data;
+	if (memcmp(h->magic, TRACE_MAGIC, sizeof TRACE_MAGIC) != 0 ||
+			h->version != TRACE_VERSION ||
+			h->rec_size != sizeof(struct trace_rec)) {
+		fprintf(stderr, "%s: unsupported trace format\n", args.trace_file);
+		exit(EXIT_FAILURE);
+	}
+
+	const struct trace_rec *recs = (const void *)(data + sizeof *h);
+	uint64_t n_recs = (st.st_size - sizeof *h) / sizeof *recs;
+
+	struct count counts[128];
+	int n_counts = 0;
+	uint64_t n_printed = 0;
+
+	for (uint64_t i = 0; i < n_recs; ++i) {
+		struct dis_insn d;
+		disasm_decode(recs[i].instr, &d);
+		if (!match(&recs[i], &d))
+			continue;
+
+		if (args.summary) {
+			int j;
+			for (j = 0; j < n_counts; ++j) {
+				if (counts[j].name == d.name)
+					break;
+			}
+			if (j == n_counts && n_counts < 128)
+				counts[n_counts++] = (struct count){ d.name, 0 };
+			if (j < n_counts)
+				counts[j].n++;
+			n_printed++;
+		} else {
+			print_rec(&recs[i], &d);
+			if (++n_printed == args.max_recs)
+				break;
+		}
+	}
+
+	if (args.summary) {
+		qsort(counts, n_counts, sizeof counts[0], cmp_count);
+		for (int j = 0; j < n_counts; ++j)
+			printf("%-10s %12llu %6.2f%%\n", counts[j].name,
+					(unsigned long long)counts[j].n,
+					100.0 * counts[j].n / n_printed);
+		printf("%-10s %12llu\n", "total", (unsigned long long)n_printed);
+	}
+
+	return 0;
+}
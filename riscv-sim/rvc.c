@@ -0,0 +1,259 @@
+#include <stdint.h>
+
+#include "rvc.h"
+
+/* 32-bit major opcodes, with the low two bits */
+#define OPC_LOAD     0x03
+#define OPC_LOAD_FP  0x07
+#define OPC_IMM      0x13
+#define OPC_STORE    0x23
+#define OPC_STORE_FP 0x27
+#define OPC_OP       0x33
+#define OPC_LUI      0x37
+#define OPC_BRANCH   0x63
+#define OPC_JALR     0x67
+#define OPC_JAL      0x6f
+
+#define EBREAK 0x00100073
+
+#define REG_RA 1
+#define REG_SP 2
+
+/* Bits hi..lo of c, shifted down */
+static uint32_t bits(uint32_t c, int hi, int lo) {
+	return (c >> lo) & ((1u << (hi - lo + 1)) - 1);
+}
+
+/* Bit pos of c, moved to bit to of the immediate */
+static uint32_t bit(uint32_t c, int pos, int to) {
+	return ((c >> pos) & 1) << to;
+}
+
+static int32_t sext(uint32_t imm, int signPos) {
+	int shift = 31 - signPos;
+	return (int32_t)(imm << shift) >> shift;
+}
+
+/* The three bit register fields of the CIW, CL, CS, CA and CB formats
+   name x8-x15 */
+static uint32_t creg(uint32_t c, int lo) {
+	return 8 + bits(c, lo + 2, lo);
+}
+
+static uint32_t r_type(uint32_t opc, uint32_t funct3, uint32_t funct7,
+		uint32_t rd, uint32_t rs1, uint32_t rs2) {
+	return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 |
+		opc;
+}
+
+static uint32_t i_type(uint32_t opc, uint32_t funct3, uint32_t rd,
+		uint32_t rs1, int32_t imm) {
+	return ((uint32_t)imm & 0xfff) << 20 | rs1 << 15 | funct3 << 12 |
+		rd << 7 | opc;
+}
+
+static uint32_t s_type(uint32_t opc, uint32_t funct3, uint32_t rs1,
+		uint32_t rs2, int32_t imm) {
+	uint32_t u = imm;
+	return bits(u, 11, 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 |
+		bits(u, 4, 0) << 7 | opc;
+}
+
+static uint32_t b_type(uint32_t funct3, uint32_t rs1, uint32_t rs2,
+		int32_t imm) {
+	uint32_t u = imm;
+	return bit(u, 12, 31) | bits(u, 10, 5) << 25 | rs2 << 20 | rs1 << 15 |
+		funct3 << 12 | bits(u, 4, 1) << 8 | bit(u, 11, 7) | OPC_BRANCH;
+}
+
+static uint32_t j_type(uint32_t rd, int32_t imm) {
+	uint32_t u = imm;
+	return bit(u, 20, 31) | bits(u, 10, 1) << 21 | bit(u, 11, 20) |
+		bits(u, 19, 12) << 12 | rd << 7 | OPC_JAL;
+}
+
+/* Immediates, named after the instructions that use them */
+
+static int32_t ci_imm(uint32_t c) { /* C.ADDI, C.LI, C.ANDI */
+	return sext(bit(c, 12, 5) | bits(c, 6, 2), 5);
+}
+
+static uint32_t cl_w_imm(uint32_t c) { /* C.LW, C.SW, C.FLW, C.FSW */
+	return bits(c, 12, 10) << 3 | bit(c, 6, 2) | bit(c, 5, 6);
+}
+
+static uint32_t cl_d_imm(uint32_t c) { /* C.FLD, C.FSD */
+	return bits(c, 12, 10) << 3 | bits(c, 6, 5) << 6;
+}
+
+static uint32_t lwsp_imm(uint32_t c) { /* C.LWSP, C.FLWSP */
+	return bit(c, 12, 5) | bits(c, 6, 4) << 2 | bits(c, 3, 2) << 6;
+}
+
+static uint32_t ldsp_imm(uint32_t c) { /* C.FLDSP */
+	return bit(c, 12, 5) | bits(c, 6, 5) << 3 | bits(c, 4, 2) << 6;
+}
+
+static uint32_t swsp_imm(uint32_t c) { /* C.SWSP, C.FSWSP */
+	return bits(c, 12, 9) << 2 | bits(c, 8, 7) << 6;
+}
+
+static uint32_t sdsp_imm(uint32_t c) { /* C.FSDSP */
+	return bits(c, 12, 10) << 3 | bits(c, 9, 7) << 6;
+}
+
+static int32_t cj_imm(uint32_t c) { /* C.J, C.JAL */
+	return sext(bit(c, 12, 11) | bit(c, 11, 4) | bits(c, 10, 9) << 8 |
+		bit(c, 8, 10) | bit(c, 7, 6) | bit(c, 6, 7) |
+		bits(c, 5, 3) << 1 | bit(c, 2, 5), 11);
+}
+
+static int32_t cb_imm(uint32_t c) { /* C.BEQZ, C.BNEZ */
+	return sext(bit(c, 12, 8) | bits(c, 11, 10) << 3 | bits(c, 6, 5) << 6 |
+		bits(c, 4, 3) << 1 | bit(c, 2, 5), 8);
+}
+
+/* Quadrant 0: stack pointer based addi, loads and stores */
+static uint32_t expand_q0(uint32_t c) {
+	uint32_t rd = creg(c, 2); /* rs2' for the stores */
+	uint32_t rs1 = creg(c, 7);
+
+	switch (bits(c, 15, 13)) {
+	case 0: { /* 000 C.ADDI4SPN */
+		uint32_t imm = bits(c, 12, 11) << 4 | bits(c, 10, 7) << 6 |
+			bit(c, 6, 2) | bit(c, 5, 3);
+		if (imm == 0)
+			return 0;
+		return i_type(OPC_IMM, 0, rd, REG_SP, imm);
+	}
+	case 1: /* 001 C.FLD */
+		return i_type(OPC_LOAD_FP, 3, rd, rs1, cl_d_imm(c));
+	case 2: /* 010 C.LW */
+		return i_type(OPC_LOAD, 2, rd, rs1, cl_w_imm(c));
+	case 3: /* 011 C.FLW */
+		return i_type(OPC_LOAD_FP, 2, rd, rs1, cl_w_imm(c));
+	case 5: /* 101 C.FSD */
+		return s_type(OPC_STORE_FP, 3, rs1, rd, cl_d_imm(c));
+	case 6: /* 110 C.SW */
+		return s_type(OPC_STORE, 2, rs1, rd, cl_w_imm(c));
+	case 7: /* 111 C.FSW */
+		return s_type(OPC_STORE_FP, 2, rs1, rd, cl_w_imm(c));
+	default: /* 100 reserved */
+		return 0;
+	}
+}
+
+/* Quadrant 1: immediates, arithmetic on x8-x15, jumps and branches */
+static uint32_t expand_q1(uint32_t c) {
+	uint32_t rd = bits(c, 11, 7);
+	uint32_t rs1 = creg(c, 7); /* and rd' */
+	uint32_t rs2 = creg(c, 2);
+
+	switch (bits(c, 15, 13)) {
+	case 0: /* 000 C.ADDI, C.NOP */
+		return i_type(OPC_IMM, 0, rd, rd, ci_imm(c));
+	case 1: /* 001 C.JAL */
+		return j_type(REG_RA, cj_imm(c));
+	case 2: /* 010 C.LI */
+		return i_type(OPC_IMM, 0, rd, 0, ci_imm(c));
+	case 3:
+		if (rd == REG_SP) { /* 011 C.ADDI16SP */
+			int32_t imm = sext(bit(c, 12, 9) | bit(c, 6, 4) |
+				bit(c, 5, 6) | bits(c, 4, 3) << 7 | bit(c, 2, 5), 9);
+			if (imm == 0)
+				return 0;
+			return i_type(OPC_IMM, 0, REG_SP, REG_SP, imm);
+		} else { /* 011 C.LUI */
+			int32_t imm = sext(bit(c, 12, 17) | bits(c, 6, 2) << 12, 17);
+			if (imm == 0)
+				return 0;
+			return (uint32_t)imm | rd << 7 | OPC_LUI;
+		}
+	case 4:
+		switch (bits(c, 11, 10)) {
+		case 0: /* 00 C.SRLI, shamt[5] must be 0 on RV32 */
+			if (bit(c, 12, 0))
+				return 0;
+			return i_type(OPC_IMM, 5, rs1, rs1, bits(c, 6, 2));
+		case 1: /* 01 C.SRAI */
+			if (bit(c, 12, 0))
+				return 0;
+			return i_type(OPC_IMM, 5, rs1, rs1, 0x400 | bits(c, 6, 2));
+		case 2: /* 10 C.ANDI */
+			return i_type(OPC_IMM, 7, rs1, rs1, ci_imm(c));
+		default:
+			if (bit(c, 12, 0)) /* C.SUBW and C.ADDW on RV64 */
+				return 0;
+			switch (bits(c, 6, 5)) {
+			case 0: /* 00 C.SUB */
+				return r_type(OPC_OP, 0, 0x20, rs1, rs1, rs2);
+			case 1: /* 01 C.XOR */
+				return r_type(OPC_OP, 4, 0, rs1, rs1, rs2);
+			case 2: /* 10 C.OR */
+				return r_type(OPC_OP, 6, 0, rs1, rs1, rs2);
+			default: /* 11 C.AND */
+				return r_type(OPC_OP, 7, 0, rs1, rs1, rs2);
+			}
+		}
+	case 5: /* 101 C.J */
+		return j_type(0, cj_imm(c));
+	case 6: /* 110 C.BEQZ */
+		return b_type(0, rs1, 0, cb_imm(c));
+	default: /* 111 C.BNEZ */
+		return b_type(1, rs1, 0, cb_imm(c));
+	}
+}
+
+/* Quadrant 2: stack pointer based loads and stores, full register moves
+   and jumps */
+static uint32_t expand_q2(uint32_t c) {
+	uint32_t rd = bits(c, 11, 7); /* and rs1 */
+	uint32_t rs2 = bits(c, 6, 2);
+
+	switch (bits(c, 15, 13)) {
+	case 0: /* 000 C.SLLI */
+		if (bit(c, 12, 0))
+			return 0;
+		return i_type(OPC_IMM, 1, rd, rd, rs2);
+	case 1: /* 001 C.FLDSP */
+		return i_type(OPC_LOAD_FP, 3, rd, REG_SP, ldsp_imm(c));
+	case 2: /* 010 C.LWSP */
+		if (rd == 0)
+			return 0;
+		return i_type(OPC_LOAD, 2, rd, REG_SP, lwsp_imm(c));
+	case 3: /* 011 C.FLWSP */
+		return i_type(OPC_LOAD_FP, 2, rd, REG_SP, lwsp_imm(c));
+	case 4:
+		if (!bit(c, 12, 0)) {
+			if (rs2 != 0) /* C.MV */
+				return r_type(OPC_OP, 0, 0, rd, 0, rs2);
+			if (rd == 0)
+				return 0;
+			return i_type(OPC_JALR, 0, 0, rd, 0); /* C.JR */
+		}
+		if (rs2 != 0) /* C.ADD */
+			return r_type(OPC_OP, 0, 0, rd, rd, rs2);
+		if (rd == 0)
+			return EBREAK; /* C.EBREAK */
+		return i_type(OPC_JALR, 0, REG_RA, rd, 0); /* C.JALR */
+	case 5: /* 101 C.FSDSP */
+		return s_type(OPC_STORE_FP, 3, REG_SP, rs2, sdsp_imm(c));
+	case 6: /* 110 C.SWSP */
+		return s_type(OPC_STORE, 2, REG_SP, rs2, swsp_imm(c));
+	default: /* 111 C.FSWSP */
+		return s_type(OPC_STORE_FP, 2, REG_SP, rs2, swsp_imm(c));
+	}
+}
+
+uint32_t rvc_expand(uint16_t c) {
+	switch (c & 0x3) {
+	case 0:
+		return expand_q0(c);
+	case 1:
+		return expand_q1(c);
+	case 2:
+		return expand_q2(c);
+	default: /* not compressed */
+		return 0;
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef RVSIM_RVC_H
+#define RVSIM_RVC_H 1
+
+#include <stdint.h>
+
+/* C extension. A compressed instruction is any encoding whose low two
+   bits are not 11. */
+#define RVC_COMPRESSED(instr) (((instr) & 0x3) != 0x3)
+
+/* The 32-bit instruction that the compressed instruction c stands for.
+   Includes the RV32FC and RV32DC loads and stores, which then decode as
+   their 32-bit forms do. Hints expand to instructions with rd == x0.
+   RETURN VALUE: 0 (not a valid 32-bit encoding) if c is illegal or
+   reserved */
+extern uint32_t rvc_expand(uint16_t c);
+
+#endif /* RVSIM_RVC_H */
@@ -0,0 +1,142 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "sched.h"
+
+/* Binary min-heap on when */
+#define SCHED_MAX_EVENTS 32
+
+struct sched_queue {
+	struct sched_event *ev[SCHED_MAX_EVENTS];
+	int n;
+};
+
+static __thread struct sched_queue own;
+static __thread struct sched_queue *attached; /* see sched_attach() */
+
+__thread uint64_t sched_next_event = SCHED_NEVER;
+__thread uint64_t sched_n_run;
+
+static struct sched_queue *cur(void) {
+	return attached ? attached : &own;
+}
+
+/* Threads attached to another queue run without events of their own */
+static void update_next(struct sched_queue *q) {
+	if (!attached)
+		sched_next_event = q->n ? q->ev[0]->when : SCHED_NEVER;
+}
+
+static void place(struct sched_queue *q, struct sched_event *ev, int i) {
+	q->ev[i] = ev;
+	ev->index = i;
+}
+
+static void sift_up(struct sched_queue *q, int i) {
+	struct sched_event *ev = q->ev[i];
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (q->ev[parent]->when <= ev->when)
+			break;
+		place(q, q->ev[parent], i);
+		i = parent;
+	}
+	place(q, ev, i);
+}
+
+static void sift_down(struct sched_queue *q, int i) {
+	struct sched_event *ev = q->ev[i];
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= q->n)
+			break;
+		if (child + 1 < q->n && q->ev[child + 1]->when < q->ev[child]->when)
+			child++;
+		if (ev->when <= q->ev[child]->when)
+			break;
+		place(q, q->ev[child], i);
+		i = child;
+	}
+	place(q, ev, i);
+}
+
+static void remove_at(struct sched_queue *q, int i) {
+	q->ev[i]->index = -1;
+	if (--q->n == i)
+		return;
+
+	struct sched_event *last = q->ev[q->n];
+	place(q, last, i);
+	sift_down(q, i);
+	sift_up(q, last->index);
+}
+
+void sched_init(void) {
+	attached = NULL;
+	for (int i = 0; i < own.n; ++i)
+		own.ev[i]->index = -1;
+	own.n = 0;
+	update_next(&own);
+}
+
+struct sched_queue *sched_share(void) {
+	return &own;
+}
+
+void sched_attach(struct sched_queue *q) {
+	attached = q;
+	sched_next_event = SCHED_NEVER;
+}
+
+void sched_event_init(struct sched_event *ev, sched_f *fn, void *arg) {
+	ev->when = SCHED_NEVER;
+	ev->fn = fn;
+	ev->arg = arg;
+	ev->index = -1;
+}
+
+void sched_at(struct sched_event *ev, uint64_t when) {
+	struct sched_queue *q = cur();
+	if (ev->index >= 0)
+		remove_at(q, ev->index);
+
+	if (q->n == SCHED_MAX_EVENTS) {
+		fprintf(stderr, "sched_at: event queue full\n");
+		abort();
+	}
+
+	ev->when = when;
+	place(q, ev, q->n++);
+	sift_up(q, ev->index);
+	update_next(q);
+}
+
+void sched_after(struct sched_event *ev, uint64_t delay) {
+	sched_at(ev, M.instret + delay);
+}
+
+void sched_cancel(struct sched_event *ev) {
+	struct sched_queue *q = cur();
+	if (ev->index < 0)
+		return;
+	remove_at(q, ev->index);
+	update_next(q);
+}
+
+bool sched_pending(const struct sched_event *ev) {
+	return ev->index >= 0;
+}
+
+void sched_run_due(void) {
+	struct sched_queue *q = cur();
+	while (q->n && q->ev[0]->when <= M.instret) {
+		struct sched_event *ev = q->ev[0];
+		remove_at(q, 0);
+		update_next(q);
+		sched_n_run++;
+		ev->fn(ev->arg); /* may reschedule itself */
+	}
+}
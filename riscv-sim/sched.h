@@ -0,0 +1,49 @@
+#ifndef RVSIM_SCHED_H
+#define RVSIM_SCHED_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Device event scheduler. Time is measured in retired instructions
+   (M.instret). Devices own their struct sched_event and (re)schedule it
+   for the next point where they need service; the core runs uninterrupted
+   until the earliest pending event. */
+
+#define SCHED_NEVER UINT64_MAX
+
+typedef void sched_f(void *arg);
+
+struct sched_event {
+	uint64_t when;
+	sched_f *fn;
+	void *arg;
+	int index; /* position in the queue, -1 if not queued */
+};
+
+/* Time of the earliest pending event, SCHED_NEVER if none */
+extern __thread uint64_t sched_next_event;
+
+/* Events run so far, to tell whether any ran within a stretch of time */
+extern __thread uint64_t sched_n_run;
+
+/* Drop every pending event, before a thread starts another machine */
+extern void sched_init(void);
+
+/* Several harts of one machine share the queue of the thread that owns
+   the devices. Other threads attach to it: their events go to that queue
+   and their sched_next_event stays SCHED_NEVER, so only the owner runs
+   events. Callers serialize access with the machine's device lock. */
+struct sched_queue;
+extern struct sched_queue *sched_share(void);
+extern void sched_attach(struct sched_queue *q);
+
+extern void sched_event_init(struct sched_event *ev, sched_f *fn, void *arg);
+extern void sched_at(struct sched_event *ev, uint64_t when);
+extern void sched_after(struct sched_event *ev, uint64_t delay);
+extern void sched_cancel(struct sched_event *ev);
+extern bool sched_pending(const struct sched_event *ev);
+
+/* Run every event that is due at the current time */
+extern void sched_run_due(void);
+
+#endif /* RVSIM_SCHED_H */
@@ -0,0 +1,709 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "fpu.h"
+#include "insn.h"
+#include "jit.h"
+#include "mem.h"
+#include "sched.h"
+#include "threaded.h"
+
+/* A block ends at the first branch or jump, or after TB_MAX_INSNS
+   instructions. OP_SYSTEM (CSRs included), fences, atomics and invalid
+   encodings are left to the interpreter: a block stops short of them and
+   threaded_run() steps over them with cpu_interp_run(). So are
+   instructions at breakpoints, see cpu_breakpoint(). */
+#define TB_MAX_INSNS 64
+#define TB_HASH_BITS 14
+#define TB_HASH_SIZE (1 << TB_HASH_BITS)
+#define TB_ARENA_SIZE (16 << 20) /* all translations, flushed when full */
+
+/* Pseudo ops in addition to enum insn_id */
+#define T_FALLTHROUGH N_INSN_IDS /* end of a block without a jump */
+#define T_NOP (N_INSN_IDS + 1)   /* result discarded into x0 */
+#define N_TOPS (N_INSN_IDS + 2)
+
+struct top {
+	const void *label;
+	uint32_t pc;
+	uint32_t imm; /* absolute target for branches, jal and auipc */
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	uint8_t seq; /* instructions retired up to and including this one */
+	uint8_t len; /* in bytes, 2 if compressed */
+};
+
+struct tblock {
+	uint32_t pc;
+	uint32_t n_insns;
+	struct tblock *hnext;
+	struct tblock *succ[2]; /* last seen successor: [0] taken, [1] not */
+	uint32_t count; /* executions, up to JIT_HOT */
+	void *native; /* jit_compile() entry point */
+	bool poll; /* a loop that may poll a device, see cpu_poll_loop() */
+	struct top ops[];
+};
+
+static __thread const void *const *labels;
+static __thread struct tblock *hash[TB_HASH_SIZE];
+static __thread uint8_t *arena;
+static __thread size_t arena_used;
+static __thread uint8_t page_map[CPU_CODE_MAP_SIZE]; /* pages blocks came from */
+static __thread unsigned gen; /* bumped by every flush */
+static __thread bool jit; /* promote hot blocks to native code */
+
+static void flush(void) {
+	memset(hash, 0, sizeof hash);
+	memset(page_map, 0, sizeof page_map);
+	arena_used = 0;
+	gen++;
+	if (jit)
+		jit_flush();
+}
+
+static void mark_page(uint32_t addr) {
+	page_map[addr >> (CPU_CODE_PAGE_BITS + 3)] |=
+		1 << ((addr >> CPU_CODE_PAGE_BITS) & 7);
+}
+
+void threaded_invalidate(uint32_t addr) {
+	if (page_map[addr >> (CPU_CODE_PAGE_BITS + 3)] &
+			(1 << ((addr >> CPU_CODE_PAGE_BITS) & 7)))
+		flush();
+}
+
+void threaded_flush(void) {
+	if (arena)
+		flush();
+}
+
+static struct tblock **bucket(uint32_t pc) {
+	return &hash[(pc >> 1) & (TB_HASH_SIZE - 1)];
+}
+
+static bool interp_only(int id) {
+	switch (id) {
+	case I_INVALID: case I_SYSTEM: case I_FENCE: case I_FENCE_I:
+	case I_LR_W: case I_SC_W: case I_AMOSWAP_W: case I_AMOADD_W:
+	case I_AMOXOR_W: case I_AMOAND_W: case I_AMOOR_W: case I_AMOMIN_W:
+	case I_AMOMAX_W: case I_AMOMINU_W: case I_AMOMAXU_W:
+	case I_CSRRW: case I_CSRRS: case I_CSRRC:
+	case I_CSRRWI: case I_CSRRSI: case I_CSRRCI:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* RETURN VALUE: NULL if the first instruction cannot be translated */
+static struct tblock *translate(uint32_t pc) {
+	struct top ops[TB_MAX_INSNS + 1];
+	uint32_t start = pc;
+	int n = 0;
+	bool jump = false;
+	bool stores = false;
+	bool fp = false;
+
+	while (n < TB_MAX_INSNS && !jump) {
+		const struct insn *in = cpu_fetch(pc);
+		if (in == NULL || interp_only(in->id) || cpu_breakpoint(pc))
+			break;
+
+		struct top *op = &ops[n++];
+		int id = in->id;
+		op->pc = pc;
+		op->imm = in->imm;
+		op->rd = in->rd;
+		op->rs1 = in->rs1;
+		op->rs2 = in->rs2;
+		op->seq = n;
+		op->len = insn_len(in);
+
+		switch (id) {
+		case I_LB: case I_LH: case I_LW: case I_LBU: case I_LHU:
+			break;
+		case I_SB: case I_SH: case I_SW:
+			stores = true;
+			break;
+		case I_BEQ: case I_BNE: case I_BLT:
+		case I_BGE: case I_BLTU: case I_BGEU:
+		case I_JAL:
+			op->imm = pc + in->imm;
+			jump = true;
+			break;
+		case I_JALR:
+			jump = true;
+			break;
+		case I_FSW:
+			stores = true;
+			/* fall through */
+		case I_FLW:
+		case I_FMADD_S ... I_FCLASS_S:
+			/* f0 is a register, and the x results still raise flags */
+			fp = true;
+			break;
+		case I_AUIPC:
+			op->imm = pc + in->imm;
+			id = I_LUI;
+			/* fall through */
+		default:
+			if (in->rd == 0)
+				id = T_NOP;
+			break;
+		}
+		op->label = labels[id];
+		pc += op->len;
+	}
+
+	if (n == 0)
+		return NULL;
+
+	int n_ops = n;
+	if (!jump) {
+		ops[n].label = labels[T_FALLTHROUGH];
+		ops[n].pc = pc;
+		ops[n].seq = n;
+		n_ops++;
+	}
+
+	size_t size = sizeof(struct tblock) + n_ops * sizeof(struct top);
+	size = (size + 15) & ~(size_t)15;
+	if (arena_used + size > TB_ARENA_SIZE)
+		flush();
+	struct tblock *blk = (struct tblock *)(arena + arena_used);
+	arena_used += size;
+
+	blk->pc = start;
+	blk->n_insns = n;
+	blk->succ[0] = NULL;
+	blk->succ[1] = NULL;
+	blk->count = 0;
+	blk->native = NULL;
+	blk->poll = jump && !stores && !fp && n <= CPU_POLL_MAX_INSNS &&
+		ops[n - 1].label != labels[I_JAL] &&
+		ops[n - 1].label != labels[I_JALR] && ops[n - 1].imm == start;
+	memcpy(blk->ops, ops, n_ops * sizeof(struct top));
+
+	struct tblock **b = bucket(start);
+	blk->hnext = *b;
+	*b = blk;
+
+	mark_page(start);
+	mark_page(pc - 1);
+	return blk;
+}
+
+static struct tblock *get_block(uint32_t pc) {
+	for (struct tblock *blk = *bucket(pc); blk; blk = blk->hnext) {
+		if (blk->pc == pc)
+			return blk;
+	}
+	return translate(pc);
+}
+
+/* Run blk and its successors while whole blocks fit before end. M.pc and
+   M.instret are exact on return. M.instret is only brought up to date
+   before memory accesses (which may reach a device) and on leaving a
+   block. Blocks translated by the JIT run natively until native code
+   leaves for a block that is not. Called once with blk == NULL to publish
+   the label table. */
+static void execute(struct tblock *blk, uint64_t end) {
+#define LABEL(id, name) [I_##id] = &&do_##name,
+	static const void *const table[N_TOPS] = {
+		INSN_LIST(LABEL)
+		[T_FALLTHROUGH] = &&fallthrough,
+		[T_NOP] = &&nop,
+	};
+#undef LABEL
+
+	if (blk == NULL) {
+		labels = table;
+		return;
+	}
+
+	uint32_t *const r = M.regs;
+	uint32_t *const f = M.fregs;
+	const unsigned blk_gen = gen;
+	const struct top *op;
+	struct tblock *next;
+	uint64_t base;
+	uint32_t npc;
+	int slot;
+
+#define NEXT() do { op++; goto *op->label; } while (0)
+
+enter:
+	if (blk->native) {
+		void *site = jit_exec(blk->native, end);
+		next = get_block(M.pc);
+		if (next == NULL || gen != blk_gen)
+			return;
+		if (site && next->native)
+			jit_link(site, next->native);
+		goto next_block;
+	}
+	/* poll loops stay here, for cpu_poll_loop() */
+	if (jit && !blk->poll && ++blk->count == JIT_HOT) {
+		blk->native = jit_compile(blk->pc, blk->n_insns);
+		if (blk->native == NULL) {
+			flush(); /* code cache full */
+			return;
+		}
+		goto enter;
+	}
+
+	base = M.instret;
+	op = blk->ops;
+	goto *op->label;
+
+	/* never translated, see interp_only() */
+do_invalid:
+do_system:
+do_fence:
+do_fence_i:
+do_lr_w:
+do_sc_w:
+do_amoswap_w:
+do_amoadd_w:
+do_amoxor_w:
+do_amoand_w:
+do_amoor_w:
+do_amomin_w:
+do_amomax_w:
+do_amominu_w:
+do_amomaxu_w:
+do_csrrw:
+do_csrrs:
+do_csrrc:
+do_csrrwi:
+do_csrrsi:
+do_csrrci:
+	M.instret = base + op->seq - 1;
+	M.pc = op->pc;
+	return;
+
+nop:
+	NEXT();
+
+	/* OP_LOAD */
+
+do_lb: {
+	uint8_t m;
+	M.instret = base + op->seq;
+	if (mem_load_byte(r[op->rs1] + op->imm, &m) == 0) {
+		r[op->rd] = (int8_t)m;
+		r[0] = 0;
+	}
+	NEXT();
+}
+
+do_lh: {
+	uint32_t eff = r[op->rs1] + op->imm;
+	uint16_t m;
+	M.instret = base + op->seq;
+	if (!(eff % 2) && mem_load_half(eff, &m) == 0) {
+		r[op->rd] = (int16_t)m;
+		r[0] = 0;
+	}
+	NEXT();
+}
+
+do_lw: {
+	uint32_t eff = r[op->rs1] + op->imm;
+	uint32_t m;
+	M.instret = base + op->seq;
+	if (!(eff % 4) && mem_load_word(eff, &m) == 0) {
+		r[op->rd] = m;
+		r[0] = 0;
+	}
+	NEXT();
+}
+
+do_lbu: {
+	uint8_t m;
+	M.instret = base + op->seq;
+	if (mem_load_byte(r[op->rs1] + op->imm, &m) == 0) {
+		r[op->rd] = m;
+		r[0] = 0;
+	}
+	NEXT();
+}
+
+do_lhu: {
+	uint32_t eff = r[op->rs1] + op->imm;
+	uint16_t m;
+	M.instret = base + op->seq;
+	if (!(eff % 2) && mem_load_half(eff, &m) == 0) {
+		r[op->rd] = m;
+		r[0] = 0;
+	}
+	NEXT();
+}
+
+	/* OP_IMM, rd != 0 from here on up to the stores */
+
+do_addi:
+	r[op->rd] = r[op->rs1] + op->imm;
+	NEXT();
+do_slli:
+	r[op->rd] = r[op->rs1] << op->imm;
+	NEXT();
+do_slti:
+	r[op->rd] = (int32_t)r[op->rs1] < (int32_t)op->imm;
+	NEXT();
+do_sltiu:
+	r[op->rd] = r[op->rs1] < op->imm;
+	NEXT();
+do_xori:
+	r[op->rd] = r[op->rs1] ^ op->imm;
+	NEXT();
+do_srli:
+	r[op->rd] = r[op->rs1] >> op->imm;
+	NEXT();
+do_srai:
+	r[op->rd] = (uint32_t)((int32_t)r[op->rs1] >> op->imm);
+	NEXT();
+do_ori:
+	r[op->rd] = r[op->rs1] | op->imm;
+	NEXT();
+do_andi:
+	r[op->rd] = r[op->rs1] & op->imm;
+	NEXT();
+
+	/* OP_AUIPC (translated to lui of the absolute value) / OP_LUI */
+
+do_auipc:
+do_lui:
+	r[op->rd] = op->imm;
+	NEXT();
+
+	/* OP_STORE
+	   A store into a page blocks were translated from flushes them all,
+	   this block included, so leave right after it. */
+
+do_sb: {
+	M.instret = base + op->seq;
+	mem_store_byte(r[op->rs1] + op->imm, r[op->rs2]);
+	if (gen != blk_gen)
+		goto flushed;
+	NEXT();
+}
+
+do_sh: {
+	uint32_t eff = r[op->rs1] + op->imm;
+	M.instret = base + op->seq;
+	if (!(eff % 2))
+		mem_store_half(eff, r[op->rs2]);
+	if (gen != blk_gen)
+		goto flushed;
+	NEXT();
+}
+
+do_sw: {
+	uint32_t eff = r[op->rs1] + op->imm;
+	M.instret = base + op->seq;
+	if (!(eff % 4))
+		mem_store_word(eff, r[op->rs2]);
+	if (gen != blk_gen)
+		goto flushed;
+	NEXT();
+}
+
+	/* OP */
+
+do_add:
+	r[op->rd] = r[op->rs1] + r[op->rs2];
+	NEXT();
+do_sub:
+	r[op->rd] = r[op->rs1] - r[op->rs2];
+	NEXT();
+do_sll:
+	r[op->rd] = r[op->rs1] << (r[op->rs2] & 0x1F);
+	NEXT();
+do_slt:
+	r[op->rd] = (int32_t)r[op->rs1] < (int32_t)r[op->rs2];
+	NEXT();
+do_sltu:
+	r[op->rd] = r[op->rs1] < r[op->rs2];
+	NEXT();
+do_xor:
+	r[op->rd] = r[op->rs1] ^ r[op->rs2];
+	NEXT();
+do_srl:
+	r[op->rd] = r[op->rs1] >> (r[op->rs2] & 0x1F);
+	NEXT();
+do_sra:
+	r[op->rd] = (int32_t)r[op->rs1] >> (r[op->rs2] & 0x1F);
+	NEXT();
+do_or:
+	r[op->rd] = r[op->rs1] | r[op->rs2];
+	NEXT();
+do_and:
+	r[op->rd] = r[op->rs1] & r[op->rs2];
+	NEXT();
+
+	/* OP, RV32M, see interp.h for division by zero and overflow */
+
+do_mul:
+	r[op->rd] = r[op->rs1] * r[op->rs2];
+	NEXT();
+do_mulh:
+	r[op->rd] = ((int64_t)(int32_t)r[op->rs1] * (int32_t)r[op->rs2]) >> 32;
+	NEXT();
+do_mulhsu:
+	r[op->rd] = ((int64_t)(int32_t)r[op->rs1] * (uint64_t)r[op->rs2]) >> 32;
+	NEXT();
+do_mulhu:
+	r[op->rd] = ((uint64_t)r[op->rs1] * r[op->rs2]) >> 32;
+	NEXT();
+do_div:
+	if (r[op->rs2] == 0)
+		r[op->rd] = UINT32_MAX;
+	else if (r[op->rs1] == 0x80000000 && r[op->rs2] == UINT32_MAX)
+		r[op->rd] = 0x80000000;
+	else
+		r[op->rd] = (int32_t)r[op->rs1] / (int32_t)r[op->rs2];
+	NEXT();
+do_divu:
+	r[op->rd] = r[op->rs2] == 0 ? UINT32_MAX : r[op->rs1] / r[op->rs2];
+	NEXT();
+do_rem:
+	if (r[op->rs2] == 0)
+		r[op->rd] = r[op->rs1];
+	else if (r[op->rs1] == 0x80000000 && r[op->rs2] == UINT32_MAX)
+		r[op->rd] = 0;
+	else
+		r[op->rd] = (int32_t)r[op->rs1] % (int32_t)r[op->rs2];
+	NEXT();
+do_remu:
+	r[op->rd] = r[op->rs2] == 0 ? r[op->rs1] : r[op->rs1] % r[op->rs2];
+	NEXT();
+
+	/* RV32F, see interp.h. The ones with an x register result may have
+	   rd == 0. */
+
+do_flw: {
+	uint32_t eff = r[op->rs1] + op->imm;
+	uint32_t m;
+	M.instret = base + op->seq;
+	if (!(eff % 4) && mem_load_word(eff, &m) == 0)
+		f[op->rd] = m;
+	NEXT();
+}
+
+do_fsw: {
+	uint32_t eff = r[op->rs1] + op->imm;
+	M.instret = base + op->seq;
+	if (!(eff % 4))
+		mem_store_word(eff, f[op->rs2]);
+	if (gen != blk_gen)
+		goto flushed;
+	NEXT();
+}
+
+do_fmadd_s:
+	f[op->rd] = fpu_fma(f[op->rs1], f[op->rs2], f[op->imm >> 3], op->imm & 0x7);
+	NEXT();
+do_fmsub_s:
+	f[op->rd] = fpu_fma(f[op->rs1], f[op->rs2], f[op->imm >> 3] ^ FPU_SIGN,
+			op->imm & 0x7);
+	NEXT();
+do_fnmsub_s:
+	f[op->rd] = fpu_fma(f[op->rs1] ^ FPU_SIGN, f[op->rs2], f[op->imm >> 3],
+			op->imm & 0x7);
+	NEXT();
+do_fnmadd_s:
+	f[op->rd] = fpu_fma(f[op->rs1] ^ FPU_SIGN, f[op->rs2],
+			f[op->imm >> 3] ^ FPU_SIGN, op->imm & 0x7);
+	NEXT();
+do_fadd_s:
+	f[op->rd] = fpu_add(f[op->rs1], f[op->rs2], op->imm);
+	NEXT();
+do_fsub_s:
+	f[op->rd] = fpu_sub(f[op->rs1], f[op->rs2], op->imm);
+	NEXT();
+do_fmul_s:
+	f[op->rd] = fpu_mul(f[op->rs1], f[op->rs2], op->imm);
+	NEXT();
+do_fdiv_s:
+	f[op->rd] = fpu_div(f[op->rs1], f[op->rs2], op->imm);
+	NEXT();
+do_fsqrt_s:
+	f[op->rd] = fpu_sqrt(f[op->rs1], op->imm);
+	NEXT();
+do_fsgnj_s:
+	f[op->rd] = fpu_sgnj(f[op->rs1], f[op->rs2]);
+	NEXT();
+do_fsgnjn_s:
+	f[op->rd] = fpu_sgnjn(f[op->rs1], f[op->rs2]);
+	NEXT();
+do_fsgnjx_s:
+	f[op->rd] = fpu_sgnjx(f[op->rs1], f[op->rs2]);
+	NEXT();
+do_fmin_s:
+	f[op->rd] = fpu_min(f[op->rs1], f[op->rs2]);
+	NEXT();
+do_fmax_s:
+	f[op->rd] = fpu_max(f[op->rs1], f[op->rs2]);
+	NEXT();
+do_fcvt_s_w:
+	f[op->rd] = fpu_cvt_s_w(r[op->rs1], op->imm);
+	NEXT();
+do_fcvt_s_wu:
+	f[op->rd] = fpu_cvt_s_wu(r[op->rs1], op->imm);
+	NEXT();
+do_fmv_w_x:
+	f[op->rd] = r[op->rs1];
+	NEXT();
+do_fcvt_w_s:
+	r[op->rd] = fpu_cvt_w_s(f[op->rs1], op->imm);
+	r[0] = 0;
+	NEXT();
+do_fcvt_wu_s:
+	r[op->rd] = fpu_cvt_wu_s(f[op->rs1], op->imm);
+	r[0] = 0;
+	NEXT();
+do_fmv_x_w:
+	r[op->rd] = f[op->rs1];
+	r[0] = 0;
+	NEXT();
+do_feq_s:
+	r[op->rd] = fpu_eq(f[op->rs1], f[op->rs2]);
+	r[0] = 0;
+	NEXT();
+do_flt_s:
+	r[op->rd] = fpu_lt(f[op->rs1], f[op->rs2]);
+	r[0] = 0;
+	NEXT();
+do_fle_s:
+	r[op->rd] = fpu_le(f[op->rs1], f[op->rs2]);
+	r[0] = 0;
+	NEXT();
+do_fclass_s:
+	r[op->rd] = fpu_class(f[op->rs1]);
+	r[0] = 0;
+	NEXT();
+
+	/* OP_BRANCH */
+
+do_beq:
+	if (r[op->rs1] == r[op->rs2])
+		goto taken;
+	goto not_taken;
+do_bne:
+	if (r[op->rs1] != r[op->rs2])
+		goto taken;
+	goto not_taken;
+do_blt:
+	if ((int32_t)r[op->rs1] < (int32_t)r[op->rs2])
+		goto taken;
+	goto not_taken;
+do_bge:
+	if ((int32_t)r[op->rs1] >= (int32_t)r[op->rs2])
+		goto taken;
+	goto not_taken;
+do_bltu:
+	if (r[op->rs1] < r[op->rs2])
+		goto taken;
+	goto not_taken;
+do_bgeu:
+	if (r[op->rs1] >= r[op->rs2])
+		goto taken;
+	goto not_taken;
+
+taken:
+	npc = op->imm;
+	slot = 0;
+	if (blk->poll) {
+		M.instret = base + blk->n_insns;
+		cpu_poll_loop(npc, blk->n_insns);
+		base = M.instret - blk->n_insns;
+	}
+	goto chain;
+not_taken:
+	npc = op->pc + op->len;
+	slot = 1;
+	goto chain;
+
+	/* OP_JALR / OP_JAL */
+
+do_jalr:
+	npc = (r[op->rs1] + op->imm) & ~0x1;
+	r[op->rd] = op->pc + op->len;
+	r[0] = 0;
+	slot = 0;
+	goto chain;
+do_jal:
+	r[op->rd] = op->pc + op->len;
+	r[0] = 0;
+	npc = op->imm;
+	slot = 0;
+	goto chain;
+
+fallthrough:
+	npc = op->pc;
+	slot = 1;
+	goto chain;
+
+flushed:
+	M.pc = op->pc + op->len;
+	return;
+
+chain:
+	M.instret = base + blk->n_insns;
+	M.pc = npc;
+	next = blk->succ[slot];
+	if (next == NULL || next->pc != npc) {
+		next = get_block(npc);
+		/* a full arena was flushed under us */
+		if (next == NULL || gen != blk_gen)
+			return;
+		blk->succ[slot] = next;
+	}
+next_block:
+	/* a device access may have scheduled an earlier event */
+	if (end > sched_next_event)
+		end = sched_next_event;
+	if (M.instret + next->n_insns > end)
+		return;
+	blk = next;
+	goto enter;
+
+#undef NEXT
+}
+
+void threaded_run(uint64_t end) {
+	for (;;) {
+		if (end > sched_next_event)
+			end = sched_next_event;
+		if (M.instret >= end)
+			return;
+
+		/* single step whatever cannot run as a whole block */
+		struct tblock *blk = get_block(M.pc);
+		if (blk == NULL || M.instret + blk->n_insns > end)
+			cpu_interp_run(M.instret + 1);
+		else
+			execute(blk, end);
+	}
+}
+
+void threaded_init(bool use_jit) {
+	if (arena == NULL) {
+		arena = malloc(TB_ARENA_SIZE);
+		if (arena == NULL) {
+			perror("threaded: malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	jit = use_jit;
+	if (jit)
+		jit_init();
+	execute(NULL, 0);
+	flush();
+}
@@ -0,0 +1,22 @@
+#ifndef RVSIM_THREADED_H
+#define RVSIM_THREADED_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Direct threaded execution engine. Guest basic blocks are translated
+   once into arrays of handler addresses with their operands and executed
+   with computed goto; blocks are linked to their successors as they are
+   discovered. Selected with cpu_init(CPU_THREADED, ...), or with
+   cpu_init(CPU_JIT, ...) to also hand hot blocks to the JIT. */
+
+extern void threaded_init(bool jit);
+
+/* Same contract as cpu_run() */
+extern void threaded_run(uint64_t end);
+
+/* Drop all translations if addr lies in a page code was translated from */
+extern void threaded_invalidate(uint32_t addr);
+extern void threaded_flush(void);
+
+#endif /* RVSIM_THREADED_H */
@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Records are collected in a ring of chunks. The core fills chunks in
+   order; a writer thread appends full chunks to the file. The core only
+   synchronizes with the writer once per chunk, and waits rather than
+   dropping records if the writer falls a whole ring behind. */
+#define TRACE_CHUNK_RECS (1 << 16)
+#define TRACE_N_CHUNKS   16
+
+struct chunk {
+	struct trace_rec recs[TRACE_CHUNK_RECS];
+	uint32_t n_recs;
+};
+
+struct trace_rec *trace_pos = NULL;
+struct trace_rec *trace_end = NULL;
+
+static struct chunk *chunks = NULL;
+static int fd = -1;
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t filled_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flushed_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t n_filled = 0;  /* chunks handed to the writer */
+static uint64_t n_flushed = 0; /* chunks written to the file */
+static bool closing = false;
+
+static void write_all(const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	while (len) {
+		ssize_t w = write(fd, p, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("trace: write");
+			exit(EXIT_FAILURE);
+		}
+		p += w;
+		len -= w;
+	}
+}
+
+static void *writer_thread(void *arg) {
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (n_flushed == n_filled && !closing)
+			pthread_cond_wait(&filled_cond, &lock);
+		if (n_flushed == n_filled)
+			break; /* closing and nothing left */
+
+		struct chunk *c = &chunks[n_flushed % TRACE_N_CHUNKS];
+		pthread_mutex_unlock(&lock);
+		write_all(c->recs, c->n_recs * sizeof c->recs[0]);
+		pthread_mutex_lock(&lock);
+
+		n_flushed++;
+		pthread_cond_signal(&flushed_cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void start_chunk(uint64_t n) {
+	struct chunk *c = &chunks[n % TRACE_N_CHUNKS];
+	trace_pos = c->recs;
+	trace_end = c->recs + TRACE_CHUNK_RECS;
+}
+
+static void submit_chunk(void) {
+	pthread_mutex_lock(&lock);
+	struct chunk *c = &chunks[n_filled % TRACE_N_CHUNKS];
+	c->n_recs = trace_pos - c->recs;
+	n_filled++;
+	pthread_cond_signal(&filled_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void trace_next_chunk(void) {
+	submit_chunk();
+
+	pthread_mutex_lock(&lock);
+	while (n_filled - n_flushed >= TRACE_N_CHUNKS)
+		pthread_cond_wait(&flushed_cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	start_chunk(n_filled);
+}
+
+void trace_open(const char *filepath) {
+	fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	struct trace_header h = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.rec_size = sizeof(struct trace_rec),
+	};
+	write_all(&h, sizeof h);
+
+	chunks = malloc(TRACE_N_CHUNKS * sizeof *chunks);
+	if (chunks == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	start_chunk(0);
+
+	int err = pthread_create(&writer, NULL, writer_thread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+void trace_close(void) {
+	if (fd < 0)
+		return;
+
+	submit_chunk();
+
+	pthread_mutex_lock(&lock);
+	closing = true;
+	pthread_cond_signal(&filled_cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(writer, NULL);
+
+	close(fd);
+	fd = -1;
+}
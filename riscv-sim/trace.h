@@ -0,0 +1,48 @@
+#ifndef RVSIM_TRACE_H
+#define RVSIM_TRACE_H 1
+
+#include <stdint.h>
+
+/* Binary execution trace. The file is a struct trace_header followed by
+   one struct trace_rec per executed instruction, in host (little endian)
+   byte order. Decode with riscv-trace. */
+
+#define TRACE_MAGIC "RVTRACE"
+#define TRACE_VERSION 1
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+};
+
+/* trace_rec flags */
+#define TRACE_F_LOAD  (1 << 0) /* mem_addr/mem_data valid, value loaded */
+#define TRACE_F_STORE (1 << 1) /* mem_addr/mem_data valid, value stored */
+
+struct trace_rec {
+	uint32_t pc;
+	uint32_t instr;
+	uint32_t rd_value; /* value of the rd field register after execution */
+	uint32_t mem_addr;
+	uint32_t mem_data;
+	uint32_t flags;
+};
+
+/* Recording side, used by the simulator */
+extern struct trace_rec *trace_pos;
+extern struct trace_rec *trace_end;
+
+extern void trace_open(const char *filepath);
+extern void trace_close(void);
+
+/* Hand the filled chunk to the writer thread and start a new one */
+extern void trace_next_chunk(void);
+
+static inline struct trace_rec *trace_next(void) {
+	if (trace_pos == trace_end)
+		trace_next_chunk();
+	return trace_pos++;
+}
+
+#endif /* RVSIM_TRACE_H */
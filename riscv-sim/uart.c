@@ -1,54 +1,288 @@
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "cpu.h"
+#include "irq.h"
+#include "mem.h"
+#include "ring.h"
+#include "sched.h"
 #include "uart.h"
 
-#define CSR_NEWDAT (1 << 0)
-#define CSR_TXDONE (1 << 1)
+/* Host side buffering between the I/O thread and the simulated core */
+#define HOST_RING_SIZE 4096
+
+/* TX bytes are handed to the I/O thread in batches: after this many
+   character times, or as soon as this many bytes are queued */
+#define TX_COALESCE_CHARS 16
+#define TX_KICK_LEVEL     256
+
+/* Retry interval while nobody has the pty slave open */
+#define HUP_RETRY_US 100000
 
 struct uart_regs {
-	uint8_t data_r;
+	uint8_t rx_fifo[UART_MAX_RX_FIFO];
+	uint32_t rx_head;
+	uint32_t rx_count;
+	uint8_t data_r; /* last byte read, returned when the FIFO is empty */
 	uint8_t data_w; /* data_w is shadow register */
-	uint8_t csr;
+	bool txdone;
+	uint8_t ie; /* interrupt enables of UART_CSR */
 };
 
-static struct uart_regs regs = {
-	.data_r = 0,
-	.data_w = 0,
-	.csr = CSR_TXDONE,
+struct uart {
+	struct uart_regs regs;
+	bool started;
+	uint32_t rx_fifo_depth;
+
+	/* Duration of one character on the line (start + 8 data + stop bits) */
+	uint64_t char_cycles;
+
+	struct sched_event rx_event;
+	struct sched_event tx_event;
+	struct sched_event flush_event;
+
+	/* Transfers in flight in a restored checkpoint, resumed by uart_start() */
+	uint64_t resume_tx_when;
+	uint64_t resume_flush_when;
+
+	/* Headless mode, see uart_init_capture() */
+	char *capture_buf;
+	size_t capture_size;
+	size_t capture_len;
 };
 
+/* The device is per machine like the rest of the machine state: u points
+   at this thread's own instance, or at the one shared by all harts of a
+   machine. The pty and the I/O thread serve a single machine per
+   process, the one that called uart_init(). */
+static __thread struct uart own;
+static __thread struct uart *u;
+
 static int ptm = -1;
+static int kick_fd = -1;
+static int wake_fd = -1; /* I/O thread -> core waiting for input */
+static bool rx_waiting; /* the core sleeps on wake_fd */
+static int extra_fd = -1; /* also ends the sleep, see uart_wake_on() */
+static struct ring rx_ring; /* I/O thread -> core */
+static struct ring tx_ring; /* core -> I/O thread */
+
+/* Wake up the I/O thread */
+static void kick(void) {
+	uint64_t one = 1;
+	write(kick_fd, &one, sizeof one);
+}
+
+static void *io_thread(void *arg) {
+	static uint8_t rx_buf[HOST_RING_SIZE];
+	static uint8_t tx_buf[HOST_RING_SIZE];
+	uint32_t tx_len = 0, tx_off = 0;
+
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = kick_fd };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, kick_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	uint32_t ptm_events = EPOLLIN;
+	ev.events = ptm_events;
+	ev.data.fd = ptm;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ptm, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		/* only ask for input while there is room for it, so bytes stay
+		   in the pty instead of being dropped */
+		uint32_t want = 0;
+		if (ring_space(&rx_ring))
+			want |= EPOLLIN;
+		if (tx_len)
+			want |= EPOLLOUT;
+		if (want != ptm_events) {
+			ev.events = want;
+			ev.data.fd = ptm;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, ptm, &ev);
+			ptm_events = want;
+		}
+
+		struct epoll_event events[2];
+		int n = epoll_wait(epfd, events, 2, -1);
+		bool hup = false;
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.fd == kick_fd) {
+				uint64_t v;
+				read(kick_fd, &v, sizeof v);
+			} else if ((events[i].events & EPOLLHUP) &&
+					!(events[i].events & EPOLLIN)) {
+				hup = true;
+			}
+		}
 
-void uart_update_state(void) {
-	if (!(regs.csr & CSR_NEWDAT)) {
-		uint8_t buf[32];
-		if (read(ptm, buf, 1) == 1) {
-			regs.data_r = buf[0];
-			regs.csr |= CSR_NEWDAT;
+		uint32_t space = ring_space(&rx_ring);
+		if (space) {
+			ssize_t r = read(ptm, rx_buf, space);
+			if (r > 0) {
+				ring_push(&rx_ring, rx_buf, r);
+				/* pairs with wait_input() */
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+				if (__atomic_load_n(&rx_waiting, __ATOMIC_RELAXED)) {
+					uint64_t one = 1;
+					write(wake_fd, &one, sizeof one);
+				}
+			}
 		}
-		//while(read(ptm, buf, sizeof buf) > 0); /* flush input buffer */
+
+		if (tx_len == 0) {
+			tx_len = ring_pop(&tx_ring, tx_buf, sizeof tx_buf);
+			tx_off = 0;
+		}
+		if (tx_len) {
+			ssize_t w = write(ptm, tx_buf + tx_off, tx_len - tx_off);
+			if (w > 0)
+				tx_off += w;
+			if (tx_off == tx_len || (w < 0 && errno != EAGAIN))
+				tx_len = 0; /* done, or nobody is listening */
+		}
+
+		if (hup)
+			usleep(HUP_RETRY_US);
 	}
-	if (!(regs.csr & CSR_TXDONE)) {
-		write(ptm, &regs.data_w, 1);
-		regs.csr |= CSR_TXDONE;
+
+	return NULL;
+}
+
+static void update_irq(void) {
+	bool level = ((u->regs.ie & UART_CSR_RXIE) && u->regs.rx_count) ||
+		((u->regs.ie & UART_CSR_TXIE) && u->regs.txdone);
+	irq_set_source(IRQ_SRC_UART, level);
+}
+
+/* The core waits in WFI, or spins in a loop polling the UART, with
+   nothing else scheduled, so only input can wake it: sleep until the I/O
+   thread has some, a signal arrives or extra_fd turns readable, instead
+   of polling every character time. Not with several harts, which may
+   need the device lock meanwhile. */
+static void wait_input(void) {
+	__atomic_store_n(&rx_waiting, true, __ATOMIC_SEQ_CST);
+	if (ring_count(&rx_ring) == 0) {
+		struct pollfd p[2] = {
+			{ .fd = wake_fd, .events = POLLIN },
+			{ .fd = extra_fd, .events = POLLIN },
+		};
+		poll(p, 2, -1); /* EINTR lets the signal be handled */
 	}
+	__atomic_store_n(&rx_waiting, false, __ATOMIC_SEQ_CST);
+
+	uint64_t v;
+	read(wake_fd, &v, sizeof v);
+}
+
+static void rx_fifo_put(uint8_t c) {
+	u->regs.rx_fifo[(u->regs.rx_head + u->regs.rx_count) % u->rx_fifo_depth] = c;
+	u->regs.rx_count++;
+}
+
+static uint8_t rx_fifo_get(void) {
+	uint8_t c = u->regs.rx_fifo[u->regs.rx_head];
+	u->regs.rx_head = (u->regs.rx_head + 1) % u->rx_fifo_depth;
+	u->regs.rx_count--;
+	return c;
+}
+
+/* Move at most one byte per character time from the host into the RX
+   FIFO. Bytes wait on the host side while the FIFO is full. */
+static void rx_poll(void *arg) {
+	if ((cpu_waiting || cpu_polling) && u->regs.rx_count == 0 &&
+			mem_device_lock == NULL && sched_next_event == SCHED_NEVER)
+		wait_input();
+
+	if (u->regs.rx_count < u->rx_fifo_depth) {
+		bool was_full = ring_space(&rx_ring) == 0;
+		uint8_t c;
+		if (ring_pop(&rx_ring, &c, 1)) {
+			rx_fifo_put(c);
+			update_irq();
+			if (was_full)
+				kick();
+		}
+	}
+	sched_after(&u->rx_event, u->char_cycles);
+}
+
+static void tx_flush(void *arg) {
+	kick();
+}
+
+/* The character in data_w has been shifted out */
+static void tx_done(void *arg) {
+	if (u->capture_buf) {
+		if (u->capture_len < u->capture_size)
+			u->capture_buf[u->capture_len] = u->regs.data_w;
+		u->capture_len++;
+		u->regs.txdone = true;
+		update_irq();
+		return;
+	}
+	if (ring_push(&tx_ring, &u->regs.data_w, 1) == 0) {
+		/* host is behind, hold the transmitter busy */
+		sched_after(&u->tx_event, u->char_cycles);
+		return;
+	}
+	u->regs.txdone = true;
+	update_irq();
+
+	if (ring_count(&tx_ring) >= TX_KICK_LEVEL) {
+		sched_cancel(&u->flush_event);
+		kick();
+	} else if (!sched_pending(&u->flush_event)) {
+		sched_after(&u->flush_event, TX_COALESCE_CHARS * u->char_cycles);
+	}
+}
+
+static uint8_t get_csr(void) {
+	uint8_t csr = 0;
+	if (u->regs.rx_count)
+		csr |= UART_CSR_NEWDAT;
+	if (u->regs.txdone)
+		csr |= UART_CSR_TXDONE;
+	if (u->regs.rx_count * 2 >= u->rx_fifo_depth)
+		csr |= UART_CSR_RXHALF;
+	if (u->regs.rx_count == u->rx_fifo_depth)
+		csr |= UART_CSR_RXFULL;
+	return csr | u->regs.ie;
 }
 
 uint8_t uart_get_register(uint32_t reg) {
 	switch (reg) {
 	case UART_DATA:
-		regs.csr &= (~CSR_NEWDAT);
-		return regs.data_r;
+		if (u->regs.rx_count) {
+			u->regs.data_r = rx_fifo_get();
+			update_irq();
+			mem_read_effects++;
+		}
+		return u->regs.data_r;
 		break;
 	case UART_CSR:
-		return regs.csr;
+		return get_csr();
 		break;
 	default:
 		fprintf(stderr, "uart_get_register: register unknown\n");
@@ -60,11 +294,16 @@ uint8_t uart_get_register(uint32_t reg) {
 void uart_set_register(uint32_t reg, uint8_t value) {
 	switch (reg) {
 	case UART_DATA:
-		regs.data_w = value;
-		regs.csr &= (~CSR_TXDONE);
+		u->regs.data_w = value;
+		u->regs.txdone = false;
+		update_irq();
+		if (u->started)
+			sched_after(&u->tx_event, u->char_cycles);
 		break;
 	case UART_CSR:
-		/* do nothing for now */
+		/* only the interrupt enables are writable */
+		u->regs.ie = value & UART_CSR_IE;
+		update_irq();
 		break;
 	default:
 		fprintf(stderr, "uart_set_register: register unknown\n");
@@ -73,7 +312,115 @@ void uart_set_register(uint32_t reg, uint8_t value) {
 	}
 }
 	
-void uart_init(void) {
+void uart_start(void) {
+	if (!ring_init(&rx_ring, HOST_RING_SIZE) || !ring_init(&tx_ring, HOST_RING_SIZE)) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	kick_fd = eventfd(0, EFD_NONBLOCK);
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (kick_fd < 0 || wake_fd < 0) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, io_thread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	u->started = true;
+	sched_after(&u->rx_event, u->char_cycles);
+	if (u->resume_tx_when != SCHED_NEVER)
+		sched_at(&u->tx_event, u->resume_tx_when);
+	if (u->resume_flush_when != SCHED_NEVER)
+		sched_at(&u->flush_event, u->resume_flush_when);
+}
+
+void uart_wake_on(int fd) {
+	extra_fd = fd;
+}
+
+void uart_save(struct uart_state *s) {
+	memset(s, 0, sizeof *s);
+	for (uint32_t i = 0; i < u->regs.rx_count; ++i)
+		s->rx_fifo[i] =
+			u->regs.rx_fifo[(u->regs.rx_head + i) % u->rx_fifo_depth];
+	s->rx_count = u->regs.rx_count;
+	s->data_r = u->regs.data_r;
+	s->data_w = u->regs.data_w;
+	s->txdone = u->regs.txdone;
+	s->ie = u->regs.ie;
+	s->tx_when = sched_pending(&u->tx_event) ?
+		u->tx_event.when : SCHED_NEVER;
+	s->flush_when = sched_pending(&u->flush_event) ?
+		u->flush_event.when : SCHED_NEVER;
+}
+
+void uart_restore(const struct uart_state *s) {
+	if (s->rx_count > u->rx_fifo_depth) {
+		fprintf(stderr, "uart_restore: %u bytes do not fit the RX FIFO\n",
+				s->rx_count);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(u->regs.rx_fifo, s->rx_fifo, s->rx_count);
+	u->regs.rx_head = 0;
+	u->regs.rx_count = s->rx_count;
+	u->regs.data_r = s->data_r;
+	u->regs.data_w = s->data_w;
+	u->regs.txdone = s->txdone;
+	u->regs.ie = s->ie & UART_CSR_IE;
+	update_irq();
+	u->resume_tx_when = s->tx_when;
+	u->resume_flush_when = s->flush_when;
+}
+
+static void init_device(uint64_t clock_hz, uint32_t baud, uint32_t rx_fifo) {
+	if (rx_fifo == 0 || rx_fifo > UART_MAX_RX_FIFO) {
+		fprintf(stderr, "uart_init: RX FIFO depth must be 1-%d\n", UART_MAX_RX_FIFO);
+		exit(EXIT_FAILURE);
+	}
+	u = &own;
+	memset(u, 0, sizeof *u);
+	u->rx_fifo_depth = rx_fifo;
+	u->regs.txdone = true;
+	u->resume_tx_when = SCHED_NEVER;
+	u->resume_flush_when = SCHED_NEVER;
+
+	u->char_cycles = clock_hz * 10 / baud;
+	if (u->char_cycles == 0)
+		u->char_cycles = 1;
+	sched_event_init(&u->rx_event, rx_poll, NULL);
+	sched_event_init(&u->tx_event, tx_done, NULL);
+	sched_event_init(&u->flush_event, tx_flush, NULL);
+}
+
+void uart_init_capture(uint64_t clock_hz, uint32_t baud, char *buf,
+		size_t size) {
+	init_device(clock_hz, baud, UART_DEFAULT_RX_FIFO);
+	u->capture_buf = buf;
+	u->capture_size = size;
+	u->started = true;
+}
+
+size_t uart_captured(void) {
+	return u->capture_len;
+}
+
+struct uart *uart_share(void) {
+	return u;
+}
+
+void uart_attach(struct uart *shared) {
+	u = shared;
+}
+
+void uart_init(uint64_t clock_hz, uint32_t baud, uint32_t rx_fifo) {
+	init_device(clock_hz, baud, rx_fifo);
+
 	ptm = getpt();
 	if (ptm < 0) {
 		perror("getpt");
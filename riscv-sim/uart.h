@@ -1,16 +1,72 @@
 #ifndef RVSIM_UART_H
 #define RVSIM_UART_H 1
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "sched.h"
+
 enum {
 	UART_CSR,
 	UART_DATA,
 };
 
-extern void uart_init(void);
-extern void uart_update_state(void);
+/* UART_CSR bits */
+#define UART_CSR_NEWDAT (1 << 0) /* RX FIFO not empty */
+#define UART_CSR_TXDONE (1 << 1) /* transmitter idle */
+#define UART_CSR_RXHALF (1 << 2) /* RX FIFO at least half full */
+#define UART_CSR_RXFULL (1 << 3) /* RX FIFO full */
+#define UART_CSR_RXIE   (1 << 4) /* interrupt while NEWDAT, read/write */
+#define UART_CSR_TXIE   (1 << 5) /* interrupt while TXDONE, read/write */
+#define UART_CSR_IE     (UART_CSR_RXIE | UART_CSR_TXIE)
+
+#define UART_DEFAULT_BAUD 115200
+#define UART_DEFAULT_RX_FIFO 16
+#define UART_MAX_RX_FIFO 256
+
+/* Guest visible UART state, for checkpoints. Bytes still buffered on the
+   host side of the pty are not part of it. */
+struct uart_state {
+	uint8_t rx_fifo[UART_MAX_RX_FIFO]; /* oldest first */
+	uint32_t rx_count;
+	uint8_t data_r;
+	uint8_t data_w;
+	uint8_t txdone;
+	uint8_t ie; /* UART_CSR_RXIE and UART_CSR_TXIE */
+	uint64_t tx_when; /* end of the character being sent, or SCHED_NEVER */
+	uint64_t flush_when;
+};
+
+/* clock_hz is the core clock, used to convert the baud rate into a
+   character time in retired instructions */
+extern void uart_init(uint64_t clock_hz, uint32_t baud, uint32_t rx_fifo_depth);
+
+/* Run the UART without a pty instead, for batch jobs: transmitted bytes
+   are stored in buf, at most size of them, and nothing is ever received.
+   Needs buf non-NULL; call in place of uart_init() and uart_start(). */
+extern void uart_init_capture(uint64_t clock_hz, uint32_t baud, char *buf,
+		size_t size);
+
+/* Bytes transmitted since uart_init_capture(), including dropped ones */
+extern size_t uart_captured(void);
+
+/* Connect the UART to the pty and start servicing it */
+extern void uart_start(void);
+
+/* End any wait for input once fd is readable too, for a debugger
+   connection. -1 for none. */
+extern void uart_wake_on(int fd);
 extern uint8_t uart_get_register(uint32_t reg);
 extern void uart_set_register(uint32_t reg, uint8_t value);
 
+/* The harts of one machine share the UART of the thread that initialized
+   it. Accesses must be serialized by the machine's device lock. */
+struct uart;
+extern struct uart *uart_share(void);
+extern void uart_attach(struct uart *shared);
+
+extern void uart_save(struct uart_state *s);
+/* Must be called before uart_start(), which resumes pending transfers */
+extern void uart_restore(const struct uart_state *s);
+
 #endif /* RVSIM_UART_H */